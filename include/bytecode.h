@@ -0,0 +1,21 @@
+// mirror/bytecode.h
+// Provides a compact binary format for compiled programs, which can be loaded straight from memory mapped files without recompiling their graphs
+#ifndef MIRROR_BYTECODE_H
+#define MIRROR_BYTECODE_H
+
+#include "event.h"
+
+// The format consists of a header, holding the format version and the number of slots used by the program, followed by the unique id and signature hash 
+// of each node type used by the program, its constants, and its lines, as node type indices, slot indices and jump targets. Constants are stored as 
+// the bytes of their values, and may therefore only be of trivial types. All integers are little-endian.
+enum { ProgramFormatVersion = 3 };
+
+std::vector<char> SaveProgram(const Program & program);
+
+// Loads a program from a block of memory, such as a memory mapped file, looking up its node types by unique id, other than those of control nodes, which are made from
+// the library's bool and int types. The memory may be released once the program is loaded. Throws if the data is malformed or of a different format version, or if any
+// node type it uses differs in its signature, or in the layout of the types of its pins, from the node type the program was saved with.
+Program LoadProgram(const void * data, size_t size, const TypeLibrary & library, const std::vector<NodeType> & nodeTypes);
+Program LoadProgramFile(const std::string & path, const TypeLibrary & library, const std::vector<NodeType> & nodeTypes);
+
+#endif
\ No newline at end of file
@@ -1,23 +1,86 @@
 #include "event.h"
+#include "pool.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
 #include <sstream>
 
 struct NodeType::Impl
 {
+    NodeType::Kind kind;
+    const Function * function;
+    const Type * type;
     std::string uniqueId, label;
     std::vector<NodeType::Pin> inputs, outputs;
+    std::vector<bool> isOutputConstructed;  // For each output, true if eval constructs a value in the storage provided by the caller, false if eval points the output at an existing object
     bool hasInFlow;
     bool hasOutFlow;
-    std::function<std::vector<std::shared_ptr<void>>(void **)> eval;
+    std::vector<std::string> subflows;      // Labels of the nested flows run by control nodes
+    bool isControl;                         // True if eval chooses which line to execute next
+    std::shared_ptr<const Subgraph> subgraph; // The graph which a subgraph node stands for
+    Program body;                           // The program invoked by a subgraph node which is not inlined
+    Eval eval;                              // Evaluates the node, given the context pointer below. A plain function pointer, so that compiled programs can call it directly.
+    const void * context;                   // Data bound to eval, such as the function object of a function node
 };
 
+NodeType::Kind NodeType::GetKind() const { return impl->kind; }
+const Function * NodeType::GetFunction() const { return impl->function; }
+const Type * NodeType::GetClass() const { return impl->type; }
+const Subgraph * NodeType::GetSubgraph() const { return impl->subgraph.get(); }
+bool NodeType::IsInlined() const { return impl->subgraph && impl->body.GetLines().empty(); }
 const std::string & NodeType::GetUniqueId() const { return impl->uniqueId; }
 const std::string & NodeType::GetLabel() const { return impl->label; }
 const std::vector<NodeType::Pin> & NodeType::GetInputs() const { return impl->inputs; }
 const std::vector<NodeType::Pin> & NodeType::GetOutputs() const { return impl->outputs; }
 bool NodeType::HasInFlow() const { return impl->hasInFlow; }
 bool NodeType::HasOutFlow() const { return impl->hasOutFlow; }
+const std::vector<std::string> & NodeType::GetSubflows() const { return impl->subflows; }
+bool NodeType::IsControl() const { return impl->isControl; }
+bool NodeType::IsOutputConstructed(size_t index) const { return impl->isOutputConstructed[index]; }
+void NodeType::Evaluate(void * inputs[], void * outputs[]) const { impl->eval(impl->context, inputs, outputs); }
+
+std::vector<std::shared_ptr<void>> NodeType::Evaluate(void * inputs[]) const
+{
+    // Constructed outputs share a single block of storage, which destroys them once the last of them is released
+    struct Storage
+    {
+        std::vector<const Type *> types;
+        std::vector<std::max_align_t> bytes;
+        std::vector<void *> values;
+        bool isConstructed = false;
+        ~Storage() { if(isConstructed) for(size_t i=0; i<types.size(); ++i) if(types[i]) types[i]->Destruct(values[i]); }
+    };
+    auto storage = std::make_shared<Storage>();
+    std::vector<size_t> offsets;
+    for(size_t i=0; i<impl->outputs.size(); ++i)
+    {
+        offsets.push_back(storage->bytes.size());
+        storage->types.push_back(impl->isOutputConstructed[i] ? impl->outputs[i].type.type : nullptr);
+        if(storage->types[i]) storage->bytes.resize(storage->bytes.size() + (storage->types[i]->size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    }
+    for(size_t i=0; i<impl->outputs.size(); ++i) storage->values.push_back(storage->bytes.data() + offsets[i]);
+
+    // Control nodes take one further output, which receives the jump target
+    size_t target = 0;
+    std::vector<void *> outputs = storage->values;
+    if(impl->isControl) outputs.push_back(&target);
+    Evaluate(inputs, outputs.data());
+    storage->isConstructed = true;
+
+    std::vector<std::shared_ptr<void>> results;
+    for(size_t i=0; i<impl->outputs.size(); ++i)
+    {
+        if(storage->types[i]) results.push_back(std::shared_ptr<void>(storage, storage->values[i]));
+        else results.push_back(std::shared_ptr<void>(outputs[i], [](void *) {})); // Referenced outputs are not owned by the caller
+    }
+    return results;
+}
 
 ////////////////////////
 // Node type creation //
@@ -26,17 +89,20 @@ bool NodeType::HasOutFlow() const { return impl->hasOutFlow; }
 NodeType NodeType::MakeEventNode(std::string name, std::vector<VarType> params)
 {
     auto impl = std::make_shared<Impl>();
+    impl->kind = EventNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
     impl->uniqueId = "event:"+name;
     impl->label = "On "+name;
     for(auto & param : params) impl->outputs.push_back({"", param});
+    impl->isOutputConstructed.resize(params.size(), false);
     impl->hasInFlow = false;
     impl->hasOutFlow = true;
-    size_t count = params.size();   
-    impl->eval = [count](void ** inputs) -> std::vector<std::shared_ptr<void>>
+    impl->context = impl.get();
+    impl->eval = [](const void * context, void ** inputs, void ** outputs)
     { 
-        std::vector<std::shared_ptr<void>> outputs;
-        for(size_t i=0; i<count; ++i) outputs.push_back(std::shared_ptr<void>(inputs[i], [](void *){}));
-        return outputs;
+        const size_t count = reinterpret_cast<const Impl *>(context)->outputs.size();
+        for(size_t i=0; i<count; ++i) outputs[i] = inputs[i];
     };
 
     NodeType n;
@@ -47,13 +113,32 @@ NodeType NodeType::MakeEventNode(std::string name, std::vector<VarType> params)
 NodeType NodeType::MakeFunctionNode(const Function & function)
 {   
     auto impl = std::make_shared<Impl>();
+    impl->kind = FunctionNode;
+    impl->function = &function;
+    impl->type = nullptr;
     std::ostringstream ss; ss << "func:" << function;
     impl->uniqueId = ss.str();
     impl->label = function.GetName();
     for(size_t i=0; i<function.GetParamCount(); ++i) impl->inputs.push_back({function.GetParamName(i), function.GetParamType(i)});
-    if(function.GetReturnType().type->index != typeid(void)) impl->outputs.push_back({"", function.GetReturnType()});
-    if(!function.IsPure()) impl->hasInFlow = impl->hasOutFlow = true;
-    impl->eval = [&function](void ** inputs) { return std::vector<std::shared_ptr<void>>{function.Invoke(inputs)}; };
+    if(function.GetReturnType().type->index != typeid(void))
+    {
+        impl->outputs.push_back({"", function.GetReturnType()});
+        impl->isOutputConstructed.push_back(function.GetReturnType().indirection == VarType::None);
+    }
+    impl->eval = function.thunk; // Function thunks already follow the node calling convention, so they can be called without any adapter
+    impl->context = function.functor.get();
+    impl->hasInFlow = impl->hasOutFlow = !function.IsPure();
+    if(function.IsAsync())
+    {
+        // Asynchronous thunks return a future rather than a value, so evaluating the node waits for the result. Suspendable invocations call the function themselves instead.
+        impl->eval = [](const void * context, void ** inputs, void ** outputs)
+        {
+            auto & function = *reinterpret_cast<const Function *>(context);
+            function.Invoke(inputs, function.GetReturnType().type->index != typeid(void) ? outputs[0] : nullptr);
+        };
+        impl->context = &function;
+        impl->hasInFlow = impl->hasOutFlow = true;
+    }
 
     NodeType n;
     n.impl = impl;
@@ -63,18 +148,21 @@ NodeType NodeType::MakeFunctionNode(const Function & function)
 NodeType NodeType::MakeSplitNode(const Type & type)
 {
     auto impl = std::make_shared<Impl>();
+    impl->kind = SplitNode;
+    impl->function = nullptr;
+    impl->type = &type;
     std::ostringstream ss; ss << "split:" << type;
     impl->uniqueId = ss.str();
     ss.str(""); ss << "split " << type;
     impl->label = ss.str();
     impl->inputs.push_back({"", {&type, false, false, VarType::LValueRef}});
     for(auto & f : type.fields) impl->outputs.push_back({f.identifier, f.type});
+    impl->isOutputConstructed.resize(type.fields.size(), false);
     impl->hasInFlow = impl->hasOutFlow = false;
-    impl->eval = [&type](void ** inputs) 
+    impl->context = &type;
+    impl->eval = [](const void * context, void ** inputs, void ** outputs) 
     {
-        std::vector<std::shared_ptr<void>> outputs; 
-        for(auto & field : type.fields) outputs.push_back(std::shared_ptr<void>(field.accessor(inputs[0]), [](void *){}));
-        return outputs; 
+        for(auto & field : reinterpret_cast<const Type *>(context)->fields) *outputs++ = field.accessor(inputs[0]);
     };
 
     NodeType n;
@@ -85,22 +173,214 @@ NodeType NodeType::MakeSplitNode(const Type & type)
 NodeType NodeType::MakeBuildNode(const Type & type)
 {
     auto impl = std::make_shared<Impl>();
+    impl->kind = BuildNode;
+    impl->function = nullptr;
+    impl->type = &type;
     std::ostringstream ss; ss << "build:" << type;
     impl->uniqueId = ss.str();
     ss.str(""); ss << "build " << type;
     impl->label = ss.str();
     for(auto & f : type.fields) impl->inputs.push_back({f.identifier, f.type});
     impl->outputs.push_back({"", {&type, false, false, VarType::None}});
+    impl->isOutputConstructed.push_back(true);
     impl->hasInFlow = impl->hasOutFlow = false;
-    impl->eval = [&type](void ** inputs) -> std::vector<std::shared_ptr<void>>
+    impl->context = &type;
+    impl->eval = [](const void * context, void ** inputs, void ** outputs)
     {
-        auto output = type.DefConstruct();
+        auto & type = *reinterpret_cast<const Type *>(context);
+        type.DefConstruct(outputs[0]);
         for(auto & field : type.fields)
         {
             assert(field.type.indirection == VarType::None);
-            field.type.type->CopyAssign(field.accessor(output.get()), *inputs++);
+            field.type.type->CopyAssign(field.accessor(outputs[0]), *inputs++);
+        }
+    };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+// Control nodes choose the line to execute next by writing the index of a jump target to the size_t pointed to by the output after their last
+static size_t & Choice(void ** outputs, size_t numOutputs) { return *reinterpret_cast<size_t *>(outputs[numOutputs]); }
+
+NodeType NodeType::MakeBranchNode(const Type & boolType)
+{
+    assert(boolType.index == typeid(bool));
+    auto impl = std::make_shared<Impl>();
+    impl->kind = BranchNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "branch";
+    impl->label = "branch";
+    impl->inputs.push_back({"condition", {&boolType, false, false, VarType::None}});
+    impl->subflows = {"true", "false"};
+    impl->hasInFlow = impl->hasOutFlow = true;
+    impl->isControl = true;
+    impl->context = nullptr;
+    impl->eval = [](const void *, void ** inputs, void ** outputs) { Choice(outputs, 0) = *reinterpret_cast<const bool *>(inputs[0]) ? 0 : 1; };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+NodeType NodeType::MakeLoopNode(const Type & intType)
+{
+    assert(intType.index == typeid(int));
+    auto impl = std::make_shared<Impl>();
+    impl->kind = LoopNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "loop";
+    impl->label = "loop";
+    impl->inputs.push_back({"first", {&intType, false, false, VarType::None}});
+    impl->inputs.push_back({"last", {&intType, false, false, VarType::None}});
+    impl->outputs.push_back({"index", {&intType, false, false, VarType::None}});
+    impl->isOutputConstructed.push_back(true);
+    impl->subflows = {"body"};
+    impl->hasInFlow = impl->hasOutFlow = true;
+    impl->isControl = true;
+    impl->context = nullptr;
+    impl->eval = [](const void *, void ** inputs, void ** outputs)
+    {
+        // Start at the first index, and skip past the body if it is already beyond the last
+        auto & index = *reinterpret_cast<int *>(outputs[0]);
+        index = *reinterpret_cast<const int *>(inputs[0]);
+        Choice(outputs, 1) = index > *reinterpret_cast<const int *>(inputs[1]) ? 0 : 1;
+    };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+NodeType NodeType::MakeJumpNode()
+{
+    auto impl = std::make_shared<Impl>();
+    impl->kind = JumpNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "jump";
+    impl->label = "jump";
+    impl->hasInFlow = impl->hasOutFlow = true;
+    impl->isControl = true;
+    impl->context = nullptr;
+    impl->eval = [](const void *, void **, void ** outputs) { Choice(outputs, 0) = 0; };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+NodeType NodeType::MakeLoopEndNode(const Type & intType)
+{
+    assert(intType.index == typeid(int));
+    auto impl = std::make_shared<Impl>();
+    impl->kind = LoopEndNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "loop end";
+    impl->label = "loop end";
+    impl->inputs.push_back({"index", {&intType, false, false, VarType::None}});
+    impl->inputs.push_back({"last", {&intType, false, false, VarType::None}});
+    impl->outputs.push_back({"index", {&intType, false, false, VarType::None}});
+    impl->isOutputConstructed.push_back(true);
+    impl->hasInFlow = impl->hasOutFlow = true;
+    impl->isControl = true;
+    impl->context = nullptr;
+    impl->eval = [](const void *, void ** inputs, void ** outputs)
+    {
+        // The index is only incremented while it is less than last, so that a loop ending at INT_MAX cannot overflow
+        const int index = *reinterpret_cast<const int *>(inputs[0]);
+        const bool isLast = index >= *reinterpret_cast<const int *>(inputs[1]);
+        *reinterpret_cast<int *>(outputs[0]) = isLast ? index : index+1;
+        Choice(outputs, 1) = isLast ? 1 : 0;
+    };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+// The outputs of the subgraph node whose shared program is running on this thread, which the program's output node writes to. Subgraph nodes may be nested, so each restores the previous outputs.
+static thread_local void ** subgraphOutputs = nullptr;
+
+NodeType NodeType::MakeSubgraphInputNode(std::string name, std::vector<Pin> inputs)
+{
+    auto impl = std::make_shared<Impl>();
+    impl->kind = EventNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "input:"+name;
+    impl->label = name+" inputs";
+    impl->outputs = move(inputs);
+    impl->isOutputConstructed.resize(impl->outputs.size(), false);
+    impl->hasInFlow = false;
+    impl->hasOutFlow = true;
+    impl->context = impl.get();
+    impl->eval = [](const void * context, void ** inputs, void ** outputs)
+    { 
+        const size_t count = reinterpret_cast<const Impl *>(context)->outputs.size();
+        for(size_t i=0; i<count; ++i) outputs[i] = inputs[i];
+    };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+NodeType NodeType::MakeSubgraphOutputNode(std::string name, std::vector<Pin> outputs)
+{
+    auto impl = std::make_shared<Impl>();
+    impl->kind = OutputNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "output:"+name;
+    impl->label = name+" outputs";
+    impl->inputs = move(outputs);
+    impl->hasInFlow = true;
+    impl->hasOutFlow = false;
+    impl->context = impl.get();
+    impl->eval = [](const void * context, void ** inputs, void **)
+    {
+        // Values are copied out of the program's frame, which is cleared once it returns, while references are passed on
+        auto & pins = reinterpret_cast<const Impl *>(context)->inputs;
+        assert(subgraphOutputs);
+        for(size_t i=0; i<pins.size(); ++i)
+        {
+            if(pins[i].type.indirection == VarType::None) pins[i].type.type->CopyConstruct(subgraphOutputs[i], inputs[i]);
+            else subgraphOutputs[i] = inputs[i];
         }
-        return {output};
+    };
+
+    NodeType n;
+    n.impl = impl;
+    return n;
+}
+
+NodeType NodeType::MakeSubgraphNode(std::shared_ptr<const Subgraph> subgraph, const std::string & name, std::vector<Pin> inputs, std::vector<Pin> outputs, bool isSequenced, Program body)
+{
+    auto impl = std::make_shared<Impl>();
+    impl->kind = SubgraphNode;
+    impl->function = nullptr;
+    impl->type = nullptr;
+    impl->uniqueId = "subgraph:"+name;
+    impl->label = name;
+    impl->inputs = move(inputs);
+    impl->outputs = move(outputs);
+    for(auto & output : impl->outputs) impl->isOutputConstructed.push_back(output.type.indirection == VarType::None);
+    impl->hasInFlow = impl->hasOutFlow = isSequenced;
+    impl->subgraph = move(subgraph);
+    impl->body = std::move(body);
+    impl->context = impl.get();
+    impl->eval = [](const void * context, void ** inputs, void ** outputs)
+    {
+        auto & impl = *reinterpret_cast<const Impl *>(context);
+        if(impl.body.GetLines().empty()) throw std::runtime_error("Subgraph node must be inlined: "+impl.label);
+        struct Restore { void ** outputs; ~Restore() { subgraphOutputs = outputs; } } restore = {subgraphOutputs};
+        subgraphOutputs = outputs;
+        impl.body.Invoke(inputs, impl.inputs.size());
     };
 
     NodeType n;
@@ -114,85 +394,749 @@ NodeType NodeType::MakeBuildNode(const Type & type)
 
 struct Program::Impl
 {
+    struct Slot { const Type * type; size_t offset; };      // Values constructed by the program are placed at a fixed offset in frame storage. Type is null for slots which refer to constants or existing objects.
+
+    // Lines lowered for execution. Each step calls its node's eval function directly, with the slot lists and destruction requirements of the line resolved ahead of time.
+    struct Step { NodeType::Eval eval; const void * context; const size_t * inputs, * outputs; size_t numInputs, numOutputs; bool hasNontrivialOutputs; const size_t * memoOffsets; const Function * asyncFunction; const size_t * targets; size_t numTargets; };
+
     std::vector<Line>                   lines;              // List of calls to be made
-    std::vector<std::shared_ptr<void>>  constants;          // Program constants, which occupy the first set of temporary slots
-    size_t                              numTemporarySlots;  // Total number of temporary slots needed
+    std::vector<Step>                   steps;              // For each line, the step which executes it
+    std::vector<std::shared_ptr<void>>  constants;          // Program constants, which occupy the first set of slots, and remain resident for the lifetime of the program
+    std::vector<Slot>                   slots;              // Layout of every slot used by the program
+    uint64_t                            id;                 // Unique identifier, which lets an execution context recognize the program it is bound to without holding a reference to it
+    size_t                              frameSize;          // Total number of bytes of storage needed for values constructed by the program
+    size_t                              maxInputs;          // Largest number of inputs read by any line
+    size_t                              maxOutputs;         // Largest number of outputs written by any line, counting the choice written by control lines
+    bool                                hasControlFlow;     // True if any line is a control line, in which case each invocation follows its own path through the lines
+    std::vector<size_t>                 nontrivialSlots;    // Slots which hold non-trivial values, and must therefore be destroyed after each invocation
+    std::vector<size_t>                 memoOffsets;        // For each memoizable line, the offsets in memo storage of a copy of each input, followed by a copy of each output
+    size_t                              memoSize;           // Total number of bytes of memo storage needed by a context which memoizes lines
+
+    // Lines are divided into phases. Each sequenced line forms a phase of its own, which runs alone and in program order, while each run of pure lines between 
+    // them forms a phase whose lines may execute in any order, or concurrently, as long as every line runs after the lines in the same phase it depends on.
+    struct Phase { size_t begin, end; std::vector<size_t> roots; bool isParallel; };
+    std::vector<Phase>                  phases;
+    std::vector<std::vector<size_t>>    dependents;         // For each line, the later lines in its phase which must wait for it
+    std::vector<size_t>                 numDependencies;    // For each line, the number of earlier lines in its phase which it must wait for
 };
 
+static size_t GetSlotAlignment(const Type & type) 
+{ 
+    // A type's alignment always divides its size, so the lowest set bit of the size is a safe alignment
+    const size_t align = type.size & (~type.size + 1);
+    return align && align < alignof(std::max_align_t) ? align : alignof(std::max_align_t);
+}
+
 Program Program::Load(std::vector<std::shared_ptr<void>> constants, std::vector<Line> lines)
 {
-    // Validate that lines only read from previously written slots
+    // Verify the program once, up front, so that execution need not check anything. The program must begin with its only event node, control lines must jump to lines after
+    // the first, and every constant read must be present. Constants are untyped, so they take the type of the first pin which reads them, and later readers must agree.
+    // A program cannot use more slots than it has constants and outputs, which bounds the storage that verification and invocation allocate.
+    size_t numSlots = constants.size(), maxSlots = constants.size();
+    for(const auto & line : lines) maxSlots += line.outputs.size();
+    std::vector<const Type *> constantTypes(constants.size(), nullptr);
     std::vector<bool> isSlotWritten(constants.size(), true);
+    std::vector<const Type *> slotTypes(constants.size(), nullptr);
+    std::vector<size_t> leaders = {0};                          // Lines at which control flow may join, or which follow a control line
     for(const auto & line : lines)
     {
-        // Check inputs
-        for(auto slot : line.inputs)
+        if(line.inputs.size() != line.type.GetInputs().size() || line.outputs.size() != line.type.GetOutputs().size()) throw std::runtime_error("Ill-formed program: Line slot count does not match node type!");
+        if((&line == lines.data()) != (line.type.GetKind() == NodeType::EventNode)) throw std::runtime_error("Ill-formed program: Program must begin with its only event node!");
+        if(line.targets.size() != (!line.type.IsControl() ? 0 : line.type.GetKind() == NodeType::BranchNode ? 2 : 1)) throw std::runtime_error("Ill-formed program: Line target count does not match node type!");
+        for(auto target : line.targets)
         {
-            if(slot >= isSlotWritten.size()) isSlotWritten.resize(slot+1, false);
-            if(!isSlotWritten[slot]) throw std::runtime_error("Ill-formed program: Line reads from slot that has not been written to!");
+            if(target == 0 || target > lines.size()) throw std::runtime_error("Ill-formed program: Line jumps to a line outside of the program!");
+            leaders.push_back(target);
         }
+        if(line.type.IsControl()) leaders.push_back(&line - lines.data() + 1);
 
-        // Mark outputs as written
-        for(auto slot : line.outputs)
+        for(size_t i=0; i<line.inputs.size(); ++i)
         {
+            auto slot = line.inputs[i];
+            if(slot >= maxSlots) throw std::runtime_error("Ill-formed program: Line reads from slot outside of the program!");
+            numSlots = std::max(numSlots, slot+1);
+            if(slot < constants.size())
+            {
+                if(!constants[slot]) throw std::runtime_error("Ill-formed program: Line reads from missing constant!");
+                if(!constantTypes[slot]) constantTypes[slot] = line.type.GetInputs()[i].type.type;
+            }
+        }
+
+        // Slots which hold constructed values are laid out in frame storage, so they must always hold the same type
+        for(size_t i=0; i<line.outputs.size(); ++i)
+        {
+            auto slot = line.outputs[i];
+            if(slot < constants.size()) throw std::runtime_error("Ill-formed program: Line writes to constant slot!");
+            if(slot >= maxSlots) throw std::runtime_error("Ill-formed program: Line writes to slot outside of the program!");
+            numSlots = std::max(numSlots, slot+1);
             if(slot >= isSlotWritten.size()) isSlotWritten.resize(slot+1, false);
+            if(slot >= slotTypes.size()) slotTypes.resize(slot+1, nullptr);
+
+            auto type = line.type.IsOutputConstructed(i) ? line.type.GetOutputs()[i].type.type : nullptr;
+            if(isSlotWritten[slot] && slotTypes[slot] != type) throw std::runtime_error("Ill-formed program: Slot is written with conflicting types!");
             isSlotWritten[slot] = true;
+            slotTypes[slot] = type;
         }
     }
-    // TODO: Validate types (perhaps store written type instead of simply a bool)
+    slotTypes.resize(numSlots, nullptr);
 
+    // Follow every path through the program, tracking the type of value held by each slot, or null if it may not have been written. The program is divided into blocks
+    // at its leaders, and the types held on entry to each block are the types which agree on every path into it. A program without control lines is a single block.
+    std::sort(begin(leaders), end(leaders));
+    leaders.erase(std::unique(begin(leaders), end(leaders)), end(leaders));
+    if(leaders.back() == lines.size()) leaders.pop_back();
+    std::vector<std::vector<const Type *>> entryTypes(leaders.size());
+    std::vector<size_t> worklist;
+    std::vector<bool> isQueued(leaders.size(), false);
+    if(!lines.empty())
+    {
+        entryTypes[0] = constantTypes;
+        entryTypes[0].resize(numSlots, nullptr);
+        worklist.push_back(0);
+    }
+    std::vector<const Type *> slotValueTypes;
+    while(!worklist.empty())
+    {
+        const size_t block = worklist.back();
+        worklist.pop_back();
+        isQueued[block] = false;
+        slotValueTypes = entryTypes[block];
+        const size_t begin = leaders[block], end = block+1 < leaders.size() ? leaders[block+1] : lines.size();
+        for(size_t i=begin; i<end; ++i)
+        {
+            const auto & line = lines[i];
+            for(size_t j=0; j<line.inputs.size(); ++j)
+            {
+                auto type = slotValueTypes[line.inputs[j]];
+                if(!type) throw std::runtime_error("Ill-formed program: Line reads from slot that has not been written to!");
+                if(type != line.type.GetInputs()[j].type.type) throw std::runtime_error("Ill-formed program: Line reads slot holding a value of a different type!");
+            }
+            for(size_t j=0; j<line.outputs.size(); ++j) slotValueTypes[line.outputs[j]] = line.type.GetOutputs()[j].type.type;
+        }
+
+        // Pass the types on to the blocks which may run next
+        auto flowTo = [&](size_t target)
+        {
+            if(target == lines.size()) return;
+            const size_t next = std::lower_bound(leaders.begin(), leaders.end(), target) - leaders.begin();
+            auto & types = entryTypes[next];
+            bool changed = types.empty();
+            if(changed) types = slotValueTypes;
+            else for(size_t j=0; j<numSlots; ++j) if(types[j] && types[j] != slotValueTypes[j]) { types[j] = nullptr; changed = true; }
+            if(changed && !isQueued[next]) { worklist.push_back(next); isQueued[next] = true; }
+        };
+        const auto & last = lines[end-1];
+        for(auto target : last.targets) flowTo(target);
+        if(last.type.GetKind() != NodeType::JumpNode) flowTo(end);
+    }
+
+    static std::atomic<uint64_t> nextId;
     auto impl = std::make_shared<Impl>();
+    impl->id = ++nextId;
     impl->lines = move(lines);
     impl->constants = move(constants);
-    impl->numTemporarySlots = isSlotWritten.size();
+    impl->maxInputs = impl->maxOutputs = 0;
+    impl->hasControlFlow = false;
+    for(auto & line : impl->lines)
+    {
+        impl->maxInputs = std::max(impl->maxInputs, line.inputs.size());
+        impl->maxOutputs = std::max(impl->maxOutputs, line.outputs.size() + (line.type.IsControl() ? 1 : 0));
+        if(line.type.IsControl()) impl->hasControlFlow = true;
+    }
+
+    // Assign a fixed offset in frame storage to every slot which holds a constructed value
+    impl->frameSize = 0;
+    impl->slots.resize(numSlots, {nullptr, 0});
+    for(size_t i=0; i<slotTypes.size(); ++i)
+    {
+        if(!slotTypes[i]) continue;
+        const size_t align = GetSlotAlignment(*slotTypes[i]);
+        impl->frameSize = (impl->frameSize + align - 1) / align * align;
+        impl->slots[i] = {slotTypes[i], impl->frameSize};
+        impl->frameSize += slotTypes[i]->size;
+        if(!slotTypes[i]->IsTrivial()) impl->nontrivialSlots.push_back(i);
+    }
+
+    // Lay out memo storage for pure lines which construct all of their outputs, and whose inputs and outputs are all trivial values, which can be compared and copied bytewise
+    const size_t none = static_cast<size_t>(-1);
+    std::vector<size_t> memoStarts;
+    impl->memoSize = 0;
+    for(auto & line : impl->lines)
+    {
+        memoStarts.push_back(none);
+        const auto & type = line.type;
+        if(type.HasInFlow() || type.HasOutFlow() || type.GetKind() == NodeType::EventNode || type.GetOutputs().empty()) continue;
+        std::vector<const Type *> values;
+        for(auto & pin : type.GetInputs()) values.push_back(pin.type.type);
+        for(size_t i=0; i<type.GetOutputs().size(); ++i) values.push_back(type.IsOutputConstructed(i) ? type.GetOutputs()[i].type.type : nullptr);
+        if(std::any_of(begin(values), end(values), [](const Type * t) { return !t || !t->IsTrivial() || !t->size; })) continue;
+        memoStarts.back() = impl->memoOffsets.size();
+        for(auto t : values)
+        {
+            const size_t align = GetSlotAlignment(*t);
+            impl->memoSize = (impl->memoSize + align - 1) / align * align;
+            impl->memoOffsets.push_back(impl->memoSize);
+            impl->memoSize += t->size;
+        }
+    }
+
+    // Lower each line to a step
+    for(size_t i=0; i<impl->lines.size(); ++i)
+    {
+        const auto & line = impl->lines[i];
+        Impl::Step step = {line.type.impl->eval, line.type.impl->context, line.inputs.data(), line.outputs.data(), line.inputs.size(), line.outputs.size(), false, nullptr, nullptr, line.targets.data(), line.targets.size()};
+        for(auto slot : line.outputs) if(impl->slots[slot].type && !impl->slots[slot].type->IsTrivial()) step.hasNontrivialOutputs = true;
+        if(memoStarts[i] != none) step.memoOffsets = impl->memoOffsets.data() + memoStarts[i];
+        if(line.type.GetFunction() && line.type.GetFunction()->IsAsync()) step.asyncFunction = line.type.GetFunction();
+        impl->steps.push_back(step);
+    }
+
+    // Build the dependency graph within each phase. A line must wait for the lines which last wrote its inputs, and for any earlier lines which read or wrote its outputs.
+    // Outputs which are not constructed, such as fields produced by split nodes, may refer to the storage of the line's inputs, so reading one also counts as 
+    // reading every slot it may refer to. Otherwise a later line which reuses one of those slots could overwrite it while the reference is still being read.
+    const size_t numLines = impl->lines.size();
+    std::vector<size_t> lastWriter(impl->slots.size(), none);
+    std::vector<std::vector<size_t>> readers(impl->slots.size()), referents(impl->slots.size());
+    impl->dependents.resize(numLines);
+    impl->numDependencies.resize(numLines, 0);
+    for(size_t begin=0, end; begin<numLines; begin=end)
+    {
+        auto isPure = [&](size_t i) { return !impl->lines[i].type.HasInFlow() && !impl->lines[i].type.HasOutFlow(); };
+        end = begin+1;
+        if(isPure(begin)) while(end < numLines && isPure(end)) ++end;
+
+        Impl::Phase phase = {begin, end, {}, false};
+        for(size_t i=begin; i<end; ++i)
+        {
+            auto dependOn = [&](size_t j) 
+            { 
+                if(j == none || j < begin || j >= i) return; // Lines in earlier phases have already completed
+                if(!impl->dependents[j].empty() && impl->dependents[j].back() == i) return;
+                impl->dependents[j].push_back(i);
+                ++impl->numDependencies[i];
+            };
+            const auto & line = impl->lines[i];
+            std::vector<size_t> reads;
+            for(auto slot : line.inputs) { reads.push_back(slot); reads.insert(reads.end(), referents[slot].begin(), referents[slot].end()); }
+            std::sort(reads.begin(), reads.end());
+            reads.erase(std::unique(reads.begin(), reads.end()), reads.end());
+            for(auto slot : reads) dependOn(lastWriter[slot]);
+            for(auto slot : line.outputs) { dependOn(lastWriter[slot]); for(auto r : readers[slot]) dependOn(r); }
+            for(auto slot : reads) readers[slot].push_back(i);
+            for(size_t j=0; j<line.outputs.size(); ++j)
+            {
+                const auto slot = line.outputs[j];
+                lastWriter[slot] = i; 
+                readers[slot].clear();
+                if(line.type.IsOutputConstructed(j)) referents[slot].clear();
+                else referents[slot] = reads;
+            }
+            if(impl->numDependencies[i] == 0) phase.roots.push_back(i);
+        }
+
+        // Only phases which contain independent lines can benefit from parallel execution
+        phase.isParallel = phase.roots.size() > 1;
+        for(size_t i=begin; i<end; ++i) if(impl->dependents[i].size() > 1) phase.isParallel = true;
+        impl->phases.push_back(std::move(phase));
+    }
 
     Program p;
     p.impl = impl;
     return p;
 }
 
-#include <iostream>
+static const std::vector<std::shared_ptr<void>> noConstants;
+static const std::vector<Program::Line> noLines;
+const std::vector<std::shared_ptr<void>> & Program::GetConstants() const { return impl ? impl->constants : noConstants; }
+const std::vector<Program::Line> & Program::GetLines() const { return impl ? impl->lines : noLines; }
+size_t Program::GetFrameSize() const { return impl ? impl->frameSize : 0; }
 
-void Program::Invoke(void * programArgs[], size_t argCount) const
+////////////////////////
+// Execution contexts //
+////////////////////////
+
+struct ExecutionContext::Impl
 {
-    if(!impl) return;
+    const Program::Impl *               program;            // Program currently being executed. Not owned, so that binding a context does not touch the reference count shared by all threads invoking the program.
+    uint64_t                            programId;          // Id of the program whose layout the context is currently bound to
+    size_t                              numSlots;           // Number of slots in a single frame
+    size_t                              numFrames;          // Number of invocations which can be executed side by side
+    size_t                              frameStride;        // Size of the storage of a single frame, in units of max_align_t
+    std::vector<void *>                 slots;              // For each frame, address of the object currently held in each slot
+    std::vector<std::max_align_t>       storage;            // For each frame, storage for values constructed by the program
+    std::vector<char>                   isLive;             // For each frame, for each slot, true if it holds a non-trivial value which must be destroyed. Stored as bytes so that lines executing in parallel may update their own outputs.
+    std::vector<void *>                 inputs, outputs;    // Scratch space for the argument lists of a single line
+    std::unique_ptr<std::atomic<size_t>[]> pending;         // For each line, the number of dependencies which have yet to complete during parallel execution
+    bool                                isMemoizing;        // True if lines whose inputs are unchanged since they last ran reuse their previous outputs
+    std::vector<std::max_align_t>       memoStorage;        // Copies of the inputs and outputs of each memoizable line, from the last time it ran
+    std::vector<char>                   isMemoValid;        // For each line, true if its memo storage holds the inputs and outputs of a completed run
+    std::atomic<size_t>                 memoHits, memoMisses;
+    bool                                isProfiling;        // True if each line executed is timed
+    size_t                              maxProfiledCalls;   // Number of calls to record individually
+    uint64_t                            profileProgramId;   // Id of the program the profile was gathered from
+    ProgramProfile                      profile;
+    std::chrono::steady_clock::time_point profileStart;
+    std::unique_ptr<InstanceArena>      arena;              // If non-null, allocates the reflected instances constructed during each invocation
 
-    // Reserve enough space
-    auto slotValues = impl->constants;
-    auto allValues = slotValues;
-    slotValues.resize(impl->numTemporarySlots, nullptr);
-    
-    // Execute lines in order
-    for(auto & line : impl->lines)
+    Impl() : program(), programId(), numSlots(), numFrames(), frameStride(), isMemoizing(), memoHits(), memoMisses(), isProfiling(), maxProfiledCalls(), profileProgramId() {}
+
+    // Prepare to execute the given program, reusing the context's current layout if it is already bound to it
+    void Bind(const Program::Impl & p, size_t frames)
+    {
+        program = &p;
+        if(programId == p.id && numFrames >= frames) return;
+        Layout(p, frames);
+    }
+
+    void Layout(const Program::Impl & p, size_t frames)
     {
-        // Setup arguments list
-        void * args[8];
-        if(&line == impl->lines.data())
+        programId = p.id;
+        numSlots = p.slots.size();
+        numFrames = frames;
+        frameStride = (p.frameSize + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+        storage.resize(frameStride * frames);
+        slots.resize(numSlots * frames);
+        isLive.assign(numSlots * frames, false);
+        inputs.resize(p.maxInputs);
+        outputs.resize(p.maxOutputs);
+        pending.reset(new std::atomic<size_t>[p.lines.size()]);
+        memoStorage.resize((p.memoSize + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+        isMemoValid.assign(p.lines.size(), false);
+        for(size_t f=0; f<frames; ++f)
         {
-            assert(argCount == line.outputs.size());
-            for(size_t i=0; i<argCount; ++i)
+            auto frameSlots = slots.data() + f*numSlots;
+            auto frameStorage = reinterpret_cast<char *>(storage.data() + f*frameStride);
+            for(size_t i=0; i<p.constants.size(); ++i) frameSlots[i] = p.constants[i].get();
+            for(size_t i=p.constants.size(); i<numSlots; ++i) frameSlots[i] = p.slots[i].type ? frameStorage + p.slots[i].offset : nullptr;
+        }
+    }
+
+    void * PrepareOutput(size_t frameBase, size_t slot)
+    {
+        auto type = program->slots[slot].type;
+        if(!type) return nullptr;
+        if(isLive[frameBase+slot])
+        {
+            type->Destruct(slots[frameBase+slot]);
+            isLive[frameBase+slot] = false;
+        }
+        return slots[frameBase+slot];
+    }
+
+    void StoreOutput(size_t frameBase, size_t slot, void * output)
+    {
+        slots[frameBase+slot] = output;
+        auto type = program->slots[slot].type;
+        if(type && !type->IsTrivial()) isLive[frameBase+slot] = true;
+    }
+
+    // Destroy any non-trivial values constructed by the current invocation. Trivial values and references are simply overwritten by the next invocation.
+    void Clear()
+    {
+        for(size_t frameBase=0; frameBase<slots.size(); frameBase += numSlots)
+        {
+            for(auto slot : program->nontrivialSlots)
             {
-                args[i] = programArgs[i];
-                assert(args[i] != nullptr);
+                if(!isLive[frameBase+slot]) continue;
+                program->slots[slot].type->Destruct(slots[frameBase+slot]);
+                isLive[frameBase+slot] = false;
             }
         }
-        else
-        {      
-            for(size_t i=0; i<line.inputs.size(); ++i)
+    }
+
+    // Execute a single step against the frame whose slots begin at frameBase. Load() has verified that every slot a step reads has been written, so no checks are needed.
+    void ExecuteStep(const Program::Impl::Step & step, size_t frameBase, void ** args, void ** outs)
+    {
+        for(size_t i=0; i<step.numInputs; ++i) args[i] = slots[frameBase + step.inputs[i]];
+        EvaluateStep(step, frameBase, args, outs);
+    }
+
+    // Execute the given line, returning the index of the line to execute next. Control lines choose it by writing the index of one of their targets to an extra output.
+    size_t ExecuteLine(size_t line, size_t frameBase, void ** args, void ** outs)
+    {
+        const auto & step = program->steps[line];
+        if(!step.numTargets)
+        {
+            ExecuteStep(step, frameBase, args, outs);
+            return line+1;
+        }
+        size_t choice = step.numTargets;
+        outs[step.numOutputs] = &choice;
+        ExecuteStep(step, frameBase, args, outs);
+        return choice < step.numTargets ? step.targets[choice] : line+1;
+    }
+
+    // Evaluate a step whose argument list has already been gathered. The entry step receives the program's arguments directly.
+    void EvaluateStep(const Program::Impl::Step & step, size_t frameBase, void ** args, void ** outs)
+    {
+        if(isMemoizing && step.memoOffsets)
+        {
+            ExecuteMemoizedStep(step, frameBase, args, outs);
+            return;
+        }
+
+        // Evaluate node, skipping liveness tracking when every output is trivial or refers to an existing object
+        if(!step.hasNontrivialOutputs)
+        {
+            for(size_t i=0; i<step.numOutputs; ++i) outs[i] = slots[frameBase + step.outputs[i]];
+            step.eval(step.context, args, outs);
+            for(size_t i=0; i<step.numOutputs; ++i) slots[frameBase + step.outputs[i]] = outs[i];
+            return;
+        }
+        for(size_t i=0; i<step.numOutputs; ++i) outs[i] = PrepareOutput(frameBase, step.outputs[i]);
+        step.eval(step.context, args, outs);
+        for(size_t i=0; i<step.numOutputs; ++i) StoreOutput(frameBase, step.outputs[i], outs[i]);
+    }
+
+    // Execute a step whose inputs and outputs are all trivial values, reusing the outputs from the last time it ran in this context if its inputs are unchanged.
+    // Lines executing in parallel only touch their own memo storage, so no synchronization is needed beyond the counters.
+    void ExecuteMemoizedStep(const Program::Impl::Step & step, size_t frameBase, void ** args, void ** outs)
+    {
+        const size_t line = &step - program->steps.data();
+        auto memo = reinterpret_cast<char *>(memoStorage.data());
+        auto & inputTypes = program->lines[line].type.GetInputs();
+        auto & outputTypes = program->lines[line].type.GetOutputs();
+        for(size_t i=0; i<step.numOutputs; ++i) outs[i] = slots[frameBase + step.outputs[i]];
+
+        bool isUnchanged = isMemoValid[line] != 0;
+        for(size_t i=0; isUnchanged && i<step.numInputs; ++i) isUnchanged = memcmp(memo + step.memoOffsets[i], args[i], inputTypes[i].type.type->size) == 0;
+        if(isUnchanged)
+        {
+            for(size_t i=0; i<step.numOutputs; ++i) memcpy(outs[i], memo + step.memoOffsets[step.numInputs+i], outputTypes[i].type.type->size);
+            memoHits.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        isMemoValid[line] = false;
+        step.eval(step.context, args, outs);
+        for(size_t i=0; i<step.numInputs; ++i) memcpy(memo + step.memoOffsets[i], args[i], inputTypes[i].type.type->size);
+        for(size_t i=0; i<step.numOutputs; ++i) memcpy(memo + step.memoOffsets[step.numInputs+i], outs[i], outputTypes[i].type.type->size);
+        isMemoValid[line] = true;
+        memoMisses.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Execute the program for frameCount invocations at once. Each line is run for every frame before moving on to the next line, unless the program contains control lines,
+    // in which case the frames may take different paths, and each runs to completion in turn.
+    void Execute(void * programArgs[], size_t argCount, size_t frameCount)
+    {
+        assert(frameCount <= numFrames);
+        assert(program->lines.empty() || argCount == program->lines[0].outputs.size());
+        struct Release { Impl & ctx; ~Release() { ctx.Clear(); } } release = {*this};
+        if(program->steps.empty()) return;
+        if(isProfiling)
+        {
+            ExecuteProfiled(programArgs, argCount, frameCount);
+            return;
+        }
+        for(size_t f=0; f<frameCount; ++f) EvaluateStep(program->steps[0], f*numSlots, programArgs + f*argCount, outputs.data());
+        if(program->hasControlFlow)
+        {
+            for(size_t f=0, frameBase=0; f<frameCount; ++f, frameBase += numSlots)
             {
-                args[i] = slotValues[line.inputs[i]].get();
-                assert(args[i] != nullptr);
+                for(size_t i=1; i<program->steps.size(); ) i = ExecuteLine(i, frameBase, inputs.data(), outputs.data());
             }
+            return;
         }
+        for(auto step = program->steps.data()+1, end = program->steps.data()+program->steps.size(); step != end; ++step)
+        {
+            for(size_t f=0, frameBase=0; f<frameCount; ++f, frameBase += numSlots) ExecuteStep(*step, frameBase, inputs.data(), outputs.data());
+        }
+    }
 
-        // Evalute node
-        auto outputs = line.type.impl->eval(args);
+    // Execute the program as above, timing every call to every line
+    void ExecuteProfiled(void * programArgs[], size_t argCount, size_t frameCount)
+    {
+        if(profileProgramId != programId)
+        {
+            profileProgramId = programId;
+            profile.lines.clear();
+            profile.calls.clear();
+            for(auto & line : program->lines) profile.lines.push_back({line.type, 0, 0, 0});
+        }
+        auto executeTimed = [&](size_t i, size_t f, size_t frameBase)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            size_t next = 1;
+            if(i == 0) EvaluateStep(program->steps[0], frameBase, programArgs + f*argCount, outputs.data());
+            else next = ExecuteLine(i, frameBase, inputs.data(), outputs.data());
+            const auto end = std::chrono::steady_clock::now();
 
-        // Store outputs
-        allValues.insert(end(allValues), begin(outputs), end(outputs));
-        for(size_t i=0; i<line.outputs.size(); ++i)
+            const double duration = std::chrono::duration<double>(end - start).count();
+            auto & line = profile.lines[i];
+            ++line.callCount;
+            line.totalTime += duration;
+            line.maxTime = std::max(line.maxTime, duration);
+            if(profile.calls.size() < maxProfiledCalls) profile.calls.push_back({i, std::chrono::duration<double>(start - profileStart).count(), duration});
+            return next;
+        };
+        if(program->hasControlFlow)
         {
-            slotValues[line.outputs[i]] = outputs[i];
+            for(size_t f=0, frameBase=0; f<frameCount; ++f, frameBase += numSlots)
+            {
+                for(size_t i=0; i<program->steps.size(); ) i = executeTimed(i, f, frameBase);
+            }
+            return;
+        }
+        for(size_t i=0; i<program->steps.size(); ++i)
+        {
+            for(size_t f=0, frameBase=0; f<frameCount; ++f, frameBase += numSlots) executeTimed(i, f, frameBase);
+        }
+    }
+
+    // Execute a single invocation from the given line, until it reaches an asynchronous line whose result is not yet ready. Returns the index of that line, with its result
+    // in pending, or the number of lines if the invocation ran to completion. The program's arguments are only needed when starting from the entry line.
+    size_t ExecuteUntilSuspended(size_t line, void * programArgs[], std::shared_ptr<FutureState> & pending)
+    {
+        while(line < program->steps.size())
+        {
+            const auto & step = program->steps[line];
+            if(line == 0) EvaluateStep(step, 0, programArgs, outputs.data());
+            else if(!step.asyncFunction) { line = ExecuteLine(line, 0, inputs.data(), outputs.data()); continue; }
+            else
+            {
+                for(size_t i=0; i<step.numInputs; ++i) inputs[i] = slots[step.inputs[i]];
+                pending = step.asyncFunction->InvokeAsync(inputs.data());
+                if(!pending->IsReady()) return line;
+                CompleteAsyncStep(step, *pending);
+                pending.reset();
+            }
+            ++line;
         }
-    } 
-}
\ No newline at end of file
+        return line;
+    }
+
+    // Move the result of an asynchronous line into its output slot, or rethrow the exception it completed with
+    void CompleteAsyncStep(const Program::Impl::Step & step, FutureState & result)
+    {
+        if(step.numOutputs == 0) { result.TakeValue(nullptr); return; }
+        auto output = PrepareOutput(0, step.outputs[0]);
+        result.TakeValue(output);
+        StoreOutput(0, step.outputs[0], output);
+    }
+
+    // Execute the program for a single invocation, running independent lines within each phase on the given thread pool
+    void ExecuteParallel(ThreadPool & pool, void * programArgs[], size_t argCount)
+    {
+        assert(program->lines.empty() || argCount == program->lines[0].outputs.size());
+        struct Release { Impl & ctx; ~Release() { ctx.Clear(); } } release = {*this};
+        if(program->hasControlFlow)
+        {
+            // Control lines decide which lines run next, so the program's phases cannot be scheduled ahead of time
+            EvaluateStep(program->steps[0], 0, programArgs, outputs.data());
+            for(size_t i=1; i<program->steps.size(); ) i = ExecuteLine(i, 0, inputs.data(), outputs.data());
+            return;
+        }
+        for(auto & phase : program->phases)
+        {
+            if(!phase.isParallel)
+            {
+                for(size_t i=phase.begin; i<phase.end; ++i)
+                {
+                    if(i == 0) EvaluateStep(program->steps[i], 0, programArgs, outputs.data());
+                    else ExecuteStep(program->steps[i], 0, inputs.data(), outputs.data());
+                }
+                continue;
+            }
+
+            for(size_t i=phase.begin; i<phase.end; ++i) pending[i] = program->numDependencies[i];
+            pool.Run(phase.roots.data(), phase.roots.size(), [this](size_t i, std::vector<size_t> & spawned)
+            {
+                thread_local std::vector<void *> scratch;
+                scratch.resize(program->maxInputs + program->maxOutputs);
+                ExecuteStep(program->steps[i], 0, scratch.data(), scratch.data() + program->maxInputs);
+                for(auto d : program->dependents[i]) if(--pending[d] == 0) spawned.push_back(d);
+            });
+        }
+    }
+};
+
+ExecutionContext::ExecutionContext() : impl(std::make_unique<Impl>()) {}
+ExecutionContext::ExecutionContext(const Program & program) : ExecutionContext() { if(program.impl) impl->Layout(*program.impl, 1); }
+ExecutionContext::ExecutionContext(ExecutionContext && r) : impl(move(r.impl)) {}
+ExecutionContext & ExecutionContext::operator = (ExecutionContext && r) { impl = move(r.impl); return *this; }
+ExecutionContext::~ExecutionContext() {}
+
+void ExecutionContext::SetMemoizing(bool enabled) { impl->isMemoizing = enabled; std::fill(begin(impl->isMemoValid), end(impl->isMemoValid), false); }
+bool ExecutionContext::IsMemoizing() const { return impl->isMemoizing; }
+size_t ExecutionContext::GetMemoHitCount() const { return impl->memoHits; }
+size_t ExecutionContext::GetMemoMissCount() const { return impl->memoMisses; }
+
+void ExecutionContext::SetProfiling(bool enabled, size_t maxCalls)
+{
+    impl->isProfiling = enabled;
+    if(!enabled) return;
+    impl->maxProfiledCalls = maxCalls;
+    impl->profileProgramId = 0;
+    impl->profile = {};
+    impl->profileStart = std::chrono::steady_clock::now();
+}
+bool ExecutionContext::IsProfiling() const { return impl->isProfiling; }
+const ProgramProfile & ExecutionContext::GetProfile() const { return impl->profile; }
+
+void ExecutionContext::SetArenaAllocation(bool enabled, size_t chunkSize) { impl->arena = enabled ? std::make_unique<InstanceArena>(chunkSize) : nullptr; }
+const InstanceArena * ExecutionContext::GetArena() const { return impl->arena.get(); }
+
+///////////////////////
+// Program execution //
+///////////////////////
+
+// Borrows a context owned by the calling thread, for the overloads of Invoke() and InvokeBatch() which do not take a context. 
+// Contexts are reused by later invocations on the same thread, while nested invocations receive a context of their own.
+static thread_local std::vector<std::unique_ptr<ExecutionContext>> threadContexts;
+static thread_local size_t threadContextDepth = 0;
+struct ThreadContext
+{
+    ExecutionContext & context;
+    ThreadContext() : context(Acquire()) {}
+    ~ThreadContext() { --threadContextDepth; }
+    static ExecutionContext & Acquire() { if(threadContextDepth == threadContexts.size()) threadContexts.push_back(std::make_unique<ExecutionContext>()); return *threadContexts[threadContextDepth++]; }
+};
+
+// Makes reflected instances constructed by the calling thread during an invocation come from the context's arena, if it has one, and resets the arena once the invocation returns
+struct ArenaInvocation
+{
+    InstanceArena * arena, * previous;
+    ArenaInvocation(InstanceArena * arena) : arena(arena), previous(arena ? InstanceArena::SetCurrent(arena) : nullptr) {}
+    ~ArenaInvocation() { if(arena) { InstanceArena::SetCurrent(previous); arena->Reset(); } }
+};
+
+void Program::Invoke(void * programArgs[], size_t argCount) const
+{
+    if(!impl) return;
+    ThreadContext thread;
+    Invoke(thread.context, programArgs, argCount);
+}
+
+void Program::Invoke(ExecutionContext & context, void * programArgs[], size_t argCount) const
+{
+    if(!impl) return;
+
+    auto & ctx = *context.impl;
+    ArenaInvocation arena(ctx.arena.get());
+    ctx.Bind(*impl, 1);
+    ctx.Execute(programArgs, argCount, 1);
+}
+
+void Program::InvokeBatch(void * programArgs[], size_t argCount, size_t batchSize) const
+{
+    if(!impl) return;
+    ThreadContext thread;
+    InvokeBatch(thread.context, programArgs, argCount, batchSize);
+}
+
+void Program::InvokeBatch(ExecutionContext & context, void * programArgs[], size_t argCount, size_t batchSize) const
+{
+    if(!impl) return;
+
+    auto & ctx = *context.impl;
+    ArenaInvocation arena(ctx.arena.get());
+
+    // Bind the context to this program with enough frames for one chunk of the batch
+    const size_t chunkSize = std::min<size_t>(batchSize, MaxBatchChunk);
+    ctx.Bind(*impl, chunkSize);
+
+    // Execute the batch one chunk at a time, which bounds the size of the context while still amortizing per-line costs
+    for(size_t i=0; i<batchSize; i += chunkSize)
+    {
+        ctx.Execute(programArgs + i*argCount, argCount, std::min(chunkSize, batchSize-i));
+    }
+}
+
+void Program::InvokeParallel(ThreadPool & pool, void * programArgs[], size_t argCount) const
+{
+    if(!impl) return;
+    ThreadContext thread;
+    InvokeParallel(thread.context, pool, programArgs, argCount);
+}
+
+void Program::InvokeParallel(ExecutionContext & context, ThreadPool & pool, void * programArgs[], size_t argCount) const
+{
+    if(!impl) return;
+
+    auto & ctx = *context.impl;
+    ArenaInvocation arena(ctx.arena.get());
+    ctx.Bind(*impl, 1);
+    ctx.ExecuteParallel(pool, programArgs, argCount);
+}
+
+/////////////////////////////
+// Suspendable invocations //
+/////////////////////////////
+
+struct Invocation::Impl : std::enable_shared_from_this<Invocation::Impl>
+{
+    Program                             program;            // Kept alive until the invocation completes
+    ExecutionContext                    context;            // Holds the invocation's frame while it is suspended
+    size_t                              line;               // Line at which the invocation is suspended
+    std::shared_ptr<FutureState>        pending;            // Result awaited by the suspended line
+    std::function<void()>               onComplete;
+    std::mutex                          mutex;
+    std::condition_variable             completed;
+    bool                                isComplete;
+    std::exception_ptr                  error;
+
+    Impl(const Program & program, std::function<void()> onComplete) : program(program), context(program), line(), onComplete(move(onComplete)), isComplete() {}
+
+    // Run until the next line which must wait, or until the end of the program. A result which becomes ready while its continuation is being registered is taken immediately.
+    void Run(void * programArgs[])
+    {
+        try
+        {
+            auto & ctx = *context.impl;
+            while(true)
+            {
+                if(pending)
+                {
+                    ctx.CompleteAsyncStep(program.impl->steps[line++], *pending);
+                    pending.reset();
+                }
+                line = ctx.ExecuteUntilSuspended(line, programArgs, pending);
+                if(!pending) break;
+                auto self = shared_from_this();
+                if(pending->OnReady([self]() { self->Run(nullptr); })) return;
+            }
+        }
+        catch(...) { error = std::current_exception(); }
+        Finish();
+    }
+
+    void Finish()
+    {
+        if(program.impl) context.impl->Clear();
+        auto callback = move(onComplete);
+        if(callback) callback();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isComplete = true;
+        }
+        completed.notify_all();
+    }
+};
+
+bool Invocation::IsComplete() const
+{
+    if(!impl) return true;
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    return impl->isComplete;
+}
+
+void Invocation::Wait() const
+{
+    if(!impl) return;
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    impl->completed.wait(lock, [this]() { return impl->isComplete; });
+    if(impl->error) std::rethrow_exception(impl->error);
+}
+
+Invocation Program::Start(void * programArgs[], size_t argCount, std::function<void()> onComplete) const
+{
+    Invocation invocation;
+    invocation.impl = std::make_shared<Invocation::Impl>(*this, move(onComplete));
+    if(!impl) { invocation.impl->Finish(); return invocation; }
+
+    auto & ctx = *invocation.impl->context.impl;
+    assert(impl->lines.empty() || argCount == impl->lines[0].outputs.size());
+    ctx.Bind(*impl, 1);
+    invocation.impl->Run(programArgs);
+    return invocation;
+}
@@ -4,35 +4,166 @@
 
 #include "refl.h"
 
+#include <algorithm>
+#include <tuple>
+#include <utility>
+
+class Program;
+struct Subgraph;
+
 class NodeType
 {
     friend class Program;
+    friend class ExecutionContext;
+    typedef void (*Eval)(const void * context, void * inputs[], void * outputs[]);
     struct Impl; std::shared_ptr<const Impl> impl;
 public:
     struct Pin { std::string label; VarType type; };
+    enum Kind { EventNode, FunctionNode, SplitNode, BuildNode, BranchNode, LoopNode, JumpNode, LoopEndNode, SubgraphNode, OutputNode };
 
+    Kind                        GetKind() const;
+    const Function *            GetFunction() const;                                    // (FunctionNode) The function called by the node, null otherwise
+    const Type *                GetClass() const;                                       // (SplitNode, BuildNode) The class which the node takes apart or assembles, null otherwise
+    const Subgraph *            GetSubgraph() const;                                    // (SubgraphNode) The graph which the node stands for, null otherwise
+    bool                        IsInlined() const;                                      // (SubgraphNode) True if compiling a graph replaces the node with the nodes of its subgraph, false if the node calls a shared program
     const std::string &         GetUniqueId() const;
     const std::string &         GetLabel() const;
     const std::vector<Pin> &    GetInputs() const;
     const std::vector<Pin> &    GetOutputs() const;
     bool                        HasInFlow() const;
     bool                        HasOutFlow() const;
+    const std::vector<std::string> & GetSubflows() const;                               // (BranchNode, LoopNode) Labels of the nested flows which the node may run before passing execution on, empty otherwise
+    bool                        IsControl() const;                                      // True if lines of this node type jump to other lines, rather than always continuing with the next line
+    bool                        IsOutputConstructed(size_t index) const;                // True if Evaluate() constructs this output in caller-provided storage, false if it points the output at an existing object
+
+    // Evaluates the node. For each constructed output, outputs[i] must point to uninitialized storage of GetOutputs()[i].type.type->size bytes, 
+    // which will hold the value on return, and which the caller must later destroy. Every other output is overwritten with the address of an existing object.
+    // Control nodes take one further output, pointing to a size_t which receives the index of the line's jump target to take, or the number of targets to continue with the next line.
+    void                        Evaluate(void * inputs[], void * outputs[]) const;
+    std::vector<std::shared_ptr<void>> Evaluate(void * inputs[]) const;                 // Compatibility form of Evaluate(), which returns constructed outputs in storage allocated on the heap. Other outputs are not owned by the caller.
 
     static NodeType             MakeEventNode(std::string name, std::vector<VarType> params);
     static NodeType             MakeFunctionNode(const Function & function);
     static NodeType             MakeSplitNode(const Type & type);
     static NodeType             MakeBuildNode(const Type & type);
+    static NodeType             MakeBranchNode(const Type & boolType);                  // Runs its "true" or "false" flow, depending on its condition, then passes execution on
+    static NodeType             MakeLoopNode(const Type & intType);                     // Runs its "body" flow once for each index from first to last inclusive, then passes execution on. The index may only be read within the body.
+
+    // Node types which declare the interface of a subgraph. The input node is an event node, which begins the subgraph, and whose outputs are the subgraph's inputs.
+    // The output node ends the subgraph, and its inputs are the subgraph's outputs. Output pins which are not references are returned by value.
+    static NodeType             MakeSubgraphInputNode(std::string name, std::vector<Pin> inputs);
+    static NodeType             MakeSubgraphOutputNode(std::string name, std::vector<Pin> outputs);
+
+    // A node which stands for a subgraph, usually made by MakeSubgraphNode() in graph.h, which derives the other arguments from the subgraph. The node takes the pins of
+    // the subgraph's input and output nodes. If body is a program, compiled from the subgraph, then evaluating the node invokes it. Otherwise the node must be inlined.
+    static NodeType             MakeSubgraphNode(std::shared_ptr<const Subgraph> subgraph, const std::string & name, std::vector<Pin> inputs, std::vector<Pin> outputs, bool isSequenced, Program body);
+
+    // Control nodes used by compiled programs, which do not appear in graphs. A jump node always takes its only target. A loop end node reads
+    // the index and last value of a loop, and if the index is less than last, increments it and takes its target, which is the start of the body.
+    static NodeType             MakeJumpNode();
+    static NodeType             MakeLoopEndNode(const Type & intType);
+};
+
+class ExecutionContext;
+class ThreadPool;
+
+// A handle to an invocation started by Program::Start(), which may be suspended while it waits on asynchronous lines. Copies refer to the same invocation.
+class Invocation
+{
+    friend class Program;
+    struct Impl; std::shared_ptr<Impl> impl;
+public:
+    bool IsComplete() const;
+    void Wait() const;                                                                  // Block until the invocation completes, rethrowing any exception thrown by one of its lines
 };
 
+// A Program is immutable once loaded, and may be shared freely between threads. Any number of threads may invoke the same Program
+// concurrently, as long as each uses its own ExecutionContext. The overloads which do not take a context use one owned by the calling 
+// thread. Invocation does not modify the reference counts of the Program or of its node types, so threads do not contend on them.
 class Program
 {
+    friend class ExecutionContext;
+    friend class Invocation;
     struct Impl; std::shared_ptr<const Impl> impl; 
 public:
-    struct Line { NodeType type; std::vector<size_t> inputs, outputs; };
+    struct Line { NodeType type; std::vector<size_t> inputs, outputs, targets; };  // Targets are the indices of the lines which a control line may jump to. The number of lines is a valid target, which ends the program.
 
+    // Verifies and lays out a program, throwing if it is ill-formed, so that invocation need not perform any checks of its own. The first line must be the program's only
+    // event node, and on every path through the program, every line must read slots which earlier lines wrote with values of the types its pins expect. Lines read constants 
+    // by the types of their pins. Control lines must have the number of targets their node type expects, and no line may jump to the first line.
     static Program Load(std::vector<std::shared_ptr<void>> constants, std::vector<Line> lines);
 
-    void Invoke(void * args[], size_t argCount) const;
+    const std::vector<std::shared_ptr<void>> & GetConstants() const;
+    const std::vector<Line> & GetLines() const;
+    size_t GetFrameSize() const;                                                        // Bytes of storage needed by each invocation for values constructed by the program
+
+    enum { MaxBatchChunk = 64 };                                                        // Largest number of invocations which InvokeBatch() executes side by side
+
+    void Invoke(void * args[], size_t argCount) const;                                  // Invoke using a context cached by the calling thread
+    void Invoke(ExecutionContext & context, void * args[], size_t argCount) const;      // Invoke using the given context, binding it to this program if necessary
+
+    // Invoke batchSize times, where args[i*argCount .. i*argCount+argCount-1] are the arguments of invocation i. Lines are executed line-major,
+    // running each line for every invocation in a chunk before moving on to the next, so sequenced side effects are grouped by line rather than by invocation.
+    // Programs with control lines, whose invocations may take different paths, instead run each invocation of a chunk in turn.
+    void InvokeBatch(void * args[], size_t argCount, size_t batchSize) const;
+    void InvokeBatch(ExecutionContext & context, void * args[], size_t argCount, size_t batchSize) const;
+
+    // Invoke once, executing independent pure lines concurrently on the given pool. Sequenced lines still execute one at a time, in order, on the calling thread.
+    // Programs with control lines are executed entirely on the calling thread.
+    void InvokeParallel(ThreadPool & pool, void * args[], size_t argCount) const;
+    void InvokeParallel(ExecutionContext & context, ThreadPool & pool, void * args[], size_t argCount) const;
+
+    // Start a suspendable invocation, which runs on the calling thread until it reaches a line calling an asynchronous function whose result is not yet ready. The invocation
+    // then saves its frame and returns, and resumes on whichever thread completes the result, so that waiting invocations do not occupy threads. Every other form of invocation
+    // blocks on asynchronous lines instead. The invocation owns its own context, and onComplete, which must not throw, is called on the thread which finishes it. Objects
+    // referred to by args must remain valid until then. The invocation keeps the program alive.
+    Invocation Start(void * args[], size_t argCount, std::function<void()> onComplete = nullptr) const;
+};
+
+// Execution statistics gathered by an ExecutionContext with profiling enabled, for the program it is bound to. Times are in seconds.
+struct ProgramProfile
+{
+    struct Line { NodeType type; uint64_t callCount; double totalTime, maxTime; };                // Totals for a single line, counting each frame of a batch as a call
+    struct Call { size_t line; double startTime, duration; };                                   // A single execution of a line, timed from when profiling was enabled
+    std::vector<Line>   lines;                                                                  // For each line of the program
+    std::vector<Call>   calls;                                                                  // The earliest calls, in order, up to the limit given to SetProfiling()
+};
+
+// Owns the slot storage and scratch buffers needed to invoke a Program. A context which is reused across invocations
+// of the same program is only bound once, after which each invocation only resets slots holding non-trivial values.
+// A context does not keep its program alive, and must not be used by more than one thread at a time.
+class ExecutionContext
+{
+    friend class Program;
+    friend class Invocation;
+    struct Impl; std::unique_ptr<Impl> impl;
+public:
+    ExecutionContext();
+    explicit ExecutionContext(const Program & program);
+    ExecutionContext(ExecutionContext && r);
+    ExecutionContext & operator = (ExecutionContext && r);
+    ~ExecutionContext();
+
+    // Opt in to memoization. Pure lines whose inputs and outputs are all trivial values remember the inputs they last ran with in this context, compared
+    // bytewise, and if a later invocation presents the same inputs, reuse their previous outputs rather than running again. Referenced inputs are compared
+    // by the value they refer to. Worthwhile when pure lines are expensive, and depend on event arguments which rarely change between invocations.
+    void SetMemoizing(bool enabled);
+    bool IsMemoizing() const;
+    size_t GetMemoHitCount() const;                                                     // Number of times a memoized line reused its previous outputs
+    size_t GetMemoMissCount() const;                                                    // Number of times a memoized line ran because its inputs had changed
+
+    // Opt in to profiling. Every line executed by Invoke() or InvokeBatch() records its call count and its total and longest duration, and the first maxCalls calls
+    // are also recorded individually, as a timeline. Profiles are discarded when profiling is enabled, or the context is bound to a different program. InvokeParallel()
+    // is not profiled. When profiling is disabled, invocation only checks for it once per call.
+    void SetProfiling(bool enabled, size_t maxCalls = 0);
+    bool IsProfiling() const;
+    const ProgramProfile & GetProfile() const;
+
+    // Opt in to arena allocation. Reflected instances which the invoking thread constructs with Type::Construct() during Invoke(), InvokeBatch() or InvokeParallel(),
+    // such as the results of functions called through Function::Invoke(args), are bump allocated from an arena owned by the context, rather than from their types'
+    // pools, and the arena is reset once the call returns. Instances which outlive the call remain valid. Lines run on other threads by InvokeParallel() are unaffected.
+    void SetArenaAllocation(bool enabled, size_t chunkSize = 4096);
+    const InstanceArena * GetArena() const;                                             // The context's arena, or null if arena allocation is disabled
 };
 
 template<class F> class Event;
@@ -45,9 +176,61 @@ public:
 
     void operator()(P... p) const
     {
-        void * args[] = {&p...};
+        void * args[sizeof...(P) ? sizeof...(P) : 1] = {&p...};
         program.Invoke(args, sizeof...(P));
     }
+
+    void operator()(ExecutionContext & context, P... p) const
+    {
+        void * args[sizeof...(P) ? sizeof...(P) : 1] = {&p...};
+        program.Invoke(context, args, sizeof...(P));
+    }
+
+    // Invoke for every tuple of arguments in tuples[0..count-1]
+    void InvokeBatch(std::tuple<P...> tuples[], size_t count) const                                         { WithBatches(count, [=](size_t i, void ** args) { GatherArgs(tuples[i], args, std::index_sequence_for<P...>()); }, [this](void ** args, size_t n) { program.InvokeBatch(args, sizeof...(P), n); }); }
+    void InvokeBatch(ExecutionContext & context, std::tuple<P...> tuples[], size_t count) const             { WithBatches(count, [=](size_t i, void ** args) { GatherArgs(tuples[i], args, std::index_sequence_for<P...>()); }, [&](void ** args, size_t n) { program.InvokeBatch(context, args, sizeof...(P), n); }); }
+
+    // Invoke count times, where invocation i receives element i of each column
+    void InvokeBatch(size_t count, std::remove_reference_t<P> *... columns) const                           { WithBatches(count, [=](size_t i, void ** args) { (void)i; void * row[sizeof...(P) ? sizeof...(P) : 1] = {(columns+i)...}; std::copy(row, row+sizeof...(P), args); }, [this](void ** args, size_t n) { program.InvokeBatch(args, sizeof...(P), n); }); }
+    void InvokeBatch(ExecutionContext & context, size_t count, std::remove_reference_t<P> *... columns) const { WithBatches(count, [=](size_t i, void ** args) { (void)i; void * row[sizeof...(P) ? sizeof...(P) : 1] = {(columns+i)...}; std::copy(row, row+sizeof...(P), args); }, [&](void ** args, size_t n) { program.InvokeBatch(context, args, sizeof...(P), n); }); }
+
+    void InvokeParallel(ThreadPool & pool, P... p) const
+    {
+        void * args[sizeof...(P) ? sizeof...(P) : 1] = {&p...};
+        program.InvokeParallel(pool, args, sizeof...(P));
+    }
+
+    void InvokeParallel(ExecutionContext & context, ThreadPool & pool, P... p) const
+    {
+        void * args[sizeof...(P) ? sizeof...(P) : 1] = {&p...};
+        program.InvokeParallel(context, pool, args, sizeof...(P));
+    }
+
+    // Start a suspendable invocation, as Program::Start(). Arguments passed by value are kept alive until the invocation completes, while referenced objects must outlive it.
+    Invocation Start(P... p) const { return Start(nullptr, std::forward<P>(p)...); }
+    Invocation Start(std::function<void()> onComplete, P... p) const
+    {
+        auto tuple = std::make_shared<std::tuple<P...>>(std::forward<P>(p)...);
+        void * args[sizeof...(P) ? sizeof...(P) : 1];
+        GatherArgs(*tuple, args, std::index_sequence_for<P...>());
+        return program.Start(args, sizeof...(P), [tuple, onComplete]() { if(onComplete) onComplete(); });
+    }
+
+    ExecutionContext CreateContext() const { return ExecutionContext(program); }
+private:
+    template<size_t... I> static void GatherArgs(std::tuple<P...> & tuple, void ** args, std::index_sequence<I...>) { void * row[sizeof...(P) ? sizeof...(P) : 1] = {&std::get<I>(tuple)...}; std::copy(row, row+sizeof...(P), args); }
+
+    // Gathers the arguments of up to MaxBatchChunk invocations at a time, and passes them to invoke
+    template<class G, class I> static void WithBatches(size_t count, G gather, I invoke)
+    {
+        void * args[Program::MaxBatchChunk * (sizeof...(P) ? sizeof...(P) : 1)];
+        for(size_t i=0; i<count; i += Program::MaxBatchChunk)
+        {
+            const size_t n = std::min<size_t>(count - i, Program::MaxBatchChunk);
+            for(size_t j=0; j<n; ++j) gather(i+j, args + j*sizeof...(P));
+            invoke(args, n);
+        }
+    }
 };
 
 #endif
\ No newline at end of file
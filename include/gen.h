@@ -0,0 +1,22 @@
+// mirror/gen.h
+// Provides a generator of random but well-formed graphs, which can be used to test and benchmark loading, compiling and invoking graphs at scale
+#ifndef MIRROR_GEN_H
+#define MIRROR_GEN_H
+
+#include "graph.h"
+
+enum GraphShape
+{
+    DeepChain,                                                      // Nodes read the most recent outputs, forming long chains of dependencies
+    WideFanOut,                                                     // Nodes read the earliest outputs, so that a few outputs have a great many readers, and every other output is read at least once
+    Diamonds,                                                       // Nodes read from a small window of recent outputs, so that paths repeatedly split and rejoin
+    FlowSequence                                                    // Most nodes are sequenced, forming one long flow sequence, and read outputs from anywhere before them
+};
+
+// Generates a graph of numNodes nodes, whose first node is an instance of eventType, and is therefore suitable for Compile(nodes, 0). Every other node is an instance of
+// one of nodeTypes, excluding event, output and control nodes, and every input is either wired to an earlier output of the same type, or given an immediate if it is an int or float. Sequenced
+// nodes are placed regularly, and read recent outputs, so that most pure nodes are compiled. The same seed produces the same graph, given the same standard library.
+// Throws if no node type can be placed, or if the shape is FlowSequence and no sequenced node type can be placed.
+std::vector<Node> GenerateGraph(const NodeType & eventType, const std::vector<NodeType> & nodeTypes, GraphShape shape, size_t numNodes, unsigned seed);
+
+#endif
\ No newline at end of file
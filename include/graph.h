@@ -16,18 +16,124 @@ struct Node
     NodeType            type;                                       // The type of this node
     std::vector<Wire>   inputs;                                     // Wires which carry data from other nodes' outputs to this node's inputs
     int                 flowOutputIndex;                            // Flow control wire which passes execution from this node to another node after it is run
+    std::vector<int>    subflowIndices;                             // For control nodes, flow control wires to the first node of each subflow, such as the arms of a branch or the body of a loop, which run before flowOutputIndex
 
     int                 x,y;                                        // A set of coordinates, provided for visualization/editing convenience. Has no effect on execution, but will be serialized to/from JSON.
     bool                selected;                                   // A selection flag, provided for visualization/editing convenience. Has no effect on execution, and will not be serialized to/from JSON.
 
                         Node()                                      : type(), flowOutputIndex(-1), x(), y(), selected() {}
-                        Node(const NodeType & type, int x, int y)   : type(type), inputs(type.GetInputs().size(), {-1,-1}), flowOutputIndex(-1), x(x), y(y), selected() {}
+                        Node(const NodeType & type, int x, int y)   : type(type), inputs(type.GetInputs().size(), {-1,-1}), flowOutputIndex(-1), subflowIndices(type.GetSubflows().size(), -1), x(x), y(y), selected() {}
 };
 
+// A graph which other graphs may use as a single node. Its interface is declared by its input and output nodes, whose node types are made by 
+// NodeType::MakeSubgraphInputNode() and MakeSubgraphOutputNode(). If the input node has a flow wire, the subgraph is sequenced, and the flow
+// from its input node must reach its output node. Otherwise the subgraph is pure, and may only contain pure nodes.
+struct Subgraph
+{
+    std::string         name;                                       // Names the node type which stands for the subgraph, as "subgraph:"+name
+    std::vector<Node>   nodes;
+    int                 inputIndex, outputIndex;                    // Indices of the subgraph's input and output nodes
+};
+
+enum SubgraphLinkage
+{
+    InlineSubgraph,                                                 // Compiling a graph replaces each node which stands for the subgraph with a copy of its nodes, so that calls cost nothing at runtime
+    SharedSubgraph                                                  // The subgraph is compiled once, into a program which is invoked by each of its nodes, so that its lines are not repeated
+};
+
+// Makes the node type which stands for a subgraph, and which takes the inputs and outputs declared by the subgraph's input and output nodes. Subgraphs may use the nodes
+// of other subgraphs. Throws if the subgraph is ill-formed, or, for shared subgraphs, does not compile.
+NodeType MakeSubgraphNode(Subgraph subgraph, SubgraphLinkage linkage = InlineSubgraph);
+
+struct CompileStats
+{
+    size_t              numLines;                                   // Number of lines in the compiled program
+    size_t              numEmittedLines;                            // Number of lines emitted by the compile, before folding. An incremental recompile only emits lines from the first step of the flow affected by an edit.
+    size_t              numConstants;                               // Number of constants held by the compiled program, including folded results
+    size_t              numFoldedLines;                             // Number of lines evaluated at compile time and removed from the program
+    size_t              numReusedFoldedLines;                       // Number of folded lines whose outputs were reused from an earlier compile, rather than evaluated again
+    size_t              numMergedNodes;                             // Number of pure nodes which were merged with an identical node
+    size_t              numInlinedNodes;                            // Number of subgraph nodes which were replaced by the nodes of their subgraphs, including nested subgraph nodes
+    size_t              numSlotsBeforeAllocation;                   // Number of slots if every node output were given a slot of its own
+    size_t              numSlotsAfterAllocation;                    // Number of slots once slots whose values are no longer needed are reused
+    size_t              frameSize;                                  // Bytes of storage needed by each invocation for values constructed by the program
+    std::vector<int>    lineNodes;                                  // For each line of the compiled program, the index of the node it was compiled from. Lines compiled from an inlined subgraph refer to its subgraph node.
+};
+
+// Compiles the event handler starting at the given node. Each node may be reached by only one flow wire. The subflows of control nodes are compiled to jumps, and the
+// outputs of nodes within a subflow, such as the index of a loop, may only be read within it, as they are not written on every path through the program. Inlined
+// subgraph nodes are replaced by the nodes of their subgraphs before compiling, so that each use of a subgraph is compiled, and optimized, along with its surroundings.
 Program Compile(const std::vector<Node> & nodes, int startIndex);
+Program Compile(const std::vector<Node> & nodes, int startIndex, CompileStats & stats);
+
+// Holds up to a fixed number of compiled programs, keyed by the content of the subgraph reachable from the start node, which is made up of the
+// unique ids of node types, wires, immediates, flow links, and subflows. Compile() returns a cached program if an identical subgraph has been compiled 
+// before, even if node indices differ, and evicts the least recently used program once full. Node types are identified by their unique ids, and
+// subgraph nodes also by their linkage and the content of their subgraphs, so a cache should not be shared between type libraries. May be used from several threads at once.
+class ProgramCache
+{
+    struct Impl; std::unique_ptr<Impl> impl;
+public:
+    explicit            ProgramCache(size_t capacity);
+                        ~ProgramCache();
+
+    Program             Compile(const std::vector<Node> & nodes, int startIndex);
+    void                Clear();
+
+    size_t              GetCapacity() const;
+    size_t              GetSize() const;                            // Number of programs currently cached
+    size_t              GetHitCount() const;                        // Number of calls to Compile() which returned a cached program
+    size_t              GetMissCount() const;                       // Number of calls to Compile() which compiled a new program
+};
+
+// Owns a graph, and recompiles the event handler starting at a given node as the graph is edited. Edits to nodes which the handler does not 
+// reach do not cause a recompile, and pure nodes which were evaluated at compile time are only evaluated again if they are downstream of an edit.
+// The compiler's state is kept between compiles, so that an edit to an immediate or a wire only updates the slots of the nodes downstream of it, 
+// and only emits again the lines from the first step of the handler's flow which runs an affected node. Edits to flow links and subflows, and graphs 
+// which use inlined subgraphs, are compiled afresh. Programs are immutable, so each recompile produces a new Program, while programs returned earlier 
+// remain valid and unchanged. Only emission is incremental: constant folding (which reuses the values of unaffected nodes), slot allocation and loading 
+// still run over every line of each recompile, so its cost remains proportional to the size of the handler. The "compile/incremental" and 
+// "compile/full" rows of the microbenchmarks compare the two.
+class IncrementalCompiler
+{
+    struct Impl; std::unique_ptr<Impl> impl;
+public:
+                        IncrementalCompiler(std::vector<Node> nodes, int startIndex);
+                        ~IncrementalCompiler();
+
+    const std::vector<Node> & GetNodes() const;
+    const CompileStats & GetStats() const;                          // Statistics from the most recent compile
+    size_t              GetCompileCount() const;                    // Number of times the program has been compiled
+
+    int                 AddNode(Node node);                         // Returns the index of the new node
+    void                SetImmediate(int nodeIndex, int pinIndex, std::string immediate);
+    void                SetWire(int nodeIndex, int pinIndex, int sourceNodeIndex, int sourcePinIndex);
+    void                SetFlow(int nodeIndex, int nextNodeIndex);
+    void                SetSubflow(int nodeIndex, int subflowIndex, int firstNodeIndex);
+
+    Program             GetProgram();                               // Returns the program for the current graph, recompiling it if an edit may have changed it
+};
+
+// Generates the C++ source of a function which performs the same calls as Compile(nodes, startIndex), in the same order, calling bound functions directly. Every subgraph is inlined.
+// Functions are called by the names they were bound under, and types are spelled with the names of bound classes, so those names must be visible to the generated code.
+// Bound names made of operator characters, such as "+", are emitted as operators. Parameters named "this" are used as the object of a method call.
+std::string TranspileGraph(const std::vector<Node> & nodes, int startIndex, const std::string & functionName);
+
+// Creates a program which passes the arguments of an event to a single function, such as one produced by TranspileGraph() and bound to a TypeLibrary
+Program CompileFunction(const NodeType & eventType, const Function & function);
 
 class JsonValue;
 JsonValue SaveGraph(const std::vector<Node> & nodes);
 std::vector<Node> LoadGraph(const std::vector<NodeType> & nodeTypes, const JsonValue & jsonGraph);
 
+// Subgraphs are saved as their name, nodes, and the indices of their input and output nodes. Graphs refer to subgraphs by the unique ids of their node types, 
+// so a subgraph must be loaded, and its node type made with MakeSubgraphNode() and added to nodeTypes, before loading graphs which use it.
+JsonValue SaveSubgraph(const Subgraph & subgraph);
+Subgraph LoadSubgraph(const std::vector<NodeType> & nodeTypes, const JsonValue & jsonSubgraph);
+
+// Export a profile gathered by an ExecutionContext, with each line attributed to the node it was compiled from, as given by CompileStats::lineNodes. SaveProfile() 
+// produces the totals for each line, while SaveChromeTrace() produces the individually recorded calls in the Trace Event Format read by chrome://tracing.
+JsonValue SaveProfile(const ProgramProfile & profile, const std::vector<int> & lineNodes);
+JsonValue SaveChromeTrace(const ProgramProfile & profile, const std::vector<int> & lineNodes);
+
 #endif
\ No newline at end of file
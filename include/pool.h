@@ -0,0 +1,30 @@
+// mirror/pool.h
+// Provides a work-stealing thread pool, which can be used to execute independent lines of a Program in parallel
+#ifndef MIRROR_POOL_H
+#define MIRROR_POOL_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+class ThreadPool
+{
+    struct Impl; std::unique_ptr<Impl> impl;
+public:
+    typedef std::function<void(size_t task, std::vector<size_t> & spawned)> TaskFunction;
+
+    explicit                ThreadPool(size_t numWorkers);                  // Creates a pool with numWorkers background threads. The thread calling Run() also executes tasks.
+                            ThreadPool(const ThreadPool &) = delete;
+                            ~ThreadPool();
+
+    ThreadPool &            operator = (const ThreadPool &) = delete;
+
+    size_t                  GetWorkerCount() const;
+
+    // Executes the root tasks, and any tasks they spawn, returning once all of them have completed. execute() is called once for each task, on any thread, 
+    // and may append newly ready tasks to spawned. These are queued on the calling worker, from which idle workers may steal them. If a task throws, no 
+    // further tasks are executed, and the exception is rethrown by Run(). Only one thread may call Run() on a given pool at a time.
+    void                    Run(const size_t roots[], size_t rootCount, const TaskFunction & execute);
+};
+
+#endif
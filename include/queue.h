@@ -0,0 +1,63 @@
+// mirror/queue.h
+// Provides a queued dispatch mode for events, in which producers on any thread post events to a lock-free ring buffer, and worker threads invoke the program in batches
+#ifndef MIRROR_QUEUE_H
+#define MIRROR_QUEUE_H
+
+#include "event.h"
+
+class EventQueue
+{
+    struct Impl; std::unique_ptr<Impl> impl;
+public:
+    enum Backpressure
+    {
+        Block,                                                      // Post() waits for a worker to free space in the queue
+        Reject                                                      // Post() returns false without queueing the event
+    };
+
+    struct Stats
+    {
+        size_t              capacity;                               // Number of events the queue can hold
+        size_t              depth;                                  // Number of events posted which have not yet been taken by a worker
+        size_t              maxDepth;                               // Largest depth observed by Post()
+        uint64_t            posted, rejected;                       // Number of events queued, and turned away by a full queue
+        uint64_t            dispatched, failed, batches;            // Number of events invoked, those in batches which threw, and the number of batches
+        double              meanLatency, maxLatency;                // Seconds from Post() until the batch holding the event finished executing
+    };
+
+    // Creates a queue of at least capacity events, rounded up to a power of two no less than two, which is drained by numWorkers threads, each of which invokes the program with its
+    // own context, in batches of up to Program::MaxBatchChunk events. A single worker dispatches events in the order they were posted; several may not.
+    EventQueue(Program program, size_t capacity, size_t numWorkers, Backpressure backpressure = Block);
+    EventQueue(const EventQueue &) = delete;
+    ~EventQueue();                                                  // Dispatches any events still queued, then stops the workers. No thread may be posting events.
+
+    EventQueue & operator = (const EventQueue &) = delete;
+
+    // Copy the arguments of an event into the queue, using the reflected copy constructors of the event's parameter types, or their move constructors if moveArgs is
+    // true. Parameters passed by reference are queued as references, and the objects they refer to must outlive the dispatch of the event. Safe to call from any thread.
+    bool                    Post(void * args[], size_t argCount, bool moveArgs = false);
+
+    // Wait until every event posted before the call has been dispatched, rethrowing the first exception thrown by a batch since the last call to Flush()
+    void                    Flush();
+    Stats                   GetStats() const;
+};
+
+template<class F> class QueuedEvent;
+template<class... P> class QueuedEvent<void(P...)>
+{
+    EventQueue queue;
+public:
+    QueuedEvent(Program program, size_t capacity, size_t numWorkers, EventQueue::Backpressure backpressure = EventQueue::Block) : queue(program, capacity, numWorkers, backpressure) {}
+
+    // Queue an event, returning false if it was rejected by a full queue. The arguments are this call's own copies, so they are moved into the queue.
+    bool operator()(P... p)
+    {
+        void * args[sizeof...(P) ? sizeof...(P) : 1] = {&p...};
+        return queue.Post(args, sizeof...(P), true);
+    }
+
+    void Flush() { queue.Flush(); }
+    EventQueue::Stats GetStats() const { return queue.GetStats(); }
+};
+
+#endif
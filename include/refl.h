@@ -3,15 +3,22 @@
 #ifndef MIRROR_REFL_H
 #define MIRROR_REFL_H
 
+#include <atomic>
 #include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <vector>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <typeindex>
 #include <string>
 #include <ostream>
 #include <list>
 #include <map>
+#include <new>
+#include <utility>
 
 template<class... T> struct Tag {}; // A trivial empty struct differentiated only by a type list. Can be used to easily pass specific type information for use in overload selection.
 
@@ -28,11 +35,12 @@ struct VarType
 
 struct NontrivialOps
 {
-    std::function<std::shared_ptr<void>(            )> defConstruct;
-    std::function<std::shared_ptr<void>(const void *)> copyConstruct;
-    std::function<std::shared_ptr<void>(      void *)> moveConstruct;
+    std::function<void(void*            )>             defConstruct;
+    std::function<void(void*,const void*)>             copyConstruct;
+    std::function<void(void*,      void*)>             moveConstruct;
     std::function<void(void*,const void*)>             copyAssign;
     std::function<void(void*,void*)>                   moveAssign;
+    void                                             (*destruct)(void*) = nullptr;  // A plain function, so that instances may be destroyed after their type
 
     template<class C> NontrivialOps(Tag<C>)
     {
@@ -41,23 +49,116 @@ struct NontrivialOps
         SetupMoveConstruct<C>(std::is_move_constructible<C>());
         SetupCopyAssign<C>(std::is_copy_assignable<C>());
         SetupMoveAssign<C>(std::is_move_assignable<C>());
+        SetupDestruct<C>(std::is_destructible<C>());
     }
 private:
-    template<class C> void SetupDefConstruct (std::true_type) { defConstruct  = [](              ) { return std::make_shared<C>(                                          ); }; } 
-    template<class C> void SetupCopyConstruct(std::true_type) { copyConstruct = [](const void * r) { return std::make_shared<C>(          *reinterpret_cast<const C *>(r) ); }; }
-    template<class C> void SetupMoveConstruct(std::true_type) { moveConstruct = [](      void * r) { return std::make_shared<C>(std::move(*reinterpret_cast<      C *>(r))); }; }
+    template<class C> void SetupDefConstruct (std::true_type) { defConstruct  = [](void * l                ) { new(l) C(                                          ); }; } 
+    template<class C> void SetupCopyConstruct(std::true_type) { copyConstruct = [](void * l, const void * r) { new(l) C(          *reinterpret_cast<const C *>(r) ); }; }
+    template<class C> void SetupMoveConstruct(std::true_type) { moveConstruct = [](void * l,       void * r) { new(l) C(std::move(*reinterpret_cast<      C *>(r))); }; }
     template<class C> void SetupCopyAssign   (std::true_type) { copyAssign = [](void * l, const void * r) { *reinterpret_cast<C *>(l) =           *reinterpret_cast<const C *>(r);  }; }
     template<class C> void SetupMoveAssign   (std::true_type) { moveAssign = [](void * l,       void * r) { *reinterpret_cast<C *>(l) = std::move(*reinterpret_cast<      C *>(r)); }; }
+    template<class C> void SetupDestruct     (std::true_type) { destruct = [](void * l) { reinterpret_cast<C *>(l)->~C(); }; }
     template<class C> void SetupDefConstruct (std::false_type) {}
     template<class C> void SetupCopyConstruct(std::false_type) {}
     template<class C> void SetupMoveConstruct(std::false_type) {}
     template<class C> void SetupCopyAssign   (std::false_type) {}
     template<class C> void SetupMoveAssign   (std::false_type) {}  
+    template<class C> void SetupDestruct     (std::false_type) {}  
+};
+
+// A free list of equally sized blocks, from which Type::Construct() allocates each instance of a type together with its reference count. Released blocks are
+// kept for later instances, rather than returned to the global allocator, until the pool is trimmed or destroyed. Each thread which uses the pool allocates
+// from and releases to a cache of its own without locking, exchanging blocks with a list shared by all threads in batches. May be used from several threads at once.
+class InstancePool
+{
+    struct Block { Block * next; };
+    struct Shared; struct ThreadCache;
+    std::shared_ptr<Shared>             shared;                     // Shared with the caches of every thread which has used the pool, and kept alive by live blocks once the pool is destroyed
+    static ThreadCache *                GetThreadCache(Shared & shared, bool create); // The calling thread's cache for the pool, or null if it has none, or the thread is exiting
+    static void                         Release(Shared & shared, void * block);
+    void *                              Refill(ThreadCache * cache, size_t size);
+    static void                         Spill(ThreadCache & cache);
+public:
+    enum                                { MaxCachedBlocks = 64 };   // A thread's cache returns half of its blocks to the shared list once it holds more than this
+
+    struct Stats
+    {
+        size_t                          blockSize;                  // Size of each block, including the instance's reference count, or zero if no block has been allocated
+        size_t                          allocatedBlocks;            // Number of blocks obtained from the global allocator
+        size_t                          reusedBlocks;               // Number of allocations served by a block which had been released earlier
+        size_t                          liveBlocks;                 // Number of blocks currently holding an instance
+        size_t                          freeBlocks;                 // Number of released blocks held for reuse, by the shared list or by threads' caches
+    };
+
+    // Refers to the state of a pool, which each live block keeps alive, so that a block may be released after the pool has been destroyed, in which case it is returned to the global allocator
+    class Owner
+    {
+        friend class InstancePool;
+        Shared *                        shared;
+                                        Owner(Shared * shared)      : shared(shared) {}
+    public:
+        void                            Release(void * block) const { InstancePool::Release(*shared, block); }
+        bool                            operator == (const Owner & r) const { return shared == r.shared; }
+    };
+
+                                        InstancePool();
+                                        InstancePool(const InstancePool &) = delete;
+                                        ~InstancePool();
+
+    void *                              Allocate(size_t size);      // Every allocation from a pool must be of the same size. Blocks are aligned to max_align_t.
+    void                                Release(void * block)       { Release(*shared, block); } // Blocks may be released on any thread, and after the pool has been destroyed
+    Owner                               GetOwner() const            { return shared.get(); }
+    void                                Trim();                     // Return the blocks in the shared list, and in the calling thread's cache, to the global allocator
+    Stats                               GetStats() const;           // Counts are approximate while other threads are using the pool
+};
+
+// Bump allocates instances from large chunks, for instances which are constructed by Type::Construct() on a thread while a Scope for the arena is active, and which
+// are usually released shortly after. Reset() reclaims every chunk whose instances have all been released, for reuse by later allocations, while chunks holding
+// instances which are still alive are handed off, and freed along with the last of them. Instances may be released on any thread, but the arena itself must only
+// be used by one thread at a time.
+class InstanceArena
+{
+    struct Chunk; struct Block;
+    std::vector<Chunk *>                chunks;                     // Chunks owned by the arena. Those before current are full, those after are empty.
+    size_t                              current, offset;            // Index of the chunk being allocated from, and offset of its next block
+    size_t                              chunkSize;
+    size_t                              numAllocatedChunks, numInstances, numResets;
+public:
+    struct Stats
+    {
+        size_t                          chunkSize;
+        size_t                          allocatedChunks;            // Number of chunks obtained from the global allocator
+        size_t                          ownedChunks;                // Number of chunks currently owned by the arena
+        size_t                          instances;                  // Number of instances allocated from the arena
+        size_t                          resets;
+    };
+
+    // Makes Type::Construct() allocate from the given arena on the calling thread until destroyed, restoring the previously active arena, if any
+    class Scope
+    {
+        InstanceArena *                 previous;
+    public:
+        explicit                        Scope(InstanceArena & arena) : previous(SetCurrent(&arena)) {}
+                                        Scope(const Scope &) = delete;
+                                        ~Scope()                    { SetCurrent(previous); }
+    };
+
+    explicit                            InstanceArena(size_t chunkSize = 4096);
+                                        InstanceArena(const InstanceArena &) = delete;
+                                        ~InstanceArena();
+
+    void *                              Allocate(size_t size);      // Blocks are aligned to max_align_t. Blocks larger than a chunk are given a chunk of their own.
+    static void                         Release(void * block);      // Release a block allocated from any arena, on any thread
+    void                                Reset();
+    Stats                               GetStats() const;
+
+    static InstanceArena *              GetCurrent();               // The arena active on the calling thread, or null
+    static InstanceArena *              SetCurrent(InstanceArena * arena); // Returns the previously active arena
 };
 
 struct Type
 {
-    struct                              Field                       { std::string identifier; VarType type; std::function<void *(void *)> accessor; };
+    struct                              Field                      { std::string identifier; VarType type; std::function<void *(void *)> accessor; };
     enum                                Kind                        { None, Fundamental, Class, Union, Enum, Array, Pointer, Function };
 
     std::type_index                     index;
@@ -73,9 +174,10 @@ struct Type
 
     std::string                         className;
     std::vector<Field>                  fields;
-    
+    mutable std::atomic<InstancePool *> pool;                       // Recycles the storage of instances made by Construct(), so that small instances do not go through the global allocator. Created on first use.
 
-                                        Type()                      : index(typeid(void)), size(), kind(None), elementType(), classType(), isPointeeConst(), isPointeeVolatile() {}
+                                        Type()                      : index(typeid(void)), size(), kind(None), elementType(), classType(), isPointeeConst(), isPointeeVolatile(), pool() {}
+                                        ~Type()                     { delete pool.load(); }
 
     bool                                IsTrivial() const           { return !nonTrivialOps; }
     bool                                IsDefConstructible() const  { return IsTrivial() || nonTrivialOps->defConstruct; }
@@ -84,27 +186,107 @@ struct Type
     bool                                IsCopyAssignable() const    { return IsTrivial() || nonTrivialOps->copyAssign; }
     bool                                IsMoveAssignable() const    { return IsTrivial() || nonTrivialOps->moveAssign; }
 
+    // Allocate storage for an instance, which construct must initialize. The instance is destroyed and freed when the last reference is released. Instances of up to
+    // MaxPooledSize bytes share a single allocation with their reference count, taken from the arena active on the calling thread if there is one, or from the type's pool.
+    enum                                { MaxPooledSize = 256 };
+    std::shared_ptr<void>               Construct(const std::function<void(void * l)> & construct) const;
+    InstancePool &                      GetPool() const             { if(auto p = pool.load(std::memory_order_acquire)) return *p; return CreatePool(); }
+    InstancePool &                      CreatePool() const;                                 // Creates the pool, unless another thread has done so first, and returns whichever pool was kept
     std::shared_ptr<void>               DefConstruct() const;
     std::shared_ptr<void>               CopyConstruct(const void * r) const;
     std::shared_ptr<void>               MoveConstruct(      void * r) const;
+    void                                DefConstruct(void * l) const;                       // Construct an instance in caller-provided storage of at least size bytes
+    void                                CopyConstruct(void * l, const void * r) const;      // Construct an instance in caller-provided storage of at least size bytes
+    void                                MoveConstruct(void * l,       void * r) const;      // Construct an instance in caller-provided storage of at least size bytes
     void                                CopyAssign(void * l, const void * r) const;
     void                                MoveAssign(void * l,       void * r) const;
+    void                                Destruct(void * l) const;                           // Destroy an instance constructed in caller-provided storage, without releasing the storage
 };
 
-class Function
+// The shared state of an asynchronous result, which is completed exactly once, on any thread, with either a value or an exception
+class FutureState
 {
-    typedef std::function<std::shared_ptr<void>(void **)> FunctionImpl;
+    mutable std::mutex                  mutex;
+    mutable std::condition_variable     ready;
+    bool                                isReady = false;
+    std::exception_ptr                  error;
+    std::function<void()>               continuation;
+protected:
+    void                                Complete(std::exception_ptr error);                                 // Marks the result as ready, and calls the continuation, if one was registered, on the completing thread
+    void                                RethrowIfFailed() const                                             { if(error) std::rethrow_exception(error); }
+    virtual void                        MoveValue(void * result)                                            = 0;
+public:
+    virtual                             ~FutureState()                                                      {}
 
+    bool                                IsReady() const;
+    void                                Wait() const;
+    bool                                OnReady(std::function<void()> continuation);                        // Registers a continuation to be called once the result is ready. Returns false, without registering it, if the result is already ready.
+    void                                TakeValue(void * result)                                            { RethrowIfFailed(); MoveValue(result); } // Once ready, moves the value into caller-provided storage of the value's size, or rethrows the exception. May only be called once.
+};
+
+template<class T> class FutureValue : public FutureState
+{
+    std::unique_ptr<T>                  value;
+    void                                MoveValue(void * result) override                                   { new(result) T(std::move(*value)); }
+public:
+    void                                SetValue(T v)                                                       { value = std::make_unique<T>(std::move(v)); Complete(nullptr); }
+    void                                SetException(std::exception_ptr e)                                  { Complete(e); }
+    T                                   Take()                                                              { RethrowIfFailed(); return std::move(*value); }
+};
+
+template<> class FutureValue<void> : public FutureState
+{
+    void                                MoveValue(void *) override                                          {}
+public:
+    void                                SetValue()                                                          { Complete(nullptr); }
+    void                                SetException(std::exception_ptr e)                                  { Complete(e); }
+    void                                Take()                                                              { RethrowIfFailed(); }
+};
+
+// The value type returned by asynchronous functions, which may be bound with TypeLibrary::BindAsyncFunction()
+template<class T> class Future
+{
+    std::shared_ptr<FutureValue<T>>     state;
+public:
+                                        Future(std::shared_ptr<FutureValue<T>> state)                       : state(move(state)) {}
+
+    const std::shared_ptr<FutureValue<T>> & GetState() const                                                { return state; }
+    bool                                IsReady() const                                                     { return state->IsReady(); }
+    T                                   Get() const                                                         { state->Wait(); return state->Take(); } // Blocks until the result is ready, and takes it. May only be called once.
+};
+
+template<class T> class Promise
+{
+    std::shared_ptr<FutureValue<T>>     state;
+public:
+                                        Promise()                                                           : state(std::make_shared<FutureValue<T>>()) {}
+
+    Future<T>                           GetFuture() const                                                   { return state; }
+    template<class... A> void           SetValue(A &&... a) const                                           { state->SetValue(std::forward<A>(a)...); }
+    void                                SetException(std::exception_ptr e) const                            { state->SetException(e); }
+};
+
+class Function
+{
+    friend class NodeType;
+public:
+    typedef void (*Thunk)(const void * functor, void * args[], void * results[]);                     // Calls a bound function object, constructing a returned value in results[0], or pointing results[0] at a returned reference. Thunks of asynchronous functions instead assign the state of the returned future to the std::shared_ptr<FutureState> at results[0].
+private:
     std::string                         name;
     std::vector<std::string>            paramNames;
     const Type *                        type;
-    FunctionImpl                        impl;
+    std::shared_ptr<const void>         functor;
+    Thunk                               thunk;
     bool                                isPure;
+    bool                                isAsync;
+
+    void *                              InvokeAndWait(void * args[], void * result) const;
 public:
-                                        Function(std::string name, const Type & type, FunctionImpl impl)    : name(move(name)), paramNames(type.paramTypes.size()), type(&type), impl(move(impl)), isPure() { assert(type.kind == Type::Function); }
+                                        Function(std::string name, const Type & type, std::shared_ptr<const void> functor, Thunk thunk) : name(move(name)), paramNames(type.paramTypes.size()), type(&type), functor(move(functor)), thunk(thunk), isPure(), isAsync() { assert(type.kind == Type::Function); }
 
     void                                SetParamName(size_t index, const char * name)                       { paramNames[index] = name; }
     void                                SetPure()                                                           { isPure = true; }
+    void                                SetAsync()                                                          { isAsync = true; }
 
     const std::string &                 GetName() const                                                     { return name; }
     const Type &                        GetType() const                                                     { return *type; }
@@ -114,7 +296,10 @@ public:
     const std::string &                 GetParamName(size_t index) const                                    { return paramNames[index]; }
     const std::vector<VarType> &        GetParamTypes() const                                               { return type->paramTypes; }
     bool                                IsPure() const                                                      { return isPure; }
-    std::shared_ptr<void>               Invoke(void * args[]) const                                         { return impl(args); }
+    bool                                IsAsync() const                                                     { return isAsync; }                 // True if the function returns a Future of its return type, rather than the value itself
+    void *                              Invoke(void * args[], void * result) const                          { if(isAsync) return InvokeAndWait(args, result); thunk(functor.get(), args, &result); return result; } // Constructs a returned value in caller-provided storage of GetReturnType().type->size bytes and returns its address. For returned references, result is ignored and the address of the referenced object is returned. Void functions construct nothing and return result unchanged.
+    std::shared_ptr<void>               Invoke(void * args[]) const;                                        // Compatibility form of Invoke(), which returns a value in storage allocated on the heap
+    std::shared_ptr<FutureState>        InvokeAsync(void * args[]) const;                                   // (Async functions only) Starts a call, returning the state of its result without waiting for it. Synchronous forms of Invoke() block until the result is ready.
 };
 
 class TypeLibrary
@@ -137,9 +322,11 @@ public:
     const std::vector<Function> &       GetAllFunctions() const                             { return functions; }
     const Function *                    GetFunction(const char * name) const                { for(auto & f : functions) if(f.GetName() == name) return &f; return nullptr; }
     const Type *                        GetType(std::type_index index) const                { auto it = types.find(index); return it != end(types) ? &it->second : nullptr; }
+    uint64_t                            GetSignatureHash() const;                           // Hash of the names, layouts, and signatures of every bound type and function, independent of the order they were bound in
 
     template<class R, class... P> void  BindPureFunction(R (*func)(P...), std::string name, std::initializer_list<const char *> paramNames) { BindFunction(func, move(name), paramNames); functions.back().SetPure(); }
     template<class R, class... P> void  BindFunction(R (*func)(P...), std::string name, std::initializer_list<const char *> paramNames) { functions.push_back(BindWithSignature(move(name), func, Tag<R(P...)>())); int i=0; for(auto pn : paramNames) { functions.back().SetParamName(i++, pn); } }
+    template<class R, class... P> void  BindAsyncFunction(Future<R> (*func)(P...), std::string name, std::initializer_list<const char *> paramNames) { functions.push_back(BindAsyncWithSignature(move(name), func, Tag<R(P...)>())); int i=0; for(auto pn : paramNames) { functions.back().SetParamName(i++, pn); } }
     template<class C> ClassReflector<C> BindClass(std::string name)                         { DeduceType<C>(); auto & type = types[typeid(C)]; type.className = move(name); return ClassReflector<C>(*this, type); }
     template<class T> const Type &      DeduceType()                                        { auto & type = types[typeid(T)]; if(type.kind == Type::None) { type.index = typeid(T); type.size = SizeOf<T>::VALUE; if(!std::is_trivial<T>::value) type.nonTrivialOps = std::make_unique<NontrivialOps>(Tag<T>()); InitType(type, Tag<T>()); assert(type.kind != Type::None); } return type; }
     template<class T> VarType           DeduceVarType()                                     { typedef std::remove_reference_t<T> U; return { &DeduceType<std::remove_cv_t<U>>(), std::is_const<U>::value, std::is_volatile<U>::value, std::is_lvalue_reference<T>::value ? VarType::LValueRef : std::is_lvalue_reference<T>::value ? VarType::RValueRef : VarType::None }; }
@@ -166,28 +353,23 @@ private: // IMPLEMENTATION DETAILS
     template<         class T, class... P> void InitParameterList(Type & type, Tag<T,P...>)                 { type.paramTypes.push_back(DeduceVarType<T>()); InitParameterList(type, Tag<P...>()); }
                                            void InitParameterList(Type & type, Tag<      >)                 {}
 
-    // BindWithSignature accepts a function option and a call signature, and creates a Function instance, with both metadata and an implementation which invokes CallWithArgs
-    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R   (P...)>) { return Function(move(name), DeduceType<R   (P...)>(), [func](void * args[]) { return std::make_shared<R>(CallWithArgs(func, args, Tag<R(P...)>())); }); }
-    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R & (P...)>) { return Function(move(name), DeduceType<R & (P...)>(), [func](void * args[]) { return std::shared_ptr<void>(&CallWithArgs(func, args, Tag<R & (P...)>())); }); }
-    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R &&(P...)>) { return Function(move(name), DeduceType<R &&(P...)>(), [func](void * args[]) { return std::shared_ptr<void>(&CallWithArgs(func, args, Tag<R &&(P...)>())); }); }
-    template<class F,          class... P> Function BindWithSignature(std::string name, F func, Tag<void(P...)>) { return Function(move(name), DeduceType<void(P...)>(), [func](void * args[]) { CallWithArgs(func, args, Tag<void(P...)>()); return std::shared_ptr<void>(); }); }
-
-    // CallWithArgs invokes a function object with a list of arguments provided as an array of void pointers. It calls PassByArg to convert each argument pointer to the correct parameter type.
-    template<class Fn, class R                                                                        > static R CallWithArgs(Fn func, void * args[], Tag<R(               )>) { return func(                                                                                                                                                                      ); }
-    template<class Fn, class R, class A                                                               > static R CallWithArgs(Fn func, void * args[], Tag<R(A              )>) { return func(PassArg<A>(args[0])                                                                                                                                                   ); }
-    template<class Fn, class R, class A, class B                                                      > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B            )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1])                                                                                                                              ); }
-    template<class Fn, class R, class A, class B, class C                                             > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C          )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2])                                                                                                         ); }
-    template<class Fn, class R, class A, class B, class C, class D                                    > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C,D        )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2]), PassArg<D>(args[3])                                                                                    ); }
-    template<class Fn, class R, class A, class B, class C, class D, class E                           > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C,D,E      )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2]), PassArg<D>(args[3]), PassArg<E>(args[4])                                                               ); }
-    template<class Fn, class R, class A, class B, class C, class D, class E, class F                  > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C,D,E,F    )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2]), PassArg<D>(args[3]), PassArg<E>(args[4]), PassArg<F>(args[5])                                          ); }
-    template<class Fn, class R, class A, class B, class C, class D, class E, class F, class G         > static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C,D,E,F,G  )>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2]), PassArg<D>(args[3]), PassArg<E>(args[4]), PassArg<F>(args[5]), PassArg<G>(args[6])                     ); }
-    template<class Fn, class R, class A, class B, class C, class D, class E, class F, class G, class H> static R CallWithArgs(Fn func, void * args[], Tag<R(A,B,C,D,E,F,G,H)>) { return func(PassArg<A>(args[0]), PassArg<B>(args[1]), PassArg<C>(args[2]), PassArg<D>(args[3]), PassArg<E>(args[4]), PassArg<F>(args[5]), PassArg<G>(args[6]), PassArg<H>(args[7])); }
+    // BindWithSignature accepts a function object and a call signature, and creates a Function instance, with both metadata and a thunk which invokes CallWithArgs
+    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R   (P...)>) { return Function(move(name), DeduceType<R   (P...)>(), std::make_shared<F>(func), [](const void * f, void * args[], void * results[]) { new(results[0]) R(CallWithArgs(*reinterpret_cast<const F *>(f), args, Tag<R(P...)>())); }); }
+    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R & (P...)>) { return Function(move(name), DeduceType<R & (P...)>(), std::make_shared<F>(func), [](const void * f, void * args[], void * results[]) { results[0] = &CallWithArgs(*reinterpret_cast<const F *>(f), args, Tag<R & (P...)>()); }); }
+    template<class F, class R, class... P> Function BindWithSignature(std::string name, F func, Tag<R &&(P...)>) { return Function(move(name), DeduceType<R &&(P...)>(), std::make_shared<F>(func), [](const void * f, void * args[], void * results[]) { results[0] = &static_cast<R &>(CallWithArgs(*reinterpret_cast<const F *>(f), args, Tag<R &&(P...)>())); }); }
+    template<class F,          class... P> Function BindWithSignature(std::string name, F func, Tag<void(P...)>) { return Function(move(name), DeduceType<void(P...)>(), std::make_shared<F>(func), [](const void * f, void * args[], void * []    ) { CallWithArgs(*reinterpret_cast<const F *>(f), args, Tag<void(P...)>()); }); }
+
+    template<class F, class R, class... P> Function BindAsyncWithSignature(std::string name, F func, Tag<R   (P...)>) { Function f(move(name), DeduceType<R   (P...)>(), std::make_shared<F>(func), [](const void * f, void * args[], void * results[]) { *reinterpret_cast<std::shared_ptr<FutureState> *>(results[0]) = CallWithArgs(*reinterpret_cast<const F *>(f), args, Tag<Future<R>(P...)>()).GetState(); }); f.SetAsync(); return f; }
+
+    // CallWithArgs invokes a function object with a list of arguments provided as an array of void pointers, for any number of parameters. It calls PassArg to convert each argument pointer to the correct parameter type.
+    template<class Fn, class R, class... P                > static R CallWithArgs(const Fn & func, void * args[], Tag<R(P...)>                          ) { return CallWithArgs(func, args, Tag<R(P...)>(), std::index_sequence_for<P...>()); }
+    template<class Fn, class R, class... P, size_t... I   > static R CallWithArgs(const Fn & func, void * args[], Tag<R(P...)>, std::index_sequence<I...>) { return func(PassArg<P>(args[I])...); }
 
     // PassArg takes a void pointer and casts it to an appropriate type to be passed to a function
     template<class T> static T    PassArg(void * addr           ) { return PassArg(addr, Tag<T>()); }
     template<class T> static T &  PassArg(void * addr, Tag<T & >) { return             *reinterpret_cast<T *>(addr);   } // For lvalue reference types, just pass a ref to the object
     template<class T> static T && PassArg(void * addr, Tag<T &&>) { return   std::move(*reinterpret_cast<T *>(addr));  } // For rvalue reference types, pass an rvalue ref to the object
-    template<class T> static T    PassArg(void * addr, Tag<T   >) { return T(std::move(*reinterpret_cast<T *>(addr))); } // For value types, move-construct a new value from the original
+    template<class T> static T    PassArg(void * addr, Tag<T   >) { return T(static_cast<std::conditional_t<std::is_copy_constructible<T>::value, const T &, T &&>>(*reinterpret_cast<T *>(addr))); } // For value types, copy-construct a new value, as the original may be read by other calls or other threads. Move-only types are moved from the original.
 };
 
 std::ostream & operator << (std::ostream & out, const Type & type);
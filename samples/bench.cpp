@@ -0,0 +1,439 @@
+// Microbenchmarks for compiling and invoking programs. Results are written as JSON, to the file named on the command line if one is given,
+// or to stdout otherwise, so that they can be compared between commits. Run as "bench --stress [max nodes] [file]" to instead load, compile
+// and invoke generated graphs of every shape, at sizes from 10 nodes up to the given maximum, which defaults to a million.
+
+#include "gen.h"
+#include "graph.h"
+#include "json.h"
+#include "pool.h"
+#include "queue.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+struct Point { float x,y; };
+
+class Accumulator
+{
+public:
+    float total = 0;
+    void Add(float value) { total += value; }
+};
+
+namespace ops
+{
+    float add(float a, float b) { return a+b; }
+    float mul(float a, float b) { return a*b; }
+    float spin(float x) { for(int i=0; i<1000; ++i) x = x*0.999f + 0.001f; return x; }
+
+    // Functions of increasing arity, used to measure the cost of calling bound functions against the number of arguments they take
+    float sum0() { return 0; }
+    float sum1(float a) { return a; }
+    float sum2(float a, float b) { return a+b; }
+    float sum4(float a, float b, float c, float d) { return a+b+c+d; }
+    float sum8(float a, float b, float c, float d, float e, float f, float g, float h) { return a+b+c+d+e+f+g+h; }
+    float sum12(float a, float b, float c, float d, float e, float f, float g, float h, float i, float j, float k, float l) { return a+b+c+d+e+f+g+h+i+j+k+l; }
+}
+
+TypeLibrary types;
+std::vector<NodeType> nodeTypes;
+JsonArray results;
+
+const NodeType & GetNodeType(const std::string & uniqueId)
+{
+    for(auto & type : nodeTypes) if(type.GetUniqueId() == uniqueId) return type;
+    throw std::runtime_error("Missing node type "+uniqueId);
+}
+
+// Function node types are found by the name their function was bound under, as their unique ids spell parameter types as the compiler names them
+const NodeType & GetFunctionNodeType(const char * name)
+{
+    if(auto function = types.GetFunction(name)) for(auto & type : nodeTypes) if(type.GetFunction() == function) return type;
+    throw std::runtime_error(std::string("Missing function ")+name);
+}
+
+Node MakeNode(const NodeType & type, std::vector<Node::Wire> inputs, int next = -1)
+{
+    Node node(type, 0, 0);
+    node.inputs = move(inputs);
+    node.flowOutputIndex = next;
+    return node;
+}
+
+Node MakeNode(const std::string & uniqueId, std::vector<Node::Wire> inputs, int next = -1) { return MakeNode(GetNodeType(uniqueId), move(inputs), next); }
+
+// Runs op repeatedly, in batches which take at least a few milliseconds, and records the fastest time per call to op over several batches
+template<class F> void Measure(const std::string & name, size_t opsPerCall, F op)
+{
+    typedef std::chrono::steady_clock clock;
+    size_t calls = 1;
+    for(auto start = clock::now(); clock::now() - start < std::chrono::milliseconds(5); calls *= 2) for(size_t i=0; i<calls; ++i) op();
+
+    double best = std::numeric_limits<double>::max();
+    for(int batch=0; batch<7; ++batch)
+    {
+        auto start = clock::now();
+        for(size_t i=0; i<calls; ++i) op();
+        best = std::min(best, std::chrono::duration<double, std::nano>(clock::now() - start).count() / calls);
+    }
+
+    results.push_back(JsonObject{
+        {"name", name},
+        {"calls", calls},
+        {"ns_per_call", best},
+        {"ns_per_op", best / opsPerCall},
+        {"ops_per_second", opsPerCall * 1e9 / best}
+    });
+    std::cerr << name << ": " << best << " ns" << std::endl;
+}
+
+// Runs op once, and records the time it took. Used for operations on large graphs, which take too long to repeat.
+template<class F> void MeasureOnce(const std::string & name, size_t opsPerCall, F op)
+{
+    auto start = std::chrono::steady_clock::now();
+    op();
+    const double time = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    results.push_back(JsonObject{
+        {"name", name},
+        {"calls", 1},
+        {"ns_per_call", time},
+        {"ns_per_op", time / opsPerCall},
+        {"ops_per_second", opsPerCall * 1e9 / time}
+    });
+    std::cerr << name << ": " << time / 1e6 << " ms" << std::endl;
+}
+
+// On Tick(x, acc), computes ((x+x)*x+x)*x... over n operations, and adds the result to acc
+std::vector<Node> MakeArithmeticChain(int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {n+1,0}})};
+    for(int i=0; i<n; ++i) nodes.push_back(MakeNode(GetFunctionNodeType(i % 2 ? "*" : "+"), {{i ? i+1 : 0, 0}, {0,0}}));
+    return nodes;
+}
+
+// On Tick(x, acc), assembles and takes apart n Points, swapping x and y each time, and adds the final x to acc
+std::vector<Node> MakeBuildSplitChain(int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {n*2+1,0}})};
+    for(int i=0; i<n; ++i)
+    {
+        const int prev = i ? i*2+1 : 0;
+        nodes.push_back(MakeNode("build:Point", {{prev, i ? 1 : 0}, {prev, 0}}));
+        nodes.push_back(MakeNode("split:Point", {{i*2+2, 0}}));
+    }
+    return nodes;
+}
+
+// On Tick(x, acc), adds x to acc n times in sequence
+std::vector<Node> MakeMethodChain(int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1)};
+    for(int i=0; i<n; ++i) nodes.push_back(MakeNode(GetFunctionNodeType("Add"), {{0,1}, {0,0}}, i+1 < n ? i+2 : -1));
+    return nodes;
+}
+
+// On Tick(x, acc), adds x to acc n times, from the body of a loop node
+std::vector<Node> MakeLoop(int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1), MakeNode("loop", {{-1,-1,"1"}, {-1,-1,std::to_string(n)}}), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {0,0}})};
+    nodes[1].subflowIndices = {2};
+    return nodes;
+}
+
+// On Tick(x, acc), adds the result of the given subgraph node, applied n times in a chain starting from x, to acc
+std::vector<Node> MakeSubgraphChain(const NodeType & subgraphType, int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {n+1,0}})};
+    for(int i=0; i<n; ++i)
+    {
+        nodes.push_back(Node(subgraphType, 0, 0));
+        nodes.back().inputs = {{i ? i+1 : 0, 0}};
+    }
+    return nodes;
+}
+
+// On Tick(x, acc), computes Spin(x+i) for each i < n, which are independent of each other, and adds their sum to acc
+std::vector<Node> MakeSpinFanOut(int n)
+{
+    std::vector<Node> nodes = {MakeNode("event:Tick", {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {n*3,0}})};
+    for(int i=0; i<n; ++i)
+    {
+        nodes.push_back(MakeNode(GetFunctionNodeType("+"), {{0,0}, {-1,-1,std::to_string(i)}}));
+        nodes.push_back(MakeNode(GetFunctionNodeType("Spin"), {{i*2+2,0}}));
+    }
+    for(int i=1; i<n; ++i) nodes.push_back(MakeNode(GetFunctionNodeType("+"), {{i > 1 ? n*2+i : 3, 0}, {i*2+3,0}}));
+    return nodes;
+}
+
+// A minimal interpreter over a fixed list of lines, used to compare dispatch strategies without the rest of Program's per-line work. Legacy dispatch
+// reproduces Program before lines were lowered to steps: each line holds its evaluator by shared_ptr and calls it through a std::function, which calls
+// the bound function through a second std::function. Lowered dispatch calls the node type's eval pointer, as Program's steps do.
+struct DispatchBaseline
+{
+    typedef std::function<void(void ** inputs, void ** outputs)> Eval;
+    struct Line { std::shared_ptr<const Eval> eval; NodeType type; std::vector<size_t> inputs, outputs; };
+
+    std::vector<Line>   lines;
+    std::vector<float>  storage;                            // Storage for slots which hold float results
+    std::vector<void *> slots;                              // Address of the value in each slot, of which the first two are the arguments to the program
+    std::vector<void *> args, outs;
+
+    static std::shared_ptr<const Eval> MakeLegacyEval(const Function & function)
+    {
+        const std::function<void *(void **, void *)> invoke = [&function](void ** args, void * result) { return function.Invoke(args, result); };
+        if(function.GetReturnType().type) return std::make_shared<const Eval>([invoke](void ** inputs, void ** outputs) { outputs[0] = invoke(inputs, outputs[0]); });
+        return std::make_shared<const Eval>([invoke](void ** inputs, void ** outputs) { invoke(inputs, nullptr); });
+    }
+
+    template<bool IsLegacy> void Invoke(float x, Accumulator & acc)
+    {
+        slots[0] = &x;
+        slots[1] = &acc;
+        for(auto & line : lines)
+        {
+            for(size_t i=0; i<line.inputs.size(); ++i) args[i] = slots[line.inputs[i]];
+            for(size_t i=0; i<line.outputs.size(); ++i) outs[i] = slots[line.outputs[i]];
+            if(IsLegacy) (*line.eval)(args.data(), outs.data());
+            else line.type.Evaluate(args.data(), outs.data());
+            for(size_t i=0; i<line.outputs.size(); ++i) slots[line.outputs[i]] = outs[i];
+        }
+    }
+};
+
+// Builds the equivalent of MakeArithmeticChain(n) as a DispatchBaseline, in which slot 0 holds x, slot 1 holds acc, and slot i+2 holds the result of operation i
+DispatchBaseline MakeBaselineArithmeticChain(int n)
+{
+    DispatchBaseline program;
+    program.storage.resize(n);
+    program.slots.resize(n+2);
+    for(int i=0; i<n; ++i) program.slots[i+2] = &program.storage[i];
+    auto & add = *types.GetFunction("+"), & mul = *types.GetFunction("*"), & accumulate = *types.GetFunction("Add");
+    const DispatchBaseline::Line addLine = {DispatchBaseline::MakeLegacyEval(add), NodeType::MakeFunctionNode(add), {}, {}}, mulLine = {DispatchBaseline::MakeLegacyEval(mul), NodeType::MakeFunctionNode(mul), {}, {}};
+    for(int i=0; i<n; ++i)
+    {
+        program.lines.push_back(i % 2 ? mulLine : addLine);
+        program.lines.back().inputs = {i ? size_t(i+1) : 0, 0};
+        program.lines.back().outputs = {size_t(i+2)};
+    }
+    program.lines.push_back({DispatchBaseline::MakeLegacyEval(accumulate), NodeType::MakeFunctionNode(accumulate), {1, size_t(n+1)}, {}});
+    program.args.resize(2);
+    program.outs.resize(1);
+    return program;
+}
+
+void BenchmarkInvoke(const std::string & name, const std::vector<Node> & nodes)
+{
+    CompileStats stats;
+    Event<void(float, Accumulator &)> tick = Compile(nodes, 0, stats);
+    ExecutionContext context;
+    Accumulator acc;
+    float x = 1.0001f;
+    Measure("invoke/"+name, stats.numLines, [&]() { tick(context, x, acc); });
+}
+
+void BenchmarkBatch(const std::string & name, const std::vector<Node> & nodes)
+{
+    Event<void(float, Accumulator &)> tick = Compile(nodes, 0);
+    ExecutionContext context;
+    Accumulator accs[Program::MaxBatchChunk];
+    float xs[Program::MaxBatchChunk];
+    for(auto & x : xs) x = 1.0001f;
+    Measure("invoke_batch/"+name, Program::MaxBatchChunk, [&]() { tick.InvokeBatch(context, Program::MaxBatchChunk, xs, accs); });
+    Measure("invoke_per_call/"+name, Program::MaxBatchChunk, [&]() { for(size_t i=0; i<Program::MaxBatchChunk; ++i) tick(context, xs[i], accs[i]); });
+}
+
+template<class... A, size_t... I> float CallWithArray(float (* function)(A...), const float * args, std::index_sequence<I...>) { return function(args[I]...); }
+
+// Measures calling the bound function of the given name through Function::Invoke(), against calling it directly. The function pointer is volatile so that the direct call is not inlined.
+template<class... A> void BenchmarkArity(const std::string & name, float (* function)(A...))
+{
+    auto & bound = *types.GetFunction(name.c_str());
+    float args[sizeof...(A) ? sizeof...(A) : 1] = {}, result;
+    void * argPointers[sizeof...(A) ? sizeof...(A) : 1];
+    for(size_t i=0; i<sizeof...(A); ++i) argPointers[i] = &args[i];
+    Measure("function/invoke/arity:"+std::to_string(sizeof...(A)), 1, [&]() { bound.Invoke(argPointers, &result); });
+    float (* volatile direct)(A...) = function;
+    Measure("function/direct/arity:"+std::to_string(sizeof...(A)), 1, [&]() { result = CallWithArray(direct, args, std::index_sequence_for<A...>()); });
+}
+
+void RunMicrobenchmarks()
+{
+    // Latency of a single invocation, and throughput of batched invocations against the same invocations made one call at a time
+    for(int n : {8, 64, 512})
+    {
+        const auto suffix = "/" + std::to_string(n);
+        BenchmarkInvoke("arithmetic_chain"+suffix, MakeArithmeticChain(n));
+        BenchmarkInvoke("build_split_chain"+suffix, MakeBuildSplitChain(n));
+        BenchmarkInvoke("method_chain"+suffix, MakeMethodChain(n));
+        BenchmarkBatch("arithmetic_chain"+suffix, MakeArithmeticChain(n));
+    }
+
+    // Cost of dispatching lines through the chain of std::functions used before lines were lowered to steps, against calling eval pointers directly
+    for(int n : {8, 64, 512})
+    {
+        auto baseline = MakeBaselineArithmeticChain(n);
+        Accumulator acc;
+        Measure("dispatch/legacy/arithmetic_chain/"+std::to_string(n), baseline.lines.size(), [&]() { baseline.Invoke<true>(1.0001f, acc); });
+        Measure("dispatch/lowered/arithmetic_chain/"+std::to_string(n), baseline.lines.size(), [&]() { baseline.Invoke<false>(1.0001f, acc); });
+    }
+
+    // Cost of iterating within a program, against invoking a program once per iteration
+    for(int n : {8, 64, 512})
+    {
+        Event<void(float, Accumulator &)> loop = Compile(MakeLoop(n), 0), once = Compile(MakeMethodChain(1), 0);
+        ExecutionContext context;
+        Accumulator acc;
+        Measure("loop/method/"+std::to_string(n), n, [&]() { loop(context, 1.0001f, acc); });
+        Measure("reinvoke/method/"+std::to_string(n), n, [&]() { for(int i=0; i<n; ++i) once(context, 1.0001f, acc); });
+    }
+
+    // Cost of calling a subgraph of four arithmetic nodes through a shared program, against inlining it
+    {
+        nodeTypes.push_back(NodeType::MakeSubgraphInputNode("Step", {{"x", types.DeduceVarType<float>()}}));
+        nodeTypes.push_back(NodeType::MakeSubgraphOutputNode("Step", {{"y", types.DeduceVarType<float>()}}));
+        Subgraph step = {"Step", {MakeNode("input:Step", {}), MakeNode("output:Step", {{5,0}})}, 0, 1};
+        for(int i=0; i<4; ++i) step.nodes.push_back(MakeNode(GetFunctionNodeType(i % 2 ? "*" : "+"), {{i ? i+1 : 0, 0}, {0,0}}));
+        for(auto linkage : {InlineSubgraph, SharedSubgraph})
+        {
+            Event<void(float, Accumulator &)> tick = Compile(MakeSubgraphChain(MakeSubgraphNode(step, linkage), 16), 0);
+            ExecutionContext context;
+            Accumulator acc;
+            Measure(std::string(linkage == InlineSubgraph ? "subgraph_inline" : "subgraph_shared")+"/16", 16, [&]() { tick(context, 1.0001f, acc); });
+        }
+    }
+
+    // Scaling of parallel invocation with thread count, over independent lines which each take a few microseconds, against serial invocation
+    {
+        Event<void(float, Accumulator &)> tick = Compile(MakeSpinFanOut(16), 0);
+        ExecutionContext context;
+        Accumulator acc;
+        Measure("invoke/spin_fan_out/16", 16, [&]() { tick(context, 1.0001f, acc); });
+        for(size_t threads : {1, 2, 4, 8})
+        {
+            ThreadPool pool(threads-1);
+            Measure("invoke_parallel/spin_fan_out/16/threads:"+std::to_string(threads), 16, [&]() { tick.InvokeParallel(context, pool, 1.0001f, acc); });
+        }
+    }
+
+    // Throughput of queued dispatch, from the calling thread to a single worker, including the time to drain the queue
+    {
+        QueuedEvent<void(float, Accumulator &)> tick(Compile(MakeArithmeticChain(8), 0), 4096, 1);
+        Accumulator acc;
+        Measure("queue/arithmetic_chain/8", 1024, [&]() { for(int i=0; i<1024; ++i) tick(1.0001f, acc); tick.Flush(); });
+    }
+
+    // Compile time against node count
+    for(int n : {16, 128, 1024, 8192})
+    {
+        auto nodes = MakeArithmeticChain(n);
+        Measure("compile/arithmetic_chain/"+std::to_string(n), nodes.size(), [&]() { Compile(nodes, 0); });
+    }
+
+    // Recompile time after an edit near the end of the handler, which emits only the last few lines again, against compiling the edited graph afresh
+    for(int n : {128, 1024, 8192})
+    {
+        IncrementalCompiler compiler(MakeArithmeticChain(n), 0);
+        compiler.GetProgram();
+        bool isWiredToX = true;
+        Measure("compile/incremental/arithmetic_chain/"+std::to_string(n), n+2, [&]()
+        {
+            isWiredToX = !isWiredToX;
+            compiler.SetWire(n+1, 1, isWiredToX ? 0 : n, 0); // The last operation reads either x or the operation before it
+            compiler.GetProgram();
+        });
+        const auto nodes = compiler.GetNodes();
+        Measure("compile/full/arithmetic_chain/"+std::to_string(n), n+2, [&]() { Compile(nodes, 0); });
+    }
+
+    // Cost of calling a bound function through its thunk, against calling it directly, for arities up to and beyond the eight parameters which calls were once limited to
+    BenchmarkArity("Sum0", &ops::sum0);
+    BenchmarkArity("Sum1", &ops::sum1);
+    BenchmarkArity("Sum2", &ops::sum2);
+    BenchmarkArity("Sum4", &ops::sum4);
+    BenchmarkArity("Sum8", &ops::sum8);
+    BenchmarkArity("Sum12", &ops::sum12);
+
+    // Cost of constructing reflected instances which own their storage, taken from their type's pool, or from an arena which is reset every 64 instances
+    {
+        auto & add = *types.GetFunction("+");
+        float a = 1, b = 2;
+        void * args[] = {&a, &b};
+        const Point p {1, 2};
+        auto & pointType = types.DeduceType<Point>();
+        Measure("construct/pool/point", 1, [&]() { pointType.CopyConstruct(&p); });
+        Measure("construct/pool/function_result", 1, [&]() { add.Invoke(args); });
+        InstanceArena arena;
+        InstanceArena::Scope scope(arena);
+        Measure("construct/arena/point", 64, [&]() { for(int i=0; i<64; ++i) pointType.CopyConstruct(&p); arena.Reset(); });
+        Measure("construct/arena/function_result", 64, [&]() { for(int i=0; i<64; ++i) add.Invoke(args); arena.Reset(); });
+    }
+}
+
+// Generates a graph of each shape and size, and measures saving it to JSON text, loading it back, compiling the loaded graph, and invoking the program
+void RunStressTest(size_t maxNodes)
+{
+    const struct { GraphShape shape; const char * name; } shapes[] = {{DeepChain, "deep_chain"}, {WideFanOut, "wide_fan_out"}, {Diamonds, "diamonds"}, {FlowSequence, "flow_sequence"}};
+    for(size_t n=10; n<=maxNodes; n *= 10) for(auto & shape : shapes)
+    {
+        const auto suffix = std::string("/") + shape.name + "/" + std::to_string(n);
+        std::vector<Node> generated, loaded;
+        MeasureOnce("stress/generate"+suffix, n, [&]() { generated = GenerateGraph(nodeTypes[0], nodeTypes, shape.shape, n, 1); });
+        std::string text;
+        MeasureOnce("stress/save"+suffix, n, [&]() { std::ostringstream ss; ss << SaveGraph(generated); text = ss.str(); });
+        generated.clear();
+        MeasureOnce("stress/load"+suffix, n, [&]() { loaded = LoadGraph(nodeTypes, jsonFrom(text)); });
+        text.clear();
+
+        Event<void(float, Accumulator &)> tick;
+        CompileStats stats;
+        MeasureOnce("stress/compile"+suffix, n, [&]() { tick = Compile(loaded, 0, stats); });
+        ExecutionContext context;
+        Accumulator acc;
+        MeasureOnce("stress/invoke"+suffix, stats.numLines, [&]() { tick(context, 1.0001f, acc); });
+    }
+}
+
+int main(int argc, char * argv[]) try
+{
+    types.BindPureFunction(&ops::add, "+", {"",""});
+    types.BindPureFunction(&ops::mul, "*", {"",""});
+    types.BindPureFunction(&ops::spin, "Spin", {""});
+    types.BindPureFunction(&ops::sum0, "Sum0", {});
+    types.BindPureFunction(&ops::sum1, "Sum1", {""});
+    types.BindPureFunction(&ops::sum2, "Sum2", {"",""});
+    types.BindPureFunction(&ops::sum4, "Sum4", {"","","",""});
+    types.BindPureFunction(&ops::sum8, "Sum8", {"","","","","","","",""});
+    types.BindPureFunction(&ops::sum12, "Sum12", {"","","","","","","","","","","",""});
+    types.BindClass<Point>("Point").HasField(&Point::x, "x").HasField(&Point::y, "y");
+    types.BindClass<Accumulator>("Accumulator").HasMethod(&Accumulator::Add, "Add", {"value"});
+    nodeTypes.push_back(NodeType::MakeEventNode("Tick", {types.DeduceVarType<float>(), types.DeduceVarType<Accumulator &>()}));
+    for(auto & func : types.GetAllFunctions()) nodeTypes.push_back(NodeType::MakeFunctionNode(func));
+    nodeTypes.push_back(NodeType::MakeBuildNode(types.DeduceType<Point>()));
+    nodeTypes.push_back(NodeType::MakeSplitNode(types.DeduceType<Point>()));
+    nodeTypes.push_back(NodeType::MakeLoopNode(types.DeduceType<int>()));
+
+
+    // Arguments are [--stress [max nodes]] [output file]
+    int arg = 1;
+    const bool isStressTest = arg < argc && std::string(argv[arg]) == "--stress";
+    size_t maxNodes = 1000000;
+    if(isStressTest && ++arg < argc && isdigit(static_cast<unsigned char>(argv[arg][0]))) maxNodes = std::stoul(argv[arg++]);
+    if(isStressTest) RunStressTest(maxNodes);
+    else RunMicrobenchmarks();
+
+    const JsonValue report = JsonObject{{"benchmarks", results}};
+    if(arg < argc) std::ofstream(argv[arg]) << tabbed(report, 4) << std::endl;
+    else std::cout << tabbed(report, 4) << std::endl;
+    return 0;
+}
+catch(const std::exception & e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
@@ -92,6 +92,11 @@ void GraphEditor::Draw() const
         {
             r.DrawLine(nv.GetFlowOutputRect().GetCenter(), NodeView(nodes[n.flowOutputIndex]).GetFlowInputRect().GetCenter());
         }
+        for(size_t i=0; i<n.subflowIndices.size(); ++i)
+        {
+            if(n.subflowIndices[i] < 0) continue;
+            r.DrawLine(nv.GetFlowOutputRect(i+1).GetCenter(), NodeView(nodes[n.subflowIndices[i]]).GetFlowInputRect().GetCenter());
+        }
         for(size_t i=0; i<n.inputs.size(); ++i)
         {
             auto wire = n.inputs[i];
@@ -146,9 +151,9 @@ void GraphEditor::Draw() const
             glEnd();
         }          
 
-        if(nv.HasOutFlow())
+        for(size_t i=0; i<nv.GetFlowOutputCount(); ++i)
         {
-            rect = nv.GetFlowOutputRect();
+            rect = nv.GetFlowOutputRect(i);
             auto center = rect.GetCenter();
             glBegin(GL_TRIANGLE_FAN);
             if(clicked.type == Feature::FlowInput) glColor3f(1,1,0);
@@ -158,7 +163,11 @@ void GraphEditor::Draw() const
             glVertex2i(rect.b1.x, center.y);
             glVertex2i(center.x, rect.b1.y);
             glVertex2i(rect.b0.x, rect.b1.y);
-            glEnd();            
+            glEnd();
+
+            auto lbl = nv.GetFlowOutputLabel(i);
+            glColor3f(1,1,1);
+            r.DrawText12(rect.b0 - int2(nv.GetPinPadding() + GetStringWidth12(lbl), 0), lbl);
         }
 
         for(size_t i=0; i<nv.GetInputCount(); ++i)
@@ -30,7 +30,7 @@ Rect Feature::GetPinRect() const
     case Input: return NodeView(*node).GetInputPinRect(pin);
     case Output: return NodeView(*node).GetOutputPinRect(pin);
     case FlowInput: return NodeView(*node).GetFlowInputRect();
-    case FlowOutput: return NodeView(*node).GetFlowOutputRect();
+    case FlowOutput: return NodeView(*node).GetFlowOutputRect(pin);
     default: assert(false); return {};
     }
 }
@@ -58,7 +58,9 @@ void GraphEditor::ConnectPins(Feature a, Feature b)
     if(b.type == Feature::FlowInput) std::swap(a, b);
     if(a.type == Feature::FlowInput && b.type == Feature::FlowOutput)
     {
-        b.node->flowOutputIndex = a.node - nodes.data();
+        // Flow output pin 0 passes execution on, and the pins after it start the subflows of control nodes
+        if(b.pin == 0) b.node->flowOutputIndex = a.node - nodes.data();
+        else b.node->subflowIndices[b.pin-1] = a.node - nodes.data();
         return;
     }
 
@@ -87,11 +89,11 @@ Feature GraphEditor::GetFeature(const int2 & coord)
                 }
             }
 
-            if(nv.HasOutFlow())
+            for(size_t i=0; i<nv.GetFlowOutputCount(); ++i)
             {
-                if(nv.GetFlowOutputRect().Contains(coord))
+                if(nv.GetFlowOutputRect(i).Contains(coord))
                 {
-                    return {coord, Feature::FlowOutput, &n, 0};
+                    return {coord, Feature::FlowOutput, &n, i};
                 }
             }
 
@@ -125,6 +127,12 @@ void GraphEditor::DeleteNode(int index)
         if(node.flowOutputIndex > index) --node.flowOutputIndex;
         else if(node.flowOutputIndex == index) node.flowOutputIndex = -1;
 
+        for(auto & subflow : node.subflowIndices)
+        {
+            if(subflow > index) --subflow;
+            else if(subflow == index) subflow = -1;
+        }
+
         for(auto & input : node.inputs)
         {
             if(input.nodeIndex > index) --input.nodeIndex;
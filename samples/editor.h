@@ -69,9 +69,11 @@ struct NodeView
 
     bool                                HasInFlow() const                                   { return GetNodeType().HasInFlow(); }
     bool                                HasOutFlow() const                                  { return GetNodeType().HasOutFlow(); }
-    int                                 GetFlowControlSize() const                          { return HasInFlow() || HasOutFlow() ? GetPinSpacing() : 0; }
+    int                                 GetFlowOutputCount() const                          { return HasOutFlow() ? 1 + (int)GetNodeType().GetSubflows().size() : 0; } // The next flow, followed by any subflows
+    std::string                         GetFlowOutputLabel(size_t index) const              { return index ? GetNodeType().GetSubflows()[index-1] : std::string(); }
+    int                                 GetFlowControlSize() const                          { return HasInFlow() || HasOutFlow() ? GetPinSpacing() * std::max(GetFlowOutputCount(), 1) : 0; }
     Rect                                GetFlowInputRect() const                            { return GetPinRect(GetPosition().x,GetPosition().y); }
-    Rect                                GetFlowOutputRect() const                           { return GetPinRect(GetPosition().x+GetSizeX()-GetPinSize(),GetPosition().y); }
+    Rect                                GetFlowOutputRect(size_t i = 0) const               { return GetPinRect(GetPosition().x+GetSizeX()-GetPinSize(),GetPosition().y + (int)i*GetPinSpacing()); }
 
     int                                 GetPinSpacing() const                               { return GetPinSize() + GetPinPadding(); }
     int                                 GetLineSpacing() const                              { return GetLineSize() + GetLinePadding(); }
@@ -85,7 +87,7 @@ struct NodeView
 
     int                                 GetInputColumnLabelWidth() const                    { int w=0; for(size_t i=0, n=GetInputCount(); i!=n; ++i) w = std::max(w, GetStringWidth12(GetInputLabel(i))); return w; }
     int                                 GetContentsColumnWidth() const                      { return GetStringWidth18(GetNodeType().GetLabel()); }
-    int                                 GetOutputColumnLabelWidth() const                   { int w=0; for(size_t i=0, n=GetOutputCount(); i!=n; ++i) w = std::max(w, GetStringWidth12(GetOutputLabel(i))); return w; }
+    int                                 GetOutputColumnLabelWidth() const                   { int w=0; for(size_t i=0, n=GetOutputCount(); i!=n; ++i) w = std::max(w, GetStringWidth12(GetOutputLabel(i))); for(size_t i=1, n=GetFlowOutputCount(); i<n; ++i) w = std::max(w, GetStringWidth12(GetFlowOutputLabel(i))); return w; }
     int                                 GetSizeX() const                                    { return GetPinSpacing() * 2 + GetInputColumnLabelWidth() + GetContentsColumnWidth() + GetOutputColumnLabelWidth() + GetColumnPadding() * 2; }
 
     Rect                                GetNodeRect() const                                 { return {GetPosition(), GetPosition() + int2(GetSizeX(),GetSizeY())}; }
@@ -7,6 +7,7 @@
 #include <fstream>
 
 GraphEditor editor;
+ProgramCache programCache(64); // Programs compiled by InvokeNode(), which are reused for as long as the invoked part of the graph is unchanged
 
 int g_editorGlutWindow, g_sketchpadGlutWindow;
 
@@ -229,7 +230,7 @@ void InvokeNode(int index)
 {
     try
     {
-        Event<void(Sketchpad &)> onDraw = Compile(editor.nodes, index); 
+        Event<void(Sketchpad &)> onDraw = programCache.Compile(editor.nodes, index); 
         Sketchpad sketchpad;
 
         glutSetWindow(g_sketchpadGlutWindow);
@@ -272,6 +273,8 @@ int main(int argc, char * argv[])
     editor.nodeTypes.push_back(NodeType::MakeSplitNode(types.DeduceType<Point>()));
     editor.nodeTypes.push_back(NodeType::MakeBuildNode(types.DeduceType<Color>()));
     editor.nodeTypes.push_back(NodeType::MakeSplitNode(types.DeduceType<Color>()));
+    editor.nodeTypes.push_back(NodeType::MakeBranchNode(types.DeduceType<bool>()));
+    editor.nodeTypes.push_back(NodeType::MakeLoopNode(types.DeduceType<int>()));
 
     // Load the graph from disk
     std::ifstream in("graph.json");
@@ -0,0 +1,856 @@
+// Tests for guarantees made by the library which are not visible in its results alone, such as invocation not allocating.
+// Prints the name of each test as it runs, and returns a non-zero exit code if any test fails.
+
+#include "bytecode.h"
+#include "gen.h"
+#include "graph.h"
+#include "json.h"
+#include "pool.h"
+#include "queue.h"
+
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <thread>
+
+// Counts every allocation made through the global operator new, so that tests can assert that an operation makes none
+static std::atomic<size_t> allocationCount {0};
+void * operator new(size_t size) { ++allocationCount; if(auto p = std::malloc(size ? size : 1)) return p; throw std::bad_alloc(); }
+void operator delete(void * p) noexcept { std::free(p); }
+
+#define CHECK(condition) if(!(condition)) throw std::runtime_error(std::string(__FILE__) + "(" + std::to_string(__LINE__) + "): CHECK(" #condition ") failed")
+
+struct Point { float x,y; };
+
+class Accumulator
+{
+public:
+    float total = 0;
+    void Add(float value) { total += value; }
+};
+
+namespace ops
+{
+    float add(float a, float b) { return a+b; }
+    float mul(float a, float b) { return a*b; }
+    bool less(float a, float b) { return a<b; }
+}
+
+// Used by TestParallelAliasedSlots. ReadAfterRewrite waits, for a bounded time, until MakePoint has been called, before reading its argument, so that
+// a line which overwrites the storage it refers to while it is still being read is caught deterministically.
+std::atomic<bool> isPointRewritten {false};
+Point MakePoint(float x, float y) { isPointRewritten = true; return {x, y}; }
+float ReadAfterRewrite(const float & value)
+{
+    for(auto start = std::chrono::steady_clock::now(); !isPointRewritten && std::chrono::steady_clock::now() - start < std::chrono::milliseconds(10); ) std::this_thread::yield();
+    if(isPointRewritten) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return value;
+}
+
+// Used by TestEventWithoutParameters
+size_t pingCount = 0;
+void CountPing() { ++pingCount; }
+
+// Used by TestAsyncInvocation. Fetch() stands in for an asynchronous source, returning a future which the test completes later, from another thread.
+Promise<float> pendingFetch;
+Future<float> Fetch(float) { pendingFetch = Promise<float>(); return pendingFetch.GetFuture(); }
+
+// Used by the EventQueue tests. Record() counts each id it is called with, throwing for negative ids, and waits while the gate is closed.
+std::atomic<int> recordedIds[4000];
+std::atomic<bool> isGateOpen {true}, isWaitingAtGate {false};
+void Record(int id)
+{
+    if(id < 0) throw std::runtime_error("negative id");
+    while(!isGateOpen) { isWaitingAtGate = true; std::this_thread::yield(); }
+    ++recordedIds[id];
+}
+
+// Used by TestMemoizedLines
+std::atomic<int> squareCalls {0};
+float Square(float x) { ++squareCalls; return x*x; }
+
+// Used by TestHighArityCalls. Records the order in which its arguments arrive, as digits, and writes through its reference parameters.
+double Digits(int a, float b, const double & c, short d, int & e, long long f, const Point & g, unsigned h, float & i, char j, int k)
+{
+    e = 50; i = 90.0f;
+    return ((((((((((a*10.0 + b)*10 + c)*10 + d)*10 + 5)*10 + f)*10 + g.x)*10 + h)*10 + 9)*10 + j)*10 + k);
+}
+
+// Used by TestInstancesOutliveTheirType
+std::atomic<int> countedDestructions {0};
+struct Counted { int value = 7; ~Counted() { ++countedDestructions; } };
+
+TypeLibrary types;
+NodeType tickType;
+
+NodeType GetFunctionNodeType(const char * name)
+{
+    if(auto function = types.GetFunction(name)) return NodeType::MakeFunctionNode(*function);
+    throw std::runtime_error(std::string("Missing function ") + name);
+}
+
+Node MakeNode(const NodeType & type, std::vector<Node::Wire> inputs, int next = -1)
+{
+    Node node(type, 0, 0);
+    node.inputs = move(inputs);
+    node.flowOutputIndex = next;
+    return node;
+}
+
+// The graph used by TestTranspiledMatchesInterpreted: on Tick(x, acc), loops over 1..3, adding Point{x+0.5, x}.x * .y to acc each time, and then adds x to acc
+std::vector<Node> MakeTranspileGraph()
+{
+    auto add = GetFunctionNodeType("+"), mul = GetFunctionNodeType("*"), accumulate = GetFunctionNodeType("Add");
+    auto build = NodeType::MakeBuildNode(types.DeduceType<Point>()), split = NodeType::MakeSplitNode(types.DeduceType<Point>());
+    std::vector<Node> nodes = {
+        MakeNode(tickType, {}, 1),                                                  // 0: Tick(x, acc)
+        MakeNode(NodeType::MakeLoopNode(types.DeduceType<int>()), {{-1,-1,"1"}, {-1,-1,"3"}}, 6),  // 1: for 1..3 do #5, then #6
+        MakeNode(add, {{0,0}, {-1,-1,"0.5"}}),                                      // 2: x + 0.5
+        MakeNode(build, {{2,0}, {0,0}}),                                            // 3: Point{#2, x}
+        MakeNode(split, {{3,0}}),                                                   // 4: #3.x, #3.y
+        MakeNode(accumulate, {{0,1}, {7,0}}),                                       // 5: acc.Add(#7)
+        MakeNode(accumulate, {{0,1}, {4,1}}),                                       // 6: acc.Add(#4.y)
+        MakeNode(mul, {{4,0}, {4,1}}),                                              // 7: #4.x * #4.y
+    };
+    nodes[1].subflowIndices = {5};
+    return nodes;
+}
+
+// The output of TranspileGraph(MakeTranspileGraph(), 0, "TickTranspiled"). If the transpiler's output changes, TestTranspiledMatchesInterpreted fails,
+// and both the function below and this string must be regenerated from the new output.
+const char * const transpiledSource = R"(// Generated by TranspileGraph() from a graph of 8 nodes. Changes to this function will be lost if it is regenerated.
+void TickTranspiled(float a0, Accumulator & a1)
+{
+    const int c0 = 1;
+    const int c1 = 3;
+    const float c2 = 0.5f;
+    if(c0 <= c1) for(int v1_0 = c0; ; ++v1_0)
+    {
+        float v2_0 = (a0 + c2);
+        Point v3_0;
+        v3_0.x = v2_0;
+        v3_0.y = a0;
+        auto & v4_0 = v3_0.x;
+        auto & v4_1 = v3_0.y;
+        float v5_0 = (v4_0 * v4_1);
+        a1.Add(v5_0);
+        if(v1_0 >= c1) break;
+    }
+    float v8_0 = (a0 + c2);
+    Point v9_0;
+    v9_0.x = v8_0;
+    v9_0.y = a0;
+    auto & v10_1 = v9_0.y;
+    a1.Add(v10_1);
+}
+)";
+
+// Generated by TranspileGraph() from a graph of 8 nodes. Changes to this function will be lost if it is regenerated.
+void TickTranspiled(float a0, Accumulator & a1)
+{
+    const int c0 = 1;
+    const int c1 = 3;
+    const float c2 = 0.5f;
+    if(c0 <= c1) for(int v1_0 = c0; ; ++v1_0)
+    {
+        float v2_0 = (a0 + c2);
+        Point v3_0;
+        v3_0.x = v2_0;
+        v3_0.y = a0;
+        auto & v4_0 = v3_0.x;
+        auto & v4_1 = v3_0.y;
+        float v5_0 = (v4_0 * v4_1);
+        a1.Add(v5_0);
+        if(v1_0 >= c1) break;
+    }
+    float v8_0 = (a0 + c2);
+    Point v9_0;
+    v9_0.x = v8_0;
+    v9_0.y = a0;
+    auto & v10_1 = v9_0.y;
+    a1.Add(v10_1);
+}
+
+///////////
+// Tests //
+///////////
+
+// Once a context has been bound to a program, invoking it again must not allocate, whether through the context, through the calling thread's cached
+// context, or through an Event. The graph exercises function nodes, build and split nodes, and a method call on a reference argument.
+void TestInvokeDoesNotAllocate()
+{
+    auto add = GetFunctionNodeType("+"), mul = GetFunctionNodeType("*"), accumulate = GetFunctionNodeType("Add");
+    auto build = NodeType::MakeBuildNode(types.DeduceType<Point>()), split = NodeType::MakeSplitNode(types.DeduceType<Point>());
+    std::vector<Node> nodes = {
+        MakeNode(tickType, {}, 1),                          // 0: Tick(x, acc)
+        MakeNode(accumulate, {{0,1}, {5,0}}),               // 1: acc.Add(#5)
+        MakeNode(add, {{0,0}, {0,0}}),                      // 2: x + x
+        MakeNode(build, {{2,0}, {0,0}}),                    // 3: Point{#2, x}
+        MakeNode(split, {{3,0}}),                           // 4: #3.x, #3.y
+        MakeNode(mul, {{4,0}, {4,1}}),                      // 5: #4.x * #4.y
+    };
+    Event<void(float, Accumulator &)> tick = Compile(nodes, 0);
+
+    ExecutionContext context;
+    Accumulator acc;
+    tick(context, 2.0f, acc);
+    tick(2.0f, acc);
+    CHECK(acc.total == 16.0f);
+
+    const size_t before = allocationCount;
+    for(int i=0; i<1000; ++i) tick(context, 2.0f, acc);
+    for(int i=0; i<1000; ++i) tick(2.0f, acc);
+    CHECK(allocationCount == before);
+    CHECK(acc.total == 8.0f * 2002);
+}
+
+// Functions and node types construct their results in storage provided by the caller, without allocating, while the compatibility forms return results on the heap
+void TestCallerProvidedOutputs()
+{
+    auto & add = *types.GetFunction("+");
+    auto build = NodeType::MakeBuildNode(types.DeduceType<Point>()), split = NodeType::MakeSplitNode(types.DeduceType<Point>());
+    float a = 1, b = 2, sum = 0;
+    void * args[] = {&a, &b};
+    Point point;
+    void * pointOutputs[] = {&point};
+    void * fieldOutputs[2] = {};
+
+    const size_t before = allocationCount;
+    CHECK(add.Invoke(args, &sum) == &sum);
+    build.Evaluate(args, pointOutputs);
+    void * pointArgs[] = {&point};
+    split.Evaluate(pointArgs, fieldOutputs);
+    CHECK(allocationCount == before);
+    CHECK(sum == 3.0f);
+    CHECK(point.x == 1.0f && point.y == 2.0f);
+    CHECK(fieldOutputs[0] == &point.x && fieldOutputs[1] == &point.y);
+
+    auto heapSum = add.Invoke(args);
+    CHECK(*reinterpret_cast<float *>(heapSum.get()) == 3.0f);
+    auto heapPoint = build.Evaluate(args);
+    CHECK(heapPoint.size() == 1 && reinterpret_cast<Point *>(heapPoint[0].get())->y == 2.0f);
+    void * heapPointArgs[] = {heapPoint[0].get()};
+    auto heapFields = split.Evaluate(heapPointArgs);
+    CHECK(heapFields.size() == 2 && heapFields[1].get() == &reinterpret_cast<Point *>(heapPoint[0].get())->y);
+}
+
+// The transpiled form of a graph, compiled as C++ and called through CompileFunction(), must have the same effects as the interpreted graph
+void TestTranspiledMatchesInterpreted()
+{
+    const auto nodes = MakeTranspileGraph();
+    CHECK(TranspileGraph(nodes, 0, "TickTranspiled") == transpiledSource);
+
+    Event<void(float, Accumulator &)> interpreted = Compile(nodes, 0), transpiled = CompileFunction(tickType, *types.GetFunction("TickTranspiled"));
+    for(float x : {0.0f, 1.0f, -2.5f, 0.125f, 1000.0f})
+    {
+        Accumulator expected, actual;
+        interpreted(x, expected);
+        transpiled(x, actual);
+        CHECK(expected.total == actual.total);
+        CHECK(std::abs(expected.total - (3*(x+0.5f)*x + x)) <= 1e-4f * (1 + std::abs(expected.total)));
+    }
+}
+
+// Float immediates which parse as infinities or NaN, as overflowing literals do on some standard libraries, have no C++ literal spelling, so the transpiler
+// must spell them through std::numeric_limits. Libraries which refuse to parse them must fail to compile the graph, rather than emitting invalid code.
+void TestTranspiledNonFiniteConstants()
+{
+    for(const char * immediate : {"1e39", "-1e39", "inf", "-inf", "nan"})
+    {
+        const std::vector<Node> nodes = {
+            MakeNode(tickType, {}, 1),                                  // 0: Tick(x, acc)
+            MakeNode(GetFunctionNodeType("Add"), {{0,1}, {-1,-1,immediate}}), // 1: acc.Add(immediate)
+        };
+        std::string source;
+        try { source = TranspileGraph(nodes, 0, "TickNonFinite"); }
+        catch(const std::runtime_error &) { continue; }
+        const auto begin = source.find("c0 = ") + 5;
+        const std::string value = source.substr(begin, source.find(';', begin) - begin);
+        CHECK(value.find("std::numeric_limits<float>::") != std::string::npos || std::isdigit(value[value[0] == '-' ? 1 : 0]));
+        CHECK(value.find("inf.") == std::string::npos && value.find("nan") == std::string::npos);
+    }
+}
+
+// A line which reads a reference into a slot, such as a field produced by a split node, must finish before a later line reuses that slot. The
+// program below reuses the slot of the first Point for the second, and both the read of the first Point's field and the construction of the second
+// Point are pure lines which become ready at the same time in the same parallel phase.
+void TestParallelAliasedSlots()
+{
+    auto add = GetFunctionNodeType("+"), makePoint = GetFunctionNodeType("MakePoint"), readAfterRewrite = GetFunctionNodeType("ReadAfterRewrite"), accumulate = GetFunctionNodeType("Add");
+    auto build = NodeType::MakeBuildNode(types.DeduceType<Point>()), split = NodeType::MakeSplitNode(types.DeduceType<Point>());
+    std::vector<Node> nodes = {
+        MakeNode(tickType, {}, 1),                          // 0: Tick(x, acc)
+        MakeNode(accumulate, {{0,1}, {8,0}}),               // 1: acc.Add(#8)
+        MakeNode(add, {{0,0}, {0,0}}),                      // 2: x + x
+        MakeNode(build, {{2,0}, {0,0}}),                    // 3: Point{#2, x}
+        MakeNode(split, {{3,0}}),                           // 4: #3.x, #3.y
+        MakeNode(readAfterRewrite, {{4,0}}),                // 5: ReadAfterRewrite(#4.x)
+        MakeNode(makePoint, {{0,0}, {2,0}}),                // 6: MakePoint(x, #2)
+        MakeNode(split, {{6,0}}),                           // 7: #6.x, #6.y
+        MakeNode(add, {{5,0}, {7,1}}),                      // 8: #5 + #7.y
+    };
+    CompileStats stats;
+    Event<void(float, Accumulator &)> tick = Compile(nodes, 0, stats);
+    CHECK(stats.numSlotsAfterAllocation < stats.numSlotsBeforeAllocation);
+
+    ThreadPool pool(3);
+    ExecutionContext context;
+    for(int i=0; i<8; ++i)
+    {
+        Accumulator acc;
+        isPointRewritten = false;
+        tick.InvokeParallel(context, pool, 1.0f, acc);
+        CHECK(acc.total == 4.0f);
+    }
+}
+
+// Editing an IncrementalCompiler's graph must produce the same program as compiling the edited graph afresh. Edits rewire the nodes of generated graphs
+// at random, including copying the inputs of a node of the same type so that pure nodes are merged, and then editing either of them so that they are not.
+void TestIncrementalMatchesCompile()
+{
+    const std::vector<NodeType> nodeTypes = {GetFunctionNodeType("+"), GetFunctionNodeType("*"), GetFunctionNodeType("Add")};
+    auto check = [](IncrementalCompiler & compiler)
+    {
+        CompileStats expectedStats;
+        Event<void(float, Accumulator &)> actual = compiler.GetProgram(), expected = Compile(compiler.GetNodes(), 0, expectedStats);
+        auto & stats = compiler.GetStats();
+        CHECK(stats.numLines == expectedStats.numLines && stats.numMergedNodes == expectedStats.numMergedNodes && stats.numFoldedLines == expectedStats.numFoldedLines);
+        for(float x : {0.0f, 0.5f, -3.0f})
+        {
+            Accumulator expectedAcc, actualAcc;
+            expected(x, expectedAcc);
+            actual(x, actualAcc);
+            CHECK(expectedAcc.total == actualAcc.total || (std::isnan(expectedAcc.total) && std::isnan(actualAcc.total)));
+        }
+    };
+
+    for(auto shape : {DeepChain, WideFanOut, Diamonds, FlowSequence})
+    {
+        std::mt19937 rng(static_cast<unsigned>(shape));
+        auto random = [&](size_t n) { return std::uniform_int_distribution<size_t>(0, n-1)(rng); };
+        IncrementalCompiler compiler(GenerateGraph(tickType, nodeTypes, shape, 300, 1), 0);
+        check(compiler);
+
+        for(int round=0; round<40; ++round)
+        {
+            for(int edit = static_cast<int>(random(3)); edit >= 0; --edit)
+            {
+                const int index = 1 + static_cast<int>(random(compiler.GetNodes().size() - 1));
+                const auto & node = compiler.GetNodes()[index];
+                const int pin = node.type.HasInFlow() ? 1 : static_cast<int>(random(2)); // Every input is a float, except for the object of Add
+                switch(random(3))
+                {
+                case 0: compiler.SetImmediate(index, pin, std::to_string(static_cast<int>(random(3)))); break;
+                case 1: // Wire to the event's float argument or to an earlier pure node
+                    if(const int source = static_cast<int>(random(index))) { if(!compiler.GetNodes()[source].type.HasInFlow()) compiler.SetWire(index, pin, source, 0); }
+                    else compiler.SetWire(index, pin, 0, 0);
+                    break;
+                case 2: // Copy the inputs of another node of the same type, so that the two are merged if both are used
+                    for(int other=1; other<index; ++other) if(compiler.GetNodes()[other].type.GetUniqueId() == node.type.GetUniqueId() && random(4) == 0)
+                    {
+                        const auto inputs = compiler.GetNodes()[other].inputs;
+                        for(int i=0; i<static_cast<int>(inputs.size()); ++i)
+                        {
+                            if(inputs[i].nodeIndex < 0) compiler.SetImmediate(index, i, inputs[i].immediate);
+                            else compiler.SetWire(index, i, inputs[i].nodeIndex, inputs[i].pinIndex);
+                        }
+                        break;
+                    }
+                    break;
+                }
+            }
+            check(compiler);
+        }
+
+        // An edit to the last node in the flow emits only the lines of the last step
+        const auto & nodes = compiler.GetNodes();
+        int last = 0;
+        while(nodes[last].flowOutputIndex >= 0) last = nodes[last].flowOutputIndex;
+        compiler.SetImmediate(last, 1, "7");
+        check(compiler);
+        CHECK(compiler.GetStats().numEmittedLines * 4 < compiler.GetStats().numLines);
+    }
+}
+
+// A saved program loads and runs as the original does, even into a library which also binds functions it does not use, and binds them in another order. 
+// Truncated or corrupted data must be rejected with an error, rather than crashing, or allocating storage for counts and slot indices which the data cannot hold.
+void TestSavedProgramLoading()
+{
+    const std::vector<NodeType> nodeTypes = {tickType, GetFunctionNodeType("+"), GetFunctionNodeType("*"), GetFunctionNodeType("Add"), NodeType::MakeBuildNode(types.DeduceType<Point>()), NodeType::MakeSplitNode(types.DeduceType<Point>())};
+    const Program program = Compile(MakeTranspileGraph(), 0);
+    const auto bytes = SaveProgram(program);
+
+    TypeLibrary library;
+    library.BindPureFunction(&ops::add, "Unrelated", {"",""});
+    library.BindClass<Accumulator>("Accumulator").HasMethod(&Accumulator::Add, "Add", {"value"});
+    library.BindClass<Point>("Point").HasField(&Point::x, "x").HasField(&Point::y, "y");
+    library.BindPureFunction(&ops::mul, "*", {"",""});
+    library.BindPureFunction(&ops::add, "+", {"",""});
+    library.DeduceType<int>();
+    std::vector<NodeType> libraryNodeTypes = {NodeType::MakeEventNode("Tick", {library.DeduceVarType<float>(), library.DeduceVarType<Accumulator &>()})};
+    for(auto name : {"+", "*", "Add"}) libraryNodeTypes.push_back(NodeType::MakeFunctionNode(*library.GetFunction(name)));
+    libraryNodeTypes.push_back(NodeType::MakeBuildNode(library.DeduceType<Point>()));
+    libraryNodeTypes.push_back(NodeType::MakeSplitNode(library.DeduceType<Point>()));
+
+    Event<void(float, Accumulator &)> original = program, loaded = LoadProgram(bytes.data(), bytes.size(), library, libraryNodeTypes);
+    Accumulator expected, actual;
+    original(2.0f, expected);
+    loaded(2.0f, actual);
+    CHECK(expected.total == actual.total);
+
+    for(size_t size=0; size<bytes.size(); ++size)
+    {
+        bool isRejected = false;
+        try { LoadProgram(bytes.data(), size, types, nodeTypes); }
+        catch(const std::runtime_error &) { isRejected = true; }
+        CHECK(isRejected);
+    }
+    for(size_t offset=0; offset+4<=bytes.size(); ++offset)
+    {
+        auto corrupt = bytes;
+        memset(corrupt.data() + offset, 0xFF, 4);
+        try { LoadProgram(corrupt.data(), corrupt.size(), types, nodeTypes); }
+        catch(const std::runtime_error &) {}
+    }
+}
+
+// An event which takes no parameters can be invoked in every way an event with parameters can, including batched and suspendable invocation
+void TestEventWithoutParameters()
+{
+    std::vector<Node> nodes = {MakeNode(NodeType::MakeEventNode("Ping", {}), {}, 1), MakeNode(GetFunctionNodeType("CountPing"), {})};
+    Event<void()> ping = Compile(nodes, 0);
+    ExecutionContext context;
+    std::tuple<> tuples[3];
+    pingCount = 0;
+    ping();
+    ping(context);
+    ping.InvokeBatch(context, 4);
+    ping.InvokeBatch(tuples, 3);
+    ping.Start().Wait();
+    CHECK(pingCount == 10);
+}
+
+// Subgraph nodes which share a name must not share a cached program when their linkage or their subgraphs differ. Each graph adds
+// Step(x) to acc, where Step is either x+2 or x*2, and is either inlined or shared.
+void TestProgramCacheKeysSubgraphs()
+{
+    auto input = NodeType::MakeSubgraphInputNode("Step", {{"x", types.DeduceVarType<float>()}});
+    auto output = NodeType::MakeSubgraphOutputNode("Step", {{"y", types.DeduceVarType<float>()}});
+    auto makeStep = [&](const char * op) { return Subgraph{"Step", {MakeNode(input, {}), MakeNode(output, {{2,0}}), MakeNode(GetFunctionNodeType(op), {{0,0}, {-1,-1,"2"}})}, 0, 1}; };
+
+    ProgramCache cache(8);
+    auto compile = [&](const NodeType & stepType)
+    {
+        std::vector<Node> nodes = {MakeNode(tickType, {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {2,0}}), MakeNode(stepType, {{0,0}})};
+        Event<void(float, Accumulator &)> tick = cache.Compile(nodes, 0);
+        Accumulator acc;
+        tick(3.0f, acc);
+        return acc.total;
+    };
+    CHECK(compile(MakeSubgraphNode(makeStep("+"), InlineSubgraph)) == 5.0f);
+    CHECK(compile(MakeSubgraphNode(makeStep("+"), SharedSubgraph)) == 5.0f);
+    CHECK(compile(MakeSubgraphNode(makeStep("*"), InlineSubgraph)) == 6.0f);
+    CHECK(compile(MakeSubgraphNode(makeStep("*"), SharedSubgraph)) == 6.0f);
+    CHECK(cache.GetMissCount() == 4 && cache.GetHitCount() == 0);
+    CHECK(compile(MakeSubgraphNode(makeStep("*"), InlineSubgraph)) == 6.0f);
+    CHECK(cache.GetMissCount() == 4 && cache.GetHitCount() == 1);
+}
+
+// A released block is reused by the next allocation, blocks released on another thread return to the shared list when that thread exits, and Trim() frees them
+void TestInstancePoolReuse()
+{
+    InstancePool pool;
+    auto a = pool.Allocate(32);
+    pool.Release(a);
+    auto b = pool.Allocate(32);
+    CHECK(a == b);
+    auto stats = pool.GetStats();
+    CHECK(stats.blockSize == 32 && stats.allocatedBlocks == 1 && stats.reusedBlocks == 1 && stats.liveBlocks == 1);
+
+    std::vector<void *> blocks = {b};
+    while(blocks.size() < 100) blocks.push_back(pool.Allocate(32));
+    std::thread([&]() { for(auto block : blocks) pool.Release(block); }).join();
+    stats = pool.GetStats();
+    CHECK(stats.allocatedBlocks == 100 && stats.liveBlocks == 0 && stats.freeBlocks == 100);
+
+    for(auto & block : blocks) block = pool.Allocate(32);
+    CHECK(pool.GetStats().allocatedBlocks == 100);
+    for(auto block : blocks) pool.Release(block);
+    pool.Trim();
+    CHECK(pool.GetStats().freeBlocks == 0);
+}
+
+// Instances constructed while a scope is active come from its arena, and once they are released, Reset() reuses their chunk rather than allocating another.
+// Instances which are alive when the arena is reset keep their chunk, and remain valid.
+void TestInstanceArenaScope()
+{
+    auto & pointType = types.DeduceType<Point>();
+    const Point p {1, 2};
+    const size_t pooled = pointType.GetPool().GetStats().liveBlocks;
+    InstanceArena arena(1024);
+    {
+        std::vector<std::shared_ptr<void>> instances;
+        InstanceArena::Scope scope(arena);
+        CHECK(InstanceArena::GetCurrent() == &arena);
+        for(int i=0; i<100; ++i) instances.push_back(pointType.CopyConstruct(&p));
+        CHECK(pointType.GetPool().GetStats().liveBlocks == pooled);
+    }
+    CHECK(InstanceArena::GetCurrent() == nullptr);
+    auto stats = arena.GetStats();
+    CHECK(stats.instances == 100 && stats.allocatedChunks > 1);
+
+    arena.Reset();
+    std::shared_ptr<void> kept;
+    {
+        InstanceArena::Scope scope(arena);
+        for(int i=0; i<100; ++i) kept = pointType.CopyConstruct(&p);
+    }
+    CHECK(arena.GetStats().allocatedChunks == stats.allocatedChunks);
+    arena.Reset();
+    CHECK(arena.GetStats().ownedChunks == stats.allocatedChunks - 1);
+    CHECK(static_cast<const Point *>(kept.get())->x == 1 && static_cast<const Point *>(kept.get())->y == 2);
+}
+
+// Pooled instances must remain valid after their type, and its pool, have been destroyed, whichever thread releases them
+void TestInstancesOutliveTheirType()
+{
+    std::shared_ptr<void> a, b;
+    {
+        TypeLibrary library;
+        auto & type = library.DeduceType<Counted>();
+        a = type.DefConstruct();
+        b = type.DefConstruct();
+        std::thread([&]() { type.DefConstruct(); }).join();
+    }
+    countedDestructions = 0;
+    CHECK(static_cast<const Counted *>(a.get())->value == 7);
+    a.reset();
+    std::thread([&]() { b.reset(); }).join();
+    CHECK(countedDestructions == 2);
+}
+
+// Start() must suspend at a line whose future is not ready, and resume on the thread which completes it, with its value, or with its exception
+void TestAsyncInvocation()
+{
+    std::vector<Node> nodes = {MakeNode(tickType, {}, 1), MakeNode(GetFunctionNodeType("Fetch"), {{0,0}}, 2), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {1,0}})};
+    Event<void(float, Accumulator &)> tick = Compile(nodes, 0);
+    for(bool isRejected : {false, true})
+    {
+        Accumulator acc;
+        std::atomic<bool> isCompleted {false};
+        std::thread::id completedOn;
+        auto invocation = tick.Start([&]() { completedOn = std::this_thread::get_id(); isCompleted = true; }, 3.0f, acc);
+        CHECK(!invocation.IsComplete() && !isCompleted && acc.total == 0);
+
+        std::thread resolver([&]()
+        {
+            if(isRejected) pendingFetch.SetException(std::make_exception_ptr(std::runtime_error("fetch failed")));
+            else pendingFetch.SetValue(5.0f);
+        });
+        const auto resolverId = resolver.get_id();
+        resolver.join();
+        CHECK(invocation.IsComplete() && isCompleted && completedOn == resolverId);
+
+        bool threw = false;
+        try { invocation.Wait(); } catch(const std::runtime_error & e) { threw = std::string(e.what()) == "fetch failed"; }
+        CHECK(threw == isRejected);
+        CHECK(acc.total == (isRejected ? 0 : 5.0f));
+    }
+}
+
+// On Item(id), calls Record(id)
+Program MakeRecordProgram()
+{
+    return Compile({MakeNode(NodeType::MakeEventNode("Item", {types.DeduceVarType<int>()}), {}, 1), MakeNode(GetFunctionNodeType("Record"), {{0,0}})}, 0);
+}
+
+// Events posted concurrently by several producers are each dispatched exactly once, and are counted by GetStats()
+void TestQueueDispatchesEveryEvent()
+{
+    for(auto & count : recordedIds) count = 0;
+    QueuedEvent<void(int)> item(MakeRecordProgram(), 64, 2);
+    std::atomic<int> refused {0};
+    std::vector<std::thread> producers;
+    for(int p=0; p<4; ++p) producers.emplace_back([&, p]() { for(int i=p; i<4000; i+=4) if(!item(i)) ++refused; });
+    for(auto & producer : producers) producer.join();
+    item.Flush();
+    CHECK(refused == 0);
+
+    for(auto & count : recordedIds) CHECK(count == 1);
+    auto stats = item.GetStats();
+    CHECK(stats.capacity == 64 && stats.depth == 0 && stats.maxDepth <= 64);
+    CHECK(stats.posted == 4000 && stats.dispatched == 4000 && stats.rejected == 0 && stats.failed == 0 && stats.batches > 0);
+}
+
+// A full queue which rejects events returns false from Post() and counts the event, without queueing it
+void TestQueueRejectsWhenFull()
+{
+    for(auto & count : recordedIds) count = 0;
+    QueuedEvent<void(int)> item(MakeRecordProgram(), 4, 1, EventQueue::Reject);
+    isGateOpen = false;
+    isWaitingAtGate = false;
+    CHECK(item(0));
+    while(!isWaitingAtGate) std::this_thread::yield();
+
+    int accepted = 1, rejected = 0;
+    for(int i=1; i<100; ++i) (item(i) ? accepted : rejected)++;
+    isGateOpen = true;
+    item.Flush();
+
+    CHECK(rejected > 0 && accepted <= 1 + 4);
+    auto stats = item.GetStats();
+    CHECK(stats.rejected == static_cast<uint64_t>(rejected) && stats.posted == static_cast<uint64_t>(accepted) && stats.dispatched == static_cast<uint64_t>(accepted));
+    for(int i=0; i<accepted; ++i) CHECK(recordedIds[i] == 1);
+}
+
+// An exception thrown while dispatching a batch is rethrown by the next call to Flush(), and only by that call
+void TestQueueRethrowsFromFlush()
+{
+    QueuedEvent<void(int)> item(MakeRecordProgram(), 16, 1);
+    CHECK(item(-1));
+    bool threw = false;
+    try { item.Flush(); } catch(const std::runtime_error & e) { threw = std::string(e.what()) == "negative id"; }
+    CHECK(threw);
+    CHECK(item.GetStats().failed == 1);
+    item.Flush();
+}
+
+// A memoizing context reruns a pure line only when its inputs change, and counts each reuse as a hit and each run as a miss. Other contexts are unaffected.
+void TestMemoizedLines()
+{
+    Event<void(float, Accumulator &)> tick = Compile({MakeNode(tickType, {}, 1), MakeNode(GetFunctionNodeType("Add"), {{0,1}, {2,0}}), MakeNode(GetFunctionNodeType("Square"), {{0,0}})}, 0);
+    ExecutionContext context, plain;
+    context.SetMemoizing(true);
+    CHECK(context.IsMemoizing() && !plain.IsMemoizing());
+    Accumulator acc;
+    squareCalls = 0;
+
+    for(int i=0; i<3; ++i) tick(context, 3.0f, acc);
+    CHECK(squareCalls == 1 && context.GetMemoMissCount() == 1 && context.GetMemoHitCount() == 2 && acc.total == 27);
+    tick(context, 4.0f, acc);
+    CHECK(squareCalls == 2 && context.GetMemoMissCount() == 2 && context.GetMemoHitCount() == 2 && acc.total == 43);
+    tick(context, 4.0f, acc);
+    tick(context, 3.0f, acc);
+    CHECK(squareCalls == 3 && context.GetMemoMissCount() == 3 && context.GetMemoHitCount() == 3 && acc.total == 68);
+
+    for(int i=0; i<2; ++i) tick(plain, 3.0f, acc);
+    CHECK(squareCalls == 5 && plain.GetMemoMissCount() == 0 && plain.GetMemoHitCount() == 0 && acc.total == 86);
+}
+
+// Program::Load() is the only check made on a program's lines, so it must reject every ill-formed program: lines which read slots holding values of other types, or which
+// may not have been written on some path, slots and jump targets outside of the program, missing constants, and lines whose slots do not match their node types
+void TestLoadRejectsIllFormedPrograms()
+{
+    auto add = GetFunctionNodeType("+"), accumulate = GetFunctionNodeType("Add"), split = NodeType::MakeSplitNode(types.DeduceType<Point>()), jump = NodeType::MakeJumpNode();
+    auto zero = std::make_shared<float>(0.0f);
+    auto load = [&](std::vector<std::shared_ptr<void>> constants, std::vector<Program::Line> lines, const char * error)
+    {
+        try { Program::Load(move(constants), move(lines)); }
+        catch(const std::runtime_error & e) { return std::string(e.what()).find(error) != std::string::npos; }
+        return false;
+    };
+
+    // On Tick(x, acc), adds x+x to acc
+    Event<void(float, Accumulator &)> valid = Program::Load({}, {{tickType, {}, {0,1}, {}}, {add, {0,0}, {2}, {}}, {accumulate, {1,2}, {}, {}}});
+    Accumulator acc;
+    valid(2.0f, acc);
+    CHECK(acc.total == 4);
+
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {split, {0}, {2,3}, {}}}, "different type"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {add, {0,2}, {2}, {}}}, "not been written"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {jump, {}, {}, {3}}, {add, {0,0}, {2}, {}}, {accumulate, {1,2}, {}, {}}}, "not been written"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {add, {0,1000}, {2}, {}}}, "outside of the program"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {add, {0,size_t(-1)}, {2}, {}}}, "outside of the program"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {add, {0,0}, {size_t(-1)}, {}}}, "outside of the program"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {jump, {}, {}, {3}}}, "outside of the program"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {jump, {}, {}, {0}}}, "outside of the program"));
+    CHECK(load({zero, nullptr}, {{tickType, {}, {2,3}, {}}, {add, {0,1}, {4}, {}}}, "missing constant"));
+    CHECK(load({zero}, {{tickType, {}, {1,2}, {}}, {add, {0,0}, {0}, {}}}, "constant slot"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {add, {0}, {2}, {}}}, "slot count"));
+    CHECK(load({}, {{tickType, {}, {0,1}, {}}, {jump, {}, {}, {}}}, "target count"));
+    CHECK(load({}, {{add, {0,0}, {2}, {}}}, "event node"));
+}
+
+// A branch node runs only the flow of the side its condition selects, then passes execution on, including when one side is empty
+void TestBranchRunsOneSide()
+{
+    auto branch = NodeType::MakeBranchNode(types.DeduceType<bool>()), accumulate = GetFunctionNodeType("Add");
+    for(bool hasFalseSide : {true, false})
+    {
+        // On Tick(x, acc), adds 10 to acc if x < 2, otherwise adds 20 if the false side is present, then adds x
+        std::vector<Node> nodes = {
+            MakeNode(tickType, {}, 1),                                  // 0: Tick(x, acc)
+            MakeNode(branch, {{2,0}}, 5),                               // 1: if #2 then #3 else #4, then #5
+            MakeNode(GetFunctionNodeType("<"), {{0,0}, {-1,-1,"2"}}),   // 2: x < 2
+            MakeNode(accumulate, {{0,1}, {-1,-1,"10"}}),                // 3: acc.Add(10)
+            MakeNode(accumulate, {{0,1}, {-1,-1,"20"}}),                // 4: acc.Add(20)
+            MakeNode(accumulate, {{0,1}, {0,0}}),                       // 5: acc.Add(x)
+        };
+        nodes[1].subflowIndices = {3, hasFalseSide ? 4 : -1};
+        Event<void(float, Accumulator &)> tick = Compile(nodes, 0);
+        Accumulator taken, notTaken;
+        tick(1.0f, taken);
+        tick(3.0f, notTaken);
+        CHECK(taken.total == 11);
+        CHECK(notTaken.total == (hasFalseSide ? 23 : 3));
+    }
+}
+
+// A profiling context counts the calls to each line, and records each call, for as many calls as it was asked to. Exported profiles and traces must be valid JSON,
+// which parses back to the same values, and attribute each line to the node it was compiled from.
+void TestProfileExport()
+{
+    CompileStats stats;
+    Event<void(float, Accumulator &)> tick = Compile(MakeTranspileGraph(), 0, stats);
+    ExecutionContext context;
+    context.SetProfiling(true, 1000);
+    Accumulator acc;
+    tick(context, 2.0f, acc);
+    tick(context, 2.0f, acc);
+
+    const auto & profile = context.GetProfile();
+    std::vector<uint64_t> nodeCalls(8);
+    uint64_t totalCalls = 0;
+    CHECK(profile.lines.size() == stats.lineNodes.size());
+    for(size_t i=0; i<profile.lines.size(); ++i)
+    {
+        nodeCalls[stats.lineNodes[i]] += profile.lines[i].callCount;
+        totalCalls += profile.lines[i].callCount;
+        CHECK(profile.lines[i].maxTime <= profile.lines[i].totalTime);
+    }
+    CHECK(nodeCalls[0] == 2 && nodeCalls[5] == 6 && nodeCalls[6] == 2 && profile.calls.size() == totalCalls);
+
+    auto reparse = [](const JsonValue & value) { std::ostringstream ss; ss << value; return jsonFrom(ss.str()); };
+    const auto jProfile = SaveProfile(profile, stats.lineNodes), jTrace = SaveChromeTrace(profile, stats.lineNodes);
+    CHECK(reparse(jProfile) == jProfile && reparse(jTrace) == jTrace);
+    CHECK(jProfile.array().size() == profile.lines.size());
+    for(size_t i=0; i<profile.lines.size(); ++i)
+    {
+        const auto & jLine = jProfile[i];
+        CHECK(jLine["line"].number<size_t>() == i && jLine["node"].number<int>() == stats.lineNodes[i] && jLine["calls"].number<uint64_t>() == profile.lines[i].callCount);
+        CHECK(jLine["id"].string() == profile.lines[i].type.GetUniqueId() && jLine["total"].isNumber() && jLine["max"].isNumber());
+    }
+
+    const auto & jEvents = jTrace["traceEvents"].array();
+    CHECK(jEvents.size() == profile.calls.size());
+    double lastStart = 0;
+    for(size_t i=0; i<jEvents.size(); ++i)
+    {
+        const auto & jEvent = jEvents[i];
+        CHECK(jEvent["ph"].string() == "X" && jEvent["name"].isString() && jEvent["pid"].isNumber() && jEvent["tid"].isNumber());
+        CHECK(jEvent["ts"].number<double>() >= lastStart && jEvent["dur"].number<double>() >= 0);
+        CHECK(jEvent["args"]["line"].number<size_t>() == profile.calls[i].line && jEvent["args"]["node"].number<int>() == stats.lineNodes[profile.calls[i].line]);
+        lastStart = jEvent["ts"].number<double>();
+    }
+}
+
+// Functions with more than eight parameters, including references, are called with each argument in its place, by either form of Function::Invoke()
+void TestHighArityCalls()
+{
+    auto & digits = *types.GetFunction("Digits");
+    CHECK(digits.GetParamCount() == 11);
+    int a = 1, e = 5; float b = 2, i = 9; double c = 3; short d = 4; long long f = 6; Point g {7, 0}; unsigned h = 8; char j = 0; int k = 1;
+    void * args[] = {&a, &b, &c, &d, &e, &f, &g, &h, &i, &j, &k};
+    double result = 0;
+    CHECK(*static_cast<double *>(digits.Invoke(args, &result)) == 12345678901.0);
+    CHECK(e == 50 && i == 90.0f);
+
+    e = 5; i = 9; k = 2;
+    CHECK(*std::static_pointer_cast<double>(digits.Invoke(args)) == 12345678902.0);
+    CHECK(e == 50 && i == 90.0f);
+}
+
+// Each row of a batched invocation must produce the result which invoking it alone does, in every form of InvokeBatch(), including batches spanning several chunks
+void TestBatchRowsMatchInvoke()
+{
+    Event<void(float, Accumulator &)> tick = Compile(MakeTranspileGraph(), 0);
+    const size_t count = Program::MaxBatchChunk * 2 + 5;
+    std::vector<float> xs(count);
+    std::vector<Accumulator> expected(count);
+    for(size_t i=0; i<count; ++i)
+    {
+        xs[i] = static_cast<float>(i) * 0.25f - 3.0f;
+        tick(xs[i], expected[i]);
+    }
+
+    ExecutionContext context;
+    for(int form=0; form<4; ++form)
+    {
+        std::vector<Accumulator> actual(count);
+        std::vector<std::tuple<float, Accumulator &>> tuples;
+        for(size_t i=0; i<count; ++i) tuples.emplace_back(xs[i], actual[i]);
+        switch(form)
+        {
+        case 0: tick.InvokeBatch(count, xs.data(), actual.data()); break;
+        case 1: tick.InvokeBatch(context, count, xs.data(), actual.data()); break;
+        case 2: tick.InvokeBatch(tuples.data(), count); break;
+        case 3: tick.InvokeBatch(context, tuples.data(), count); break;
+        }
+        for(size_t i=0; i<count; ++i) CHECK(actual[i].total == expected[i].total);
+    }
+}
+
+int main() try
+{
+    types.BindPureFunction(&ops::add, "+", {"",""});
+    types.BindPureFunction(&ops::mul, "*", {"",""});
+    types.BindPureFunction(&ops::less, "<", {"",""});
+    types.BindClass<Point>("Point").HasField(&Point::x, "x").HasField(&Point::y, "y");
+    types.BindClass<Accumulator>("Accumulator").HasMethod(&Accumulator::Add, "Add", {"value"});
+    types.BindPureFunction(&MakePoint, "MakePoint", {"x", "y"});
+    types.BindPureFunction(&ReadAfterRewrite, "ReadAfterRewrite", {"value"});
+    types.BindFunction(&CountPing, "CountPing", {});
+    types.BindAsyncFunction(&Fetch, "Fetch", {"x"});
+    types.BindFunction(&Record, "Record", {"id"});
+    types.BindPureFunction(&Square, "Square", {"x"});
+    types.BindFunction(&Digits, "Digits", {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k"});
+    types.BindFunction(&TickTranspiled, "TickTranspiled", {"x", "acc"});
+    tickType = NodeType::MakeEventNode("Tick", {types.DeduceVarType<float>(), types.DeduceVarType<Accumulator &>()});
+
+    const struct { const char * name; void (* run)(); } tests[] = {
+        {"InvokeDoesNotAllocate", TestInvokeDoesNotAllocate},
+        {"CallerProvidedOutputs", TestCallerProvidedOutputs},
+        {"TranspiledMatchesInterpreted", TestTranspiledMatchesInterpreted},
+        {"TranspiledNonFiniteConstants", TestTranspiledNonFiniteConstants},
+        {"ParallelAliasedSlots", TestParallelAliasedSlots},
+        {"IncrementalMatchesCompile", TestIncrementalMatchesCompile},
+        {"SavedProgramLoading", TestSavedProgramLoading},
+        {"EventWithoutParameters", TestEventWithoutParameters},
+        {"ProgramCacheKeysSubgraphs", TestProgramCacheKeysSubgraphs},
+        {"InstancePoolReuse", TestInstancePoolReuse},
+        {"InstanceArenaScope", TestInstanceArenaScope},
+        {"InstancesOutliveTheirType", TestInstancesOutliveTheirType},
+        {"AsyncInvocation", TestAsyncInvocation},
+        {"QueueDispatchesEveryEvent", TestQueueDispatchesEveryEvent},
+        {"QueueRejectsWhenFull", TestQueueRejectsWhenFull},
+        {"QueueRethrowsFromFlush", TestQueueRethrowsFromFlush},
+        {"MemoizedLines", TestMemoizedLines},
+        {"LoadRejectsIllFormedPrograms", TestLoadRejectsIllFormedPrograms},
+        {"BranchRunsOneSide", TestBranchRunsOneSide},
+        {"ProfileExport", TestProfileExport},
+        {"HighArityCalls", TestHighArityCalls},
+        {"BatchRowsMatchInvoke", TestBatchRowsMatchInvoke},
+    };
+
+    int failures = 0;
+    for(auto & test : tests)
+    {
+        std::cout << test.name << "... ";
+        try { test.run(); std::cout << "passed" << std::endl; }
+        catch(const std::exception & e) { std::cout << "FAILED\n  " << e.what() << std::endl; ++failures; }
+    }
+    std::cout << (failures ? std::to_string(failures) + " test(s) failed" : "All tests passed") << std::endl;
+    return failures ? 1 : 0;
+}
+catch(const std::exception & e)
+{
+    std::cerr << e.what() << std::endl;
+    return -1;
+}
@@ -0,0 +1,244 @@
+#include "bytecode.h"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char programMagic[4] = {'M','I','R','P'};
+
+// Constants carry no type information of their own, so their types are recovered from the input pins which read them
+static std::vector<const Type *> GetConstantTypes(const std::vector<Program::Line> & lines, size_t numConstants)
+{
+    std::vector<const Type *> types(numConstants, nullptr);
+    for(auto & line : lines) for(size_t i=0; i<line.inputs.size(); ++i)
+    {
+        if(line.inputs[i] < numConstants && !types[line.inputs[i]]) types[line.inputs[i]] = line.type.GetInputs()[i].type.type;
+    }
+    return types;
+}
+
+// Hashes the unique id of a node type, along with the names, layouts and signatures of everything its lines depend on: the types of its pins, and for function
+// nodes, the function's signature. A program can therefore be loaded against any type library which agrees on the node types it uses, whatever else is bound.
+static uint64_t GetSignatureHash(const NodeType & nodeType)
+{
+    std::ostringstream ss;
+    ss << nodeType.GetUniqueId() << ' ' << nodeType.GetKind();
+    if(auto function = nodeType.GetFunction()) ss << " func " << *function << (function->IsPure() ? " pure" : "") << (function->IsAsync() ? " async" : "");
+    auto describePins = [&](const char * direction, const std::vector<NodeType::Pin> & pins)
+    {
+        for(auto & pin : pins)
+        {
+            auto & type = *pin.type.type;
+            ss << '\n' << direction << ' ' << pin.type << ' ' << type.kind << ' ' << type.size << (type.IsTrivial() ? " trivial" : "");
+            for(auto & field : type.fields) ss << ' ' << field.identifier << ':' << field.type;
+        }
+    };
+    describePins("in", nodeType.GetInputs());
+    describePins("out", nodeType.GetOutputs());
+
+    // Hash the description with 64-bit FNV-1a, as TypeLibrary::GetSignatureHash() does
+    uint64_t hash = 14695981039346656037ULL;
+    for(auto ch : ss.str()) hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+    return hash;
+}
+
+static bool MakeControlNodeType(const std::string & id, const TypeLibrary & library, NodeType & type)
+{
+    auto boolType = library.GetType(typeid(bool)), intType = library.GetType(typeid(int));
+    if(id == "jump") type = NodeType::MakeJumpNode();
+    else if(id == "branch" && boolType) type = NodeType::MakeBranchNode(*boolType);
+    else if(id == "loop" && intType) type = NodeType::MakeLoopNode(*intType);
+    else if(id == "loop end" && intType) type = NodeType::MakeLoopEndNode(*intType);
+    else return false;
+    return true;
+}
+
+/////////////
+// Writing //
+/////////////
+
+class ProgramWriter
+{
+    std::vector<char> & bytes;
+public:
+    ProgramWriter(std::vector<char> & bytes) : bytes(bytes) {}
+
+    void WriteBytes(const void * data, size_t size) { auto p = reinterpret_cast<const char *>(data); bytes.insert(end(bytes), p, p+size); }
+    void WriteU32(uint32_t value) { for(int i=0; i<4; ++i) bytes.push_back(static_cast<char>(value >> i*8)); }
+    void WriteU64(uint64_t value) { for(int i=0; i<8; ++i) bytes.push_back(static_cast<char>(value >> i*8)); }
+    void WriteString(const std::string & s) { WriteU32(static_cast<uint32_t>(s.size())); WriteBytes(s.data(), s.size()); }
+};
+
+std::vector<char> SaveProgram(const Program & program)
+{
+    const auto & constants = program.GetConstants();
+    const auto & lines = program.GetLines();
+
+    // Number the node types used by the program, and count its slots
+    std::vector<const NodeType *> nodeTypes;
+    std::unordered_map<std::string, uint32_t> nodeTypeIndices;
+    size_t numSlots = constants.size();
+    for(auto & line : lines)
+    {
+        if(nodeTypeIndices.insert({line.type.GetUniqueId(), static_cast<uint32_t>(nodeTypes.size())}).second) nodeTypes.push_back(&line.type);
+        for(auto slot : line.inputs) numSlots = std::max(numSlots, slot+1);
+        for(auto slot : line.outputs) numSlots = std::max(numSlots, slot+1);
+    }
+
+    std::vector<char> bytes;
+    ProgramWriter w(bytes);
+    w.WriteBytes(programMagic, sizeof(programMagic));
+    w.WriteU32(ProgramFormatVersion);
+    w.WriteU32(static_cast<uint32_t>(numSlots));
+
+    w.WriteU32(static_cast<uint32_t>(nodeTypes.size()));
+    for(auto type : nodeTypes)
+    {
+        w.WriteString(type->GetUniqueId());
+        w.WriteU64(GetSignatureHash(*type));
+    }
+
+    // Constants which are never read are stored as empty, and loaded as null
+    auto constantTypes = GetConstantTypes(lines, constants.size());
+    w.WriteU32(static_cast<uint32_t>(constants.size()));
+    for(size_t i=0; i<constants.size(); ++i)
+    {
+        if(!constantTypes[i] || !constants[i]) { w.WriteU32(0); continue; }
+        std::ostringstream ss; ss << *constantTypes[i];
+        if(!constantTypes[i]->IsTrivial()) throw std::runtime_error("Unable to save program - Constant is of non-trivial type "+ss.str());
+        if(constantTypes[i]->size == 0) throw std::runtime_error("Unable to save program - Constant is of empty type "+ss.str());
+        w.WriteU32(static_cast<uint32_t>(constantTypes[i]->size));
+        w.WriteBytes(constants[i].get(), constantTypes[i]->size);
+    }
+
+    w.WriteU32(static_cast<uint32_t>(lines.size()));
+    for(auto & line : lines)
+    {
+        w.WriteU32(nodeTypeIndices[line.type.GetUniqueId()]);
+        w.WriteU32(static_cast<uint32_t>(line.inputs.size()));
+        w.WriteU32(static_cast<uint32_t>(line.outputs.size()));
+        w.WriteU32(static_cast<uint32_t>(line.targets.size()));
+        for(auto slot : line.inputs) w.WriteU32(static_cast<uint32_t>(slot));
+        for(auto slot : line.outputs) w.WriteU32(static_cast<uint32_t>(slot));
+        for(auto target : line.targets) w.WriteU32(static_cast<uint32_t>(target));
+    }
+    return bytes;
+}
+
+/////////////
+// Reading //
+/////////////
+
+class ProgramReader
+{
+    const char * data, * end;
+public:
+    ProgramReader(const void * data, size_t size) : data(reinterpret_cast<const char *>(data)), end(this->data + size) {}
+
+    const char * ReadBytes(size_t size) { if(size > static_cast<size_t>(end - data)) throw std::runtime_error("Unable to load program - Unexpected end of data!"); auto p = data; data += size; return p; }
+    uint32_t ReadU32() { auto p = reinterpret_cast<const unsigned char *>(ReadBytes(4)); uint32_t value = 0; for(int i=0; i<4; ++i) value |= static_cast<uint32_t>(p[i]) << i*8; return value; }
+    uint64_t ReadU64() { auto p = reinterpret_cast<const unsigned char *>(ReadBytes(8)); uint64_t value = 0; for(int i=0; i<8; ++i) value |= static_cast<uint64_t>(p[i]) << i*8; return value; }
+    std::string ReadString() { auto size = ReadU32(); auto p = ReadBytes(size); return std::string(p, p+size); }
+
+    // Reads the number of items in a list, each of which takes at least minItemSize bytes, so that a corrupt count fails here rather than allocating storage for the list
+    size_t ReadCount(size_t minItemSize) { auto count = ReadU32(); if(count > static_cast<size_t>(end - data) / minItemSize) throw std::runtime_error("Unable to load program - Count exceeds the remaining data!"); return count; }
+};
+
+Program LoadProgram(const void * data, size_t size, const TypeLibrary & library, const std::vector<NodeType> & nodeTypes)
+{
+    ProgramReader r(data, size);
+    if(memcmp(r.ReadBytes(sizeof(programMagic)), programMagic, sizeof(programMagic)) != 0) throw std::runtime_error("Unable to load program - Data is not a program!");
+    if(r.ReadU32() != ProgramFormatVersion) throw std::runtime_error("Unable to load program - Unsupported format version!");
+    const size_t numSlots = r.ReadU32();
+
+    // Resolve node types, falling back to the control node types, as the jump and loop end lines emitted for control nodes have no node type of their own in a graph.
+    // Only the node types the program uses must match the ones it was saved with, so that binding unrelated types and functions does not invalidate saved programs.
+    std::unordered_map<std::string, const NodeType *> nodeTypesById;
+    for(auto & type : nodeTypes) nodeTypesById[type.GetUniqueId()] = &type;
+    std::vector<NodeType> programNodeTypes(r.ReadCount(12));
+    for(auto & type : programNodeTypes)
+    {
+        auto id = r.ReadString();
+        auto it = nodeTypesById.find(id);
+        if(it != end(nodeTypesById)) type = *it->second;
+        else if(!MakeControlNodeType(id, library, type)) throw std::runtime_error("Unable to load program - Unrecognized node type: "+id);
+        if(r.ReadU64() != GetSignatureHash(type)) throw std::runtime_error("Unable to load program - Node type "+id+" does not match the one the program was saved with!");
+    }
+
+    // Constants are read before the lines, but are given types afterwards, by the input pins which read them
+    std::vector<std::pair<const char *, size_t>> constantBytes(r.ReadCount(4));
+    for(auto & constant : constantBytes)
+    {
+        constant.second = r.ReadU32();
+        constant.first = r.ReadBytes(constant.second);
+    }
+
+    // Every slot is either a constant or written by an output, so the slot count is bounded before Program::Load() lays out storage for it
+    std::vector<Program::Line> lines(r.ReadCount(16));
+    size_t numOutputs = 0;
+    auto readSlot = [&]() -> size_t { auto slot = r.ReadU32(); if(slot >= numSlots) throw std::runtime_error("Unable to load program - Slot index out of range!"); return slot; };
+    for(auto & line : lines)
+    {
+        auto typeIndex = r.ReadU32();
+        if(typeIndex >= programNodeTypes.size()) throw std::runtime_error("Unable to load program - Node type index out of range!");
+        line.type = programNodeTypes[typeIndex];
+        const size_t numInputs = r.ReadCount(4), numLineOutputs = r.ReadCount(4), numTargets = r.ReadCount(4);
+        if(numInputs != line.type.GetInputs().size() || numLineOutputs != line.type.GetOutputs().size()) throw std::runtime_error("Unable to load program - Line slot count does not match node type!");
+        line.inputs.resize(numInputs);
+        line.outputs.resize(numLineOutputs);
+        line.targets.resize(numTargets);
+        for(auto & slot : line.inputs) slot = readSlot();
+        for(auto & slot : line.outputs) slot = readSlot();
+        for(auto & target : line.targets) target = r.ReadU32();
+        numOutputs += numLineOutputs;
+    }
+    if(numSlots > constantBytes.size() + numOutputs) throw std::runtime_error("Unable to load program - Slot count exceeds the slots the lines can write!");
+
+    auto constantTypes = GetConstantTypes(lines, constantBytes.size());
+    std::vector<std::shared_ptr<void>> constants;
+    for(size_t i=0; i<constantBytes.size(); ++i)
+    {
+        auto type = constantTypes[i];
+        if(!type) { constants.push_back(nullptr); continue; }
+        if(!type->IsTrivial() || type->size != constantBytes[i].second) throw std::runtime_error("Unable to load program - Constant does not match the type of the pins which read it!");
+        auto bytes = constantBytes[i].first;
+        constants.push_back(type->Construct([=](void * l) { memcpy(l, bytes, type->size); }));
+    }
+    return Program::Load(move(constants), move(lines));
+}
+
+Program LoadProgramFile(const std::string & path, const TypeLibrary & library, const std::vector<NodeType> & nodeTypes)
+{
+    // Map the file into memory for the duration of the load
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if(file == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open "+path);
+    LARGE_INTEGER size; GetFileSizeEx(file, &size);
+    HANDLE mapping = size.QuadPart ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    const void * data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    struct Unmap { HANDLE file, mapping; const void * data; ~Unmap() { if(data) UnmapViewOfFile(data); if(mapping) CloseHandle(mapping); CloseHandle(file); } } unmap = {file, mapping, data};
+    if(size.QuadPart && !data) throw std::runtime_error("Unable to map "+path);
+    return LoadProgram(data, static_cast<size_t>(size.QuadPart), library, nodeTypes);
+#else
+    int file = open(path.c_str(), O_RDONLY);
+    if(file < 0) throw std::runtime_error("Unable to open "+path);
+    struct stat st; fstat(file, &st);
+    const size_t size = static_cast<size_t>(st.st_size);
+    void * data = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0) : nullptr;
+    close(file);
+    if(data == MAP_FAILED) throw std::runtime_error("Unable to map "+path);
+    struct Unmap { void * data; size_t size; ~Unmap() { if(data) munmap(data, size); } } unmap = {data, size};
+    return LoadProgram(data, size, library, nodeTypes);
+#endif
+}
\ No newline at end of file
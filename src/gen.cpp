@@ -0,0 +1,117 @@
+#include "gen.h"
+
+#include <algorithm>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+
+class GraphGenerator
+{
+    struct Source { int nodeIndex, pinIndex; };
+
+    GraphShape shape;
+    std::mt19937 rng;
+    std::vector<Node> nodes;
+    std::unordered_map<const Type *, std::vector<Source>> sources;  // For each type, every output of that type, in the order the nodes were added
+    std::unordered_map<const Type *, size_t> nextUnread;            // For each type, the earliest output of that type which WideFanOut has not yet wired
+    int lastSequencedIndex;
+
+    size_t Random(size_t n) { return std::uniform_int_distribution<size_t>(0, n-1)(rng); }
+
+    static bool IsImmediateType(const VarType & type) { return type.indirection == VarType::None && (type.type->index == typeid(int) || type.type->index == typeid(float)); }
+
+    bool IsPlaceable(const NodeType & type) const
+    {
+        for(auto & pin : type.GetInputs()) if(!IsImmediateType(pin.type) && !sources.count(pin.type.type)) return false;
+        return true;
+    }
+
+    std::string MakeImmediate(const VarType & type)
+    {
+        std::ostringstream ss;
+        if(type.type->index == typeid(int)) ss << static_cast<int>(Random(201)) - 100;
+        else ss << (static_cast<int>(Random(2001)) - 1000) * 0.01f;
+        return ss.str();
+    }
+
+    Node::Wire MakeWire(const VarType & type, bool isSequenced)
+    {
+        auto it = sources.find(type.type);
+        if(it == end(sources) || (IsImmediateType(type) && Random(8) == 0)) return {-1, -1, MakeImmediate(type)};
+
+        // Sequenced nodes read the most recent outputs, so that the pure nodes before them are used
+        const auto & list = it->second;
+        const size_t window = std::min<size_t>(list.size(), 4);
+        size_t index = list.size()-1;
+        if(!isSequenced) switch(shape)
+        {
+        case DeepChain: break;
+        case WideFanOut: // Alternate between the first few outputs and the earliest output which has no reader yet, so that every output is read
+            {
+                auto & next = nextUnread[type.type];
+                index = next < list.size() && Random(2) ? next++ : Random(window);
+            }
+            break;
+        case Diamonds: index = list.size()-1 - Random(window); break;
+        case FlowSequence: index = Random(list.size()); break;
+        }
+        return {list[index].nodeIndex, list[index].pinIndex};
+    }
+
+    void AddNode(const NodeType & type)
+    {
+        const int index = static_cast<int>(nodes.size());
+        Node node(type, index % 32 * 200, index / 32 * 100);
+        const bool isSequenced = type.HasInFlow();
+        for(size_t i=0; i<node.inputs.size(); ++i) node.inputs[i] = MakeWire(type.GetInputs()[i].type, isSequenced);
+        if(type.HasOutFlow())
+        {
+            if(lastSequencedIndex >= 0) nodes[lastSequencedIndex].flowOutputIndex = index;
+            lastSequencedIndex = index;
+        }
+        for(int i=0; i<static_cast<int>(type.GetOutputs().size()); ++i) sources[type.GetOutputs()[i].type.type].push_back({index, i});
+        nodes.push_back(std::move(node));
+    }
+
+    const NodeType * PickType(const std::vector<const NodeType *> & types)
+    {
+        std::vector<const NodeType *> placeable;
+        for(auto type : types) if(IsPlaceable(*type)) placeable.push_back(type);
+        return placeable.empty() ? nullptr : placeable[Random(placeable.size())];
+    }
+public:
+    GraphGenerator(GraphShape shape, unsigned seed) : shape(shape), rng(seed), lastSequencedIndex(-1) {}
+
+    std::vector<Node> Generate(const NodeType & eventType, const std::vector<NodeType> & nodeTypes, size_t numNodes)
+    {
+        // Pure nodes without outputs could never be used, events may only begin a graph, control nodes would leave their subflows empty, and output nodes may only end a subgraph
+        std::vector<const NodeType *> pureTypes, sequencedTypes;
+        for(auto & type : nodeTypes)
+        {
+            if(type.GetKind() == NodeType::EventNode || type.GetKind() == NodeType::OutputNode || type.IsControl()) continue;
+            if(type.HasInFlow()) sequencedTypes.push_back(&type);
+            else if(!type.GetOutputs().empty()) pureTypes.push_back(&type);
+        }
+
+        nodes.reserve(numNodes);
+        if(numNodes > 0) AddNode(eventType);
+        const size_t sequencedInterval = shape == FlowSequence ? 1 : shape == DeepChain ? 64 : 8;
+        while(nodes.size() < numNodes)
+        {
+            // Pick a sequenced node at regular intervals, and for the last node, falling back to a pure node if no sequenced node can be placed
+            const bool wantSequenced = nodes.size() % sequencedInterval == 0 || nodes.size() == numNodes-1;
+            auto type = wantSequenced ? PickType(sequencedTypes) : nullptr;
+            if(!type && shape == FlowSequence) throw std::runtime_error("Unable to generate graph - No sequenced node type can be placed!");
+            if(!type) type = PickType(pureTypes);
+            if(!type) type = PickType(sequencedTypes);
+            if(!type) throw std::runtime_error("Unable to generate graph - No node type can be placed!");
+            AddNode(*type);
+        }
+        return move(nodes);
+    }
+};
+
+std::vector<Node> GenerateGraph(const NodeType & eventType, const std::vector<NodeType> & nodeTypes, GraphShape shape, size_t numNodes, unsigned seed)
+{
+    return GraphGenerator(shape, seed).Generate(eventType, nodeTypes, numNodes);
+}
\ No newline at end of file
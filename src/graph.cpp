@@ -2,34 +2,102 @@
 #include "event.h"  // For Program
 #include "json.h"   // For JsonValue
 
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <sstream>
+
 ///////////////////////
 // Compilation logic //
 ///////////////////////
 
 class ProgramCompiler
 {
+public:
+    typedef std::vector<std::vector<std::shared_ptr<void>>> FoldCache;                       // For each node, the outputs it produced when last folded, or nothing if they must be computed again
+private:
     struct NodeRecord
     {
         std::vector<size_t> inputSlots;
         std::vector<size_t> outputSlots;
         bool used;
+        bool resolved;
+        int canonicalIndex;     // Index of the node whose lines compute this node's outputs. Identical pure nodes share a single canonical node.
         size_t timestamp;
-        NodeRecord() : used(), timestamp() {}
+        size_t visitStamp;      // Timestamp at which the node was last visited while emitting lines
+        bool stale;             // True if a pure node has not been emitted since a node it depends on was last run
+        std::vector<int> consumers; // Used nodes with a wire from one of this node's outputs, once for each such wire
+        std::vector<int> merged;    // For a canonical pure node, the other nodes which were merged with it
+        size_t firstStep;       // Index of the step of the top-level flow during which the node's line was first emitted, if it has been emitted
+        NodeRecord() : used(), resolved(), canonicalIndex(-1), timestamp(), visitStamp(), stale(true), firstStep(static_cast<size_t>(-1)) {}
     };
+    struct Checkpoint { size_t line, undo; int node; };                                     // Position in the emitted lines and undo log at the start of a step of the top-level flow, and the node that step runs
+    struct UndoRecord { int node; size_t timestamp; bool stale; };                          // Emission state of a node before it was changed
 
+    std::vector<Node> inlinedNodes;                                                         // The graph, with the nodes of inlined subgraphs appended, if it uses any
+    std::vector<int> nodeOrigins;                                                           // For each node of inlinedNodes, the node of the graph which it was copied for
+    size_t numGraphNodes;
+    size_t numInlinedNodes;
     const std::vector<Node> & nodes;
     std::vector<NodeRecord> nodeRecords;
     std::vector<std::shared_ptr<void>> constants;
+    std::vector<const Type *> constantTypes;
+    std::vector<size_t> constantSlots;                                                      // Slot of each constant. Constants occupy the first slots, unless they were interned by Update().
+    std::map<std::pair<const Type *, std::string>, size_t> constantIndices;                 // Slot of each distinct immediate value, keyed by type and object representation
+    std::map<std::pair<std::string, std::vector<size_t>>, int> pureNodeIndices;             // Canonical node for each distinct pure computation, keyed by node type and input slots
     std::vector<Program::Line> lines;
+    std::vector<int> lineNodes;                                                             // For each line, the node it was emitted for
+    FoldCache * foldCache;
     size_t totalSlots;
     size_t timestamp;
+    CompileStats stats;
+
+    // State kept by an updatable compiler, so that Update() can resume emission from the first step of the top-level flow affected by an edit
+    bool isUpdatable;
+    bool areConstantsLeading;                                                               // True if constant i occupies slot i
+    size_t subflowDepth;
+    std::vector<Checkpoint> checkpoints;                                                    // For each step of the top-level flow emitted so far, where it starts
+    std::vector<UndoRecord> undoLog;                                                        // Changes made to the emission state of nodes, in order
+    std::vector<size_t> releasedSlots;                                                      // Slots which no line refers to any longer, which may be given out again
 
+    const std::vector<Node> & InlineSubgraphs(const std::vector<Node> & graph, bool inlineShared);
+    template<class T> size_t InternConstant(const Type * type, T value);
+    size_t NewSlot();
+    void CompileImmediates(int index, std::vector<size_t> & inputSlots);
     void CompileConstants(int index);
-    void LazilyEmitPureLine(int index);
+    void ResolveSlots(int index);
+    void UpdateSlots(int index, bool isEdited, std::vector<int> & affected);
+    void CountMergedNodes();
+    void SetEmitState(int index, size_t timestamp, bool stale);
+    void MarkConsumersStale(int index);
+    void EmitPureLines(int index);
     void EmitLine(int index);
+    void EmitFlow(int startIndex);
+    void EmitSubflow(int startIndex);
+    void EmitBranch(int index);
+    void EmitLoop(int index);
+    void CompileLines(int startIndex);
+    bool FoldLine(const Program::Line & line, std::vector<std::shared_ptr<void>> & values);
+    void FoldConstants();
+    void AllocateSlots();
 public:
-    ProgramCompiler::ProgramCompiler(const std::vector<Node> & nodes) : nodes(nodes), nodeRecords(nodes.size()), totalSlots(), timestamp() {}
+    ProgramCompiler::ProgramCompiler(const std::vector<Node> & graph, FoldCache * foldCache = nullptr, bool inlineShared = false, bool isUpdatable = false) : numGraphNodes(graph.size()), numInlinedNodes(), nodes(InlineSubgraphs(graph, inlineShared)), nodeRecords(nodes.size()), foldCache(foldCache), totalSlots(), timestamp(), stats(), isUpdatable(isUpdatable && &nodes == &graph), areConstantsLeading(true), subflowDepth() {}
     Program Compile(int startIndex);
+    const CompileStats & GetStats() const { return stats; }
+    bool IsNodeUsed(int index) const { return nodeRecords[index].used; }
+
+    // An updatable compiler is one constructed with isUpdatable set, for a graph with no inlined subgraphs. It refers to the graph it was constructed from, which 
+    // may then be edited, as long as Compile() has been called, and each edit is reported. Flow links and subflows may not be edited.
+    bool IsUpdatable() const { return isUpdatable; }
+    void AddNode() { numGraphNodes = nodes.size(); nodeRecords.emplace_back(); nodeRecords.back().inputSlots.resize(nodes.back().type.GetInputs().size()); nodeRecords.back().outputSlots.resize(nodes.back().type.GetOutputs().size()); }
+    void SetWireSource(int nodeIndex, int oldSourceIndex, int newSourceIndex);              // Reports that a wire into the given node now comes from a different node, or from an immediate if the index is -1
+    bool Update(const std::vector<int> & editedNodes);                                     // Re-emits the lines affected by edits to the given nodes. Returns false if the emitted lines are unchanged.
+    Program LoadProgram();                                                                  // Loads a program from the lines emitted by Compile() or Update()
+    std::string Transpile(int startIndex, const std::string & functionName);
 };
 
 Program Compile(const std::vector<Node> & nodes, int startIndex)
@@ -37,129 +105,588 @@ Program Compile(const std::vector<Node> & nodes, int startIndex)
     return ProgramCompiler(nodes).Compile(startIndex);
 }
 
+Program Compile(const std::vector<Node> & nodes, int startIndex, CompileStats & stats)
+{
+    ProgramCompiler compiler(nodes);
+    auto program = compiler.Compile(startIndex);
+    stats = compiler.GetStats();
+    return program;
+}
+
+std::string TranspileGraph(const std::vector<Node> & nodes, int startIndex, const std::string & functionName)
+{
+    return ProgramCompiler(nodes, nullptr, true).Transpile(startIndex, functionName);
+}
+
+Program CompileFunction(const NodeType & eventType, const Function & function)
+{
+    const auto & params = eventType.GetOutputs();
+    if(function.GetParamCount() != params.size()) throw std::runtime_error("Compile error - Function parameter count does not match event parameters!");
+    Program::Line event {eventType, {}, {}, {}}, call {NodeType::MakeFunctionNode(function), {}, {}, {}};
+    for(size_t i=0; i<params.size(); ++i) event.outputs.push_back(i);
+    call.inputs = event.outputs;
+    if(function.GetReturnType().type->index != typeid(void)) call.outputs.push_back(params.size());
+    return Program::Load({}, {event, call});
+}
+
 Program ProgramCompiler::Compile(int nodeIndex)
 {
-    // Reserve input and output slot indices for every node
-    for(size_t i=0; i<nodes.size(); ++i)
+    CompileLines(nodeIndex);
+    stats.numEmittedLines = lines.size();
+    return LoadProgram();
+}
+
+Program ProgramCompiler::LoadProgram()
+{
+    // Folding and slot allocation rewrite the lines and constants, so an updatable compiler restores the emitted ones afterwards, for use by the next Update().
+    // Unlike emission, the copies, folding, allocation and loading below all run over every line, even after an Update() which emitted only a few of them.
+    std::vector<Program::Line> emittedLines;
+    std::vector<int> emittedLineNodes;
+    std::vector<std::shared_ptr<void>> emittedConstants;
+    std::vector<size_t> emittedConstantSlots;
+    const size_t emittedSlots = totalSlots;
+    if(isUpdatable)
     {
-        nodeRecords[i].inputSlots.resize(nodes[i].type.GetInputs().size());
-        nodeRecords[i].outputSlots.resize(nodes[i].type.GetOutputs().size());
+        emittedLines = lines;
+        emittedLineNodes = lineNodes;
+        emittedConstants = constants;
+        emittedConstantSlots = constantSlots;
     }
 
-    // Compile all constants and mark used nodes
-    for(int i = nodeIndex; i != -1; i = nodes[i].flowOutputIndex)
+    FoldConstants();
+    AllocateSlots();
+    auto program = Program::Load(constants, lines);
+    stats.numLines = lines.size();
+    stats.numConstants = constants.size();
+    stats.frameSize = program.GetFrameSize();
+    stats.lineNodes = lineNodes;
+    if(!nodeOrigins.empty()) for(auto & node : stats.lineNodes) node = nodeOrigins[node];
+
+    if(isUpdatable)
     {
-        CompileConstants(i);
+        lines = move(emittedLines);
+        lineNodes = move(emittedLineNodes);
+        constants = move(emittedConstants);
+        constantSlots = move(emittedConstantSlots);
+        totalSlots = emittedSlots;
     }
-    totalSlots = constants.size();
+    return program;
+}
 
-    // Reserve temporary slots for outputs of all used functions
-    for(size_t i=0; i<nodes.size(); ++i)
+NodeType MakeSubgraphNode(Subgraph subgraph, SubgraphLinkage linkage)
+{
+    auto isNode = [&](int index) { return index >= 0 && static_cast<size_t>(index) < subgraph.nodes.size(); };
+    if(!isNode(subgraph.inputIndex) || subgraph.nodes[subgraph.inputIndex].type.GetKind() != NodeType::EventNode) throw std::runtime_error("Subgraph error - Subgraph has no input node: "+subgraph.name);
+    if(!isNode(subgraph.outputIndex) || subgraph.nodes[subgraph.outputIndex].type.GetKind() != NodeType::OutputNode) throw std::runtime_error("Subgraph error - Subgraph has no output node: "+subgraph.name);
+
+    // A sequenced subgraph must run from its input node to its output node, so that inlined copies pass execution on
+    const auto & input = subgraph.nodes[subgraph.inputIndex];
+    const bool isSequenced = input.flowOutputIndex != -1 && input.flowOutputIndex != subgraph.outputIndex;
+    for(int i = input.flowOutputIndex, steps = 0; isSequenced && i != subgraph.outputIndex; i = subgraph.nodes[i].flowOutputIndex)
+    {
+        if(!isNode(i) || static_cast<size_t>(++steps) > subgraph.nodes.size()) throw std::runtime_error("Subgraph error - Flow from the input node does not reach the output node: "+subgraph.name);
+    }
+
+    // A shared program runs the subgraph from its input node, and must always finish by running the output node, which the flow of a pure subgraph does not reach
+    Program body;
+    if(linkage == SharedSubgraph)
+    {
+        auto nodes = subgraph.nodes;
+        if(!isSequenced) nodes[subgraph.inputIndex].flowOutputIndex = subgraph.outputIndex;
+        body = Compile(nodes, subgraph.inputIndex);
+    }
+    auto inputs = input.type.GetOutputs(), outputs = subgraph.nodes[subgraph.outputIndex].type.GetInputs();
+    auto name = subgraph.name;
+    return NodeType::MakeSubgraphNode(std::make_shared<Subgraph>(std::move(subgraph)), name, move(inputs), move(outputs), isSequenced, std::move(body));
+}
+
+// Appends a copy of the nodes of the subgraph of every inlined subgraph node to the graph, and wires the graph around them. Wires from the outputs of a subgraph node
+// instead carry the values wired into its output node, and wires from the outputs of its input node the values wired into the subgraph node. Flow into a subgraph
+// node continues from its input node, and flow into its output node continues from the subgraph node. Subgraph nodes and their input and output nodes are then
+// no longer reached, but remain in place, so that nodes keep their indices. Returns the graph itself if it has no inlined subgraph nodes.
+const std::vector<Node> & ProgramCompiler::InlineSubgraphs(const std::vector<Node> & graph, bool inlineShared)
+{
+    auto isInlined = [=](const NodeType & type) { return type.GetKind() == NodeType::SubgraphNode && (inlineShared || type.IsInlined()); };
+    if(std::none_of(begin(graph), end(graph), [&](const Node & node) { return isInlined(node.type); })) return graph;
+
+    // Copy the nodes of each subgraph, including the nodes of nested subgraphs, which are themselves copied as they are reached
+    inlinedNodes = graph;
+    for(size_t i=0; i<graph.size(); ++i) nodeOrigins.push_back(static_cast<int>(i));
+    std::vector<int> inputNodes, outputNodes, owners;                                       // For each inlined subgraph node, the copies of its input and output nodes, and for those copies, the subgraph node
+    for(size_t i=0; i<inlinedNodes.size(); ++i)
     {
-        if(!nodeRecords[i].used) continue;
-        for(size_t j=0; j<nodes[i].type.GetOutputs().size(); ++j)
+        if(!isInlined(inlinedNodes[i].type)) continue;
+        const auto & subgraph = *inlinedNodes[i].type.GetSubgraph();
+        const int base = static_cast<int>(inlinedNodes.size());
+        for(auto node : subgraph.nodes)
         {
-            nodeRecords[i].outputSlots[j] = totalSlots + j;
+            for(auto & wire : node.inputs) if(wire.nodeIndex >= 0) wire.nodeIndex += base;
+            if(node.flowOutputIndex >= 0) node.flowOutputIndex += base;
+            for(auto & subflow : node.subflowIndices) if(subflow >= 0) subflow += base;
+            inlinedNodes.push_back(std::move(node));
+            nodeOrigins.push_back(nodeOrigins[i]);
         }
-        totalSlots += nodes[i].type.GetOutputs().size();
+        inputNodes.resize(inlinedNodes.size(), -1);
+        outputNodes.resize(inlinedNodes.size(), -1);
+        owners.resize(inlinedNodes.size(), -1);
+        inputNodes[i] = base + subgraph.inputIndex;
+        outputNodes[i] = base + subgraph.outputIndex;
+        owners[inputNodes[i]] = owners[outputNodes[i]] = static_cast<int>(i);
+        ++numInlinedNodes;
     }
+    inputNodes.resize(inlinedNodes.size(), -1);
+    outputNodes.resize(inlinedNodes.size(), -1);
+    owners.resize(inlinedNodes.size(), -1);
 
-    // Determine temporary slot indices to use for function inputs
+    // Rewire every node, following wires and flow through as many subgraph boundaries as necessary, as subgraphs may be nested
+    auto isInputNode = [&](int i) { return owners[i] >= 0 && inputNodes[owners[i]] == i; };
+    auto isOutputNode = [&](int i) { return owners[i] >= 0 && outputNodes[owners[i]] == i; };
+    auto rewireFlow = [&](int & next)
+    {
+        while(next >= 0)
+        {
+            if(inputNodes[next] >= 0) next = inlinedNodes[inputNodes[next]].flowOutputIndex;
+            else if(isOutputNode(next)) next = inlinedNodes[owners[next]].flowOutputIndex;
+            else break;
+        }
+    };
+    for(auto & node : inlinedNodes)
+    {
+        for(auto & wire : node.inputs)
+        {
+            while(wire.nodeIndex >= 0)
+            {
+                const int source = wire.nodeIndex;
+                if(outputNodes[source] >= 0) wire = inlinedNodes[outputNodes[source]].inputs[wire.pinIndex];
+                else if(isInputNode(source)) wire = inlinedNodes[owners[source]].inputs[wire.pinIndex];
+                else break;
+            }
+        }
+        rewireFlow(node.flowOutputIndex);
+        for(auto & subflow : node.subflowIndices) rewireFlow(subflow);
+    }
+    return inlinedNodes;
+}
+
+void ProgramCompiler::CompileLines(int nodeIndex)
+{
+    // Reserve input and output slot indices for every node
     for(size_t i=0; i<nodes.size(); ++i)
     {
-        if(!nodeRecords[i].used) continue;
-        for(size_t j=0; j<nodes[i].type.GetInputs().size(); ++j)
+        nodeRecords[i].inputSlots.resize(nodes[i].type.GetInputs().size());
+        nodeRecords[i].outputSlots.resize(nodes[i].type.GetOutputs().size());
+    }
+
+    // Compile all constants and mark used nodes, for every node reached by flow wires, including those in the subflows of control nodes
+    std::vector<bool> isFlowReached(nodes.size(), false);
+    std::vector<int> flowStarts = {nodeIndex};
+    while(!flowStarts.empty())
+    {
+        const int start = flowStarts.back();
+        flowStarts.pop_back();
+        for(int i = start; i != -1; i = nodes[i].flowOutputIndex)
         {
-            auto & input = nodes[i].inputs[j];
-            if(input.nodeIndex == -1) continue; // Immediates were already set during CompileConstants() phase
-            nodeRecords[i].inputSlots[j] = nodeRecords[input.nodeIndex].outputSlots[input.pinIndex];
+            if(isFlowReached[i]) throw std::runtime_error("Compile error - Node is reached by more than one flow wire!");
+            isFlowReached[i] = true;
+            CompileConstants(i);
+            for(auto it = nodes[i].subflowIndices.rbegin(); it != nodes[i].subflowIndices.rend(); ++it) if(*it != -1) flowStarts.push_back(*it);
         }
     }
 
+    // Determine slot indices for the inputs and outputs of all used nodes
+    for(size_t i=0; i<nodes.size(); ++i)
+    {
+        if(nodeRecords[i].used) ResolveSlots(i);
+    }
+
     // Emit calls for nodes in order
-    for(int i = nodeIndex; i != -1; i = nodes[i].flowOutputIndex)
+    EmitFlow(nodeIndex);
+
+    // Nodes of the graph are used if any of the nodes inlined on their behalf are. Records are not consulted for used nodes once lines are emitted.
+    stats.numInlinedNodes = numInlinedNodes;
+    for(size_t i=numGraphNodes; i<nodes.size(); ++i) if(nodeRecords[i].used) nodeRecords[nodeOrigins[i]].used = true;
+}
+
+void ProgramCompiler::EmitFlow(int startIndex)
+{
+    for(int i = startIndex; i != -1; i = nodes[i].flowOutputIndex)
     {
+        if(isUpdatable && subflowDepth == 0) checkpoints.push_back({lines.size(), undoLog.size(), i});
         ++timestamp;
         for(auto & input : nodes[i].inputs)
         {
-            if(input.nodeIndex >= 0) LazilyEmitPureLine(input.nodeIndex);
+            if(input.nodeIndex >= 0) EmitPureLines(nodeRecords[input.nodeIndex].canonicalIndex);
         }
         EmitLine(i);
+        if(nodes[i].type.GetKind() == NodeType::BranchNode) EmitBranch(i);
+        if(nodes[i].type.GetKind() == NodeType::LoopNode) EmitLoop(i);
+    }
+}
+
+void ProgramCompiler::EmitSubflow(int startIndex)
+{
+    // A subflow may not run, so once it has been emitted, the sequenced nodes it ran are treated as never having been run, and the pure nodes it emitted as stale.
+    // Subflows nest no deeper than the control nodes of the graph, so recursion is bounded by the nesting depth rather than the size of the graph.
+    const size_t begin = lines.size();
+    ++subflowDepth;
+    EmitFlow(startIndex);
+    --subflowDepth;
+    for(size_t i=begin; i<lines.size(); ++i)
+    {
+        auto & record = nodeRecords[lineNodes[i]];
+        if(nodes[lineNodes[i]].type.HasInFlow() || nodes[lineNodes[i]].type.HasOutFlow()) SetEmitState(lineNodes[i], 0, record.stale);
+        else SetEmitState(lineNodes[i], record.timestamp, true);
     }
+}
 
-    // Load the resulting program
-    return Program::Load(constants, lines);
+void ProgramCompiler::EmitBranch(int index)
+{
+    // branch -> [true, false], true arm..., jump -> [end], false arm..., end. The jump is omitted when the false arm is empty.
+    const size_t branchLine = lines.size()-1;
+    const auto & subflows = nodes[index].subflowIndices;
+    EmitSubflow(subflows[0]);
+    size_t jumpLine = 0;
+    if(subflows[1] != -1)
+    {
+        jumpLine = lines.size();
+        lines.push_back({NodeType::MakeJumpNode(), {}, {}, {}});
+        lineNodes.push_back(index);
+    }
+    const size_t falseLine = lines.size();
+    EmitSubflow(subflows[1]);
+    if(jumpLine) lines[jumpLine].targets = {lines.size()};
+    lines[branchLine].targets = {branchLine+1, falseLine};
 }
 
-void ProgramCompiler::CompileConstants(int index)
+void ProgramCompiler::EmitLoop(int index)
 {
+    // loop -> [end], body..., loop end -> [body], end. The loop end line advances the index, and jumps back to the body until it has passed the last index.
+    const size_t loopLine = lines.size()-1;
+    EmitSubflow(nodes[index].subflowIndices[0]);
     auto & record = nodeRecords[index];
-    if(record.used) return; // Only need to do this once per node
-    record.used = true;
+    lines.push_back({NodeType::MakeLoopEndNode(*nodes[index].type.GetOutputs()[0].type.type), {record.outputSlots[0], record.inputSlots[1]}, {record.outputSlots[0]}, {loopLine+1}});
+    lineNodes.push_back(index);
+    lines[loopLine].targets = {lines.size()};
+    SetEmitState(index, 0, record.stale); // The index is only written within the loop
+}
 
+void ProgramCompiler::CompileConstants(int startIndex)
+{
+    // Visit every node upstream of the given node. Graph walks use an explicit stack, so that long chains of nodes cannot exhaust the call stack.
+    std::vector<int> stack = {startIndex};
+    while(!stack.empty())
+    {
+        const int index = stack.back();
+        stack.pop_back();
+        auto & record = nodeRecords[index];
+        if(record.used) continue; // Only need to do this once per node
+        record.used = true;
+
+        auto & node = nodes[index];
+        CompileImmediates(index, record.inputSlots);
+        for(auto & input : node.inputs) if(input.nodeIndex != -1) nodeRecords[input.nodeIndex].consumers.push_back(index);
+        for(auto it = node.inputs.rbegin(); it != node.inputs.rend(); ++it) if(it->nodeIndex != -1) stack.push_back(it->nodeIndex); // Wired to other node
+    }
+}
+
+// Sets the slots of the immediate inputs of a node to the constants they hold
+void ProgramCompiler::CompileImmediates(int index, std::vector<size_t> & inputSlots)
+{
     auto & node = nodes[index];
     for(size_t i=0; i<node.inputs.size(); ++i)
     {
         auto & input = node.inputs[i];
-        if(input.nodeIndex == -1) // Immediate
+        if(input.nodeIndex != -1) continue;
+        if(input.immediate.empty()) throw std::runtime_error("Compile error - Wire not connected and no immediate present!");
+
+        auto type = node.type.GetInputs()[i].type;
+        assert(type.indirection == VarType::None);
+        if(type.type->index == typeid(int))
+        {
+            std::istringstream ss(input.immediate);
+            int value; if(!(ss >> value)) throw std::runtime_error("Compile error - Unable to parse int from "+input.immediate);
+            inputSlots[i] = InternConstant(type.type, value);
+        }
+        else if(type.type->index == typeid(float))
         {
-            if(input.immediate.empty()) throw std::runtime_error("Compile error - Wire not connected and no immediate present!");
+            std::istringstream ss(input.immediate);
+            float value; if(!(ss >> value)) throw std::runtime_error("Compile error - Unable to parse float from "+input.immediate);
+            inputSlots[i] = InternConstant(type.type, value);
+        }           
+        else throw std::runtime_error(std::string("Compile error - Immediates are not supported for ")+type.type->index.name());
+    }
+}
 
-            auto type = node.type.GetInputs()[i].type;
-            assert(type.indirection == VarType::None);
-            if(type.type->index == typeid(int))
-            {
-                std::istringstream ss(input.immediate);
-                int value; if(!(ss >> value)) throw std::runtime_error("Compile error - Unable to parse int from "+input.immediate);
-                constants.push_back(std::make_shared<int>(value));
-            }
-            else if(type.type->index == typeid(float))
-            {
-                std::istringstream ss(input.immediate);
-                float value; if(!(ss >> value)) throw std::runtime_error("Compile error - Unable to parse float from "+input.immediate);
-                constants.push_back(std::make_shared<float>(value));
-            }           
-            else throw std::runtime_error(std::string("Compile error - Immediates are not supported for ")+type.type->index.name());
+// Returns a slot which no line refers to. Slots released by Update() are given out first.
+size_t ProgramCompiler::NewSlot()
+{
+    if(releasedSlots.empty()) return totalSlots++;
+    const size_t slot = releasedSlots.back();
+    releasedSlots.pop_back();
+    return slot;
+}
+
+template<class T> size_t ProgramCompiler::InternConstant(const Type * type, T value)
+{
+    // Identical immediates share a single constant, so that pure nodes reading them can be recognized as identical
+    auto & index = constantIndices[{type, std::string(reinterpret_cast<const char *>(&value), sizeof(value))}];
+    if(index == 0)
+    {
+        constants.push_back(std::make_shared<T>(value));
+        constantTypes.push_back(type);
+        constantSlots.push_back(NewSlot());
+        if(constantSlots.back() != constants.size()-1) areConstantsLeading = false;
+        index = constants.size();
+    }
+    return constantSlots[index-1];
+}
+
+void ProgramCompiler::ResolveSlots(int startIndex)
+{
+    // Resolve nodes depth first, each after the nodes it reads from. The stack holds each node being resolved, and the next of its inputs to visit.
+    std::vector<std::pair<int, size_t>> stack;
+    auto visit = [&](int index)
+    {
+        auto & record = nodeRecords[index];
+        if(record.resolved) return; // Only need to do this once per node
+        record.resolved = true;
+        record.canonicalIndex = index;
+
+        // Sequenced nodes are never merged, so their outputs can be given slots before visiting their inputs
+        if(nodes[index].type.HasInFlow() || nodes[index].type.HasOutFlow()) for(auto & slot : record.outputSlots) slot = NewSlot();
+        stack.push_back({index, 0});
+    };
+    visit(startIndex);
+    while(!stack.empty())
+    {
+        const int index = stack.back().first;
+        auto & node = nodes[index];
+        if(stack.back().second < node.inputs.size())
+        {
+            auto & input = node.inputs[stack.back().second++];
+            if(input.nodeIndex != -1) visit(input.nodeIndex); // Immediates were already set during CompileConstants() phase
+            continue;
+        }
+        stack.pop_back();
 
-            record.inputSlots[i] = constants.size()-1;
+        // Determine slot indices to use for inputs
+        auto & record = nodeRecords[index];
+        for(size_t i=0; i<node.inputs.size(); ++i)
+        {
+            auto & input = node.inputs[i];
+            if(input.nodeIndex != -1) record.inputSlots[i] = nodeRecords[input.nodeIndex].outputSlots[input.pinIndex];
         }
-        else // Wired to other node
+
+        // A pure node of the same type as an earlier one, reading the same slots, computes the same values, so it can simply alias the earlier node's outputs
+        if(node.type.HasInFlow() || node.type.HasOutFlow()) continue;
+        auto it = pureNodeIndices.find({node.type.GetUniqueId(), record.inputSlots});
+        if(it != end(pureNodeIndices))
         {
-            CompileConstants(input.nodeIndex);
+            record.canonicalIndex = it->second;
+            record.outputSlots = nodeRecords[it->second].outputSlots;
+            nodeRecords[it->second].merged.push_back(index);
+            ++stats.numMergedNodes;
+            continue;
         }
+        pureNodeIndices[{node.type.GetUniqueId(), record.inputSlots}] = index;
+        for(auto & slot : record.outputSlots) slot = NewSlot();
     }
 }
 
-void ProgramCompiler::LazilyEmitPureLine(int index)    
+void ProgramCompiler::SetWireSource(int nodeIndex, int oldSourceIndex, int newSourceIndex)
 {
-    // If this node is sequenced, simply verify that it has been run at least once
-    auto & node = nodes[index];
+    if(!nodeRecords[nodeIndex].used) return; // Consumers are only recorded for used nodes, when they are first used
+    if(oldSourceIndex >= 0)
+    {
+        auto & consumers = nodeRecords[oldSourceIndex].consumers;
+        consumers.erase(std::find(begin(consumers), end(consumers), nodeIndex));
+    }
+    if(newSourceIndex >= 0) nodeRecords[newSourceIndex].consumers.push_back(nodeIndex);
+}
+
+bool ProgramCompiler::Update(const std::vector<int> & editedNodes)
+{
+    assert(isUpdatable && !checkpoints.empty());
+    stats.numEmittedLines = 0;
+
+    // Nodes which the edited nodes now read from for the first time must have their constants compiled, and be given slots
+    std::vector<int> edited;
+    for(auto index : editedNodes) if(nodeRecords[index].used) edited.push_back(index);
+    std::sort(begin(edited), end(edited));
+    edited.erase(std::unique(begin(edited), end(edited)), end(edited));
+    for(auto index : edited) for(auto & input : nodes[index].inputs) if(input.nodeIndex >= 0 && !nodeRecords[input.nodeIndex].used) CompileConstants(input.nodeIndex);
+    for(auto index : edited) for(auto & input : nodes[index].inputs) if(input.nodeIndex >= 0) ResolveSlots(input.nodeIndex);
+
+    // Find the used nodes downstream of the edited nodes, and update their slots, each after the nodes it reads from
+    std::map<int, bool> cone;                                                               // Whether each node downstream of an edit has been ordered yet
+    for(std::vector<int> stack(edited); !stack.empty(); )
+    {
+        const int index = stack.back();
+        stack.pop_back();
+        if(cone.insert({index, false}).second) stack.insert(end(stack), begin(nodeRecords[index].consumers), end(nodeRecords[index].consumers));
+    }
+    std::vector<int> order;
+    std::vector<std::pair<int, size_t>> stack;
+    for(auto & entry : cone)
+    {
+        if(entry.second) continue;
+        entry.second = true;
+        stack.push_back({entry.first, 0});
+        while(!stack.empty())
+        {
+            const int index = stack.back().first;
+            if(stack.back().second < nodes[index].inputs.size())
+            {
+                auto it = cone.find(nodes[index].inputs[stack.back().second++].nodeIndex);
+                if(it != end(cone) && !it->second) { it->second = true; stack.push_back({it->first, 0}); }
+                continue;
+            }
+            order.push_back(index);
+            stack.pop_back();
+        }
+    }
+    std::vector<int> affected;
+    for(auto index : order) UpdateSlots(index, std::binary_search(begin(edited), end(edited), index), affected);
+
+    // Lines emitted before the first step of the top-level flow which emitted an affected node are unchanged. Rewind the emission state to the start of that step, 
+    // and emit the rest of the flow again.
+    size_t step = checkpoints.size();
+    for(auto index : affected) step = std::min(step, nodeRecords[index].firstStep);
+    if(step == checkpoints.size())
+    {
+        CountMergedNodes(); // Edits may still change which nodes are reachable, without changing any line
+        return false;
+    }
+    const auto checkpoint = checkpoints[step];
+    for(size_t i=checkpoint.line; i<lines.size(); ++i)
+    {
+        auto & record = nodeRecords[lineNodes[i]];
+        if(record.firstStep != static_cast<size_t>(-1) && record.firstStep >= step) record.firstStep = static_cast<size_t>(-1);
+    }
+    for(; undoLog.size() > checkpoint.undo; undoLog.pop_back())
+    {
+        auto & record = nodeRecords[undoLog.back().node];
+        record.timestamp = undoLog.back().timestamp;
+        record.stale = undoLog.back().stale;
+    }
+    lines.resize(checkpoint.line);
+    lineNodes.resize(checkpoint.line);
+    checkpoints.resize(step);
+    EmitFlow(checkpoint.node);
+    stats.numEmittedLines = lines.size() - checkpoint.line;
+    CountMergedNodes();
+    return true;
+}
+
+void ProgramCompiler::CountMergedNodes()
+{
+    // Nodes stay used once an update has compiled them, even if the edits since have left them unreachable, and such a node may remain the canonical node
+    // of reachable ones. Merges are therefore counted among the nodes which the sequenced nodes of the lines read, as a full compile would count them.
+    std::vector<bool> isLive(nodes.size());
+    std::vector<int> stack, groupSizes(nodes.size());
+    for(auto index : lineNodes) if(nodes[index].type.HasInFlow() || nodes[index].type.HasOutFlow()) stack.push_back(index);
+    stats.numMergedNodes = 0;
+    while(!stack.empty())
+    {
+        const int index = stack.back();
+        stack.pop_back();
+        if(isLive[index]) continue;
+        isLive[index] = true;
+        if(nodeRecords[index].canonicalIndex >= 0 && groupSizes[nodeRecords[index].canonicalIndex]++) ++stats.numMergedNodes;
+        for(auto & input : nodes[index].inputs) if(input.nodeIndex >= 0) stack.push_back(input.nodeIndex);
+    }
+}
+
+// Updates the input slots of a node after an edit, and for a pure node, which node it is merged with and its output slots. Any node whose line may have changed is added to affected.
+void ProgramCompiler::UpdateSlots(int index, bool isEdited, std::vector<int> & affected)
+{
+    const auto & node = nodes[index];
+    auto & record = nodeRecords[index];
+    std::vector<size_t> inputSlots = record.inputSlots;
+    if(isEdited) CompileImmediates(index, inputSlots);
+    for(size_t i=0; i<node.inputs.size(); ++i) if(node.inputs[i].nodeIndex != -1) inputSlots[i] = nodeRecords[node.inputs[i].nodeIndex].outputSlots[node.inputs[i].pinIndex];
+    if(inputSlots == record.inputSlots) return;
+    affected.push_back(index);
     if(node.type.HasInFlow() || node.type.HasOutFlow())
     {
-        if(nodeRecords[index].timestamp == 0) throw std::runtime_error("Sequencing error! Node depends on sequenced node which has not yet been run!");
+        record.inputSlots = move(inputSlots);
         return;
     }
 
-    // Otherwise node is pure.
-    if(nodeRecords[index].timestamp == timestamp) return; // Node was recomputed this timestep, no need to revisit it
+    // Leave the computation the node used to perform or share. If other nodes were merged with it, the first of them takes over, along with the node's output slots,
+    // so that nodes reading from the merged nodes are unaffected.
+    const int canonical = record.canonicalIndex;
+    affected.push_back(canonical);
+    bool keepsSlots = false;
+    if(canonical == index)
+    {
+        const std::pair<std::string, std::vector<size_t>> key = {node.type.GetUniqueId(), record.inputSlots};
+        pureNodeIndices.erase(key);
+        if(record.merged.empty()) keepsSlots = true;
+        else
+        {
+            auto merged = move(record.merged);
+            record.merged.clear();
+            const int heir = *std::min_element(begin(merged), end(merged));
+            for(auto m : merged) if(m != heir) { nodeRecords[m].canonicalIndex = heir; nodeRecords[heir].merged.push_back(m); }
+            nodeRecords[heir].canonicalIndex = heir;
+            pureNodeIndices[key] = heir;
+        }
+    }
+    else
+    {
+        auto & merged = nodeRecords[canonical].merged;
+        merged.erase(std::find(begin(merged), end(merged), index));
+    }
+
+    // Merge with an identical node if there is one, or perform the new computation, reusing the node's own output slots if it kept them
+    record.inputSlots = move(inputSlots);
+    auto it = pureNodeIndices.find({node.type.GetUniqueId(), record.inputSlots});
+    if(it != end(pureNodeIndices))
+    {
+        if(keepsSlots) releasedSlots.insert(end(releasedSlots), begin(record.outputSlots), end(record.outputSlots));
+        record.canonicalIndex = it->second;
+        record.outputSlots = nodeRecords[it->second].outputSlots;
+        nodeRecords[it->second].merged.push_back(index);
+        return;
+    }
+    pureNodeIndices[{node.type.GetUniqueId(), record.inputSlots}] = index;
+    record.canonicalIndex = index;
+    if(!keepsSlots) for(auto & slot : record.outputSlots) slot = NewSlot();
+}
 
-    bool needsUpdate = false;
-    if(nodeRecords[index].timestamp == 0) needsUpdate = true; // If this node was never computed, we need to update it
+void ProgramCompiler::EmitPureLines(int startIndex)
+{
+    // Emit the given pure node, and the pure nodes it reads from, if they are stale. Each node is emitted after the stale nodes it reads from, and is visited at most once per timestep.
+    std::vector<std::pair<int, size_t>> stack;
+    auto visit = [&](int index)
+    {
+        auto & record = nodeRecords[index];
+        if(record.visitStamp == timestamp) return;
+        record.visitStamp = timestamp;
 
-    // Check all dependencies
-    for(size_t i=0; i<node.inputs.size(); ++i)
+        // If this node is sequenced, simply verify that it has been run at least once
+        if(nodes[index].type.HasInFlow() || nodes[index].type.HasOutFlow())
+        {
+            if(record.timestamp == 0) throw std::runtime_error("Sequencing error! Node depends on sequenced node which has not yet been run!");
+            return;
+        }
+        if(record.stale) stack.push_back({index, 0});
+    };
+    visit(startIndex);
+    while(!stack.empty())
     {
-        const auto & input = node.inputs[i];
-        if(input.nodeIndex >= 0)
+        const int index = stack.back().first;
+        auto & node = nodes[index];
+        if(stack.back().second < node.inputs.size())
         {
-            // Allow this input to update if it needs to. If this input was recomputed more recently than our node, we also need to recompute
-            LazilyEmitPureLine(input.nodeIndex);
-            if(nodeRecords[input.nodeIndex].timestamp > nodeRecords[index].timestamp) needsUpdate = true;
+            auto & input = node.inputs[stack.back().second++];
+            if(input.nodeIndex >= 0) visit(nodeRecords[input.nodeIndex].canonicalIndex);
+            continue;
         }
+        stack.pop_back();
+        EmitLine(index);
     }
-
-    // If this node needs an update, lets recompute it
-    if(needsUpdate) EmitLine(index);
 }
 
 void ProgramCompiler::EmitLine(int index)
@@ -172,8 +699,663 @@ void ProgramCompiler::EmitLine(int index)
     line.inputs = record.inputSlots;
     line.outputs = record.outputSlots;
     lines.push_back(line);
+    lineNodes.push_back(index);
+
+    if(isUpdatable && record.firstStep == static_cast<size_t>(-1)) record.firstStep = checkpoints.size()-1;
+    SetEmitState(index, timestamp, false);
+    MarkConsumersStale(index);
+}
 
+void ProgramCompiler::SetEmitState(int index, size_t timestamp, bool stale)
+{
+    auto & record = nodeRecords[index];
+    if(isUpdatable) undoLog.push_back({index, record.timestamp, record.stale});
     record.timestamp = timestamp;
+    record.stale = stale;
+}
+
+void ProgramCompiler::MarkConsumersStale(int index)
+{
+    // Pure nodes downstream of this node must be emitted again before their outputs are next read. A stale node's consumers are already stale. 
+    // The outputs of a canonical node are also read by the consumers of the nodes merged with it.
+    std::vector<int> stack = {index};
+    while(!stack.empty())
+    {
+        const int source = stack.back();
+        stack.pop_back();
+        auto markConsumers = [&](int node)
+        {
+            for(auto consumer : nodeRecords[node].consumers)
+            {
+                const int canonical = nodeRecords[consumer].canonicalIndex;
+                if(canonical < 0 || nodeRecords[canonical].stale || nodes[canonical].type.HasInFlow() || nodes[canonical].type.HasOutFlow()) continue;
+                SetEmitState(canonical, nodeRecords[canonical].timestamp, true);
+                stack.push_back(canonical);
+            }
+        };
+        markConsumers(source);
+        for(auto node : nodeRecords[source].merged) markConsumers(node);
+    }
+}
+
+bool ProgramCompiler::FoldLine(const Program::Line & line, std::vector<std::shared_ptr<void>> & values)
+{
+    std::vector<void *> inputs, outputs(line.outputs.size());
+    for(auto slot : line.inputs) inputs.push_back(values[slot].get());
+    try
+    {
+        // Nodes which construct a value only ever construct a single output
+        if(line.outputs.size() == 1 && line.type.IsOutputConstructed(0))
+        {
+            values[line.outputs[0]] = line.type.GetOutputs()[0].type.type->Construct([&](void * l) { outputs[0] = l; line.type.Evaluate(inputs.data(), outputs.data()); });
+            return true;
+        }
+        for(size_t i=0; i<line.outputs.size(); ++i) if(line.type.IsOutputConstructed(i)) return false;
+
+        // Other outputs refer to existing objects, which may be parts of the inputs, so the inputs are kept alive for as long as the outputs
+        line.type.Evaluate(inputs.data(), outputs.data());
+        std::vector<std::shared_ptr<void>> owners;
+        for(auto slot : line.inputs) owners.push_back(values[slot]);
+        auto owner = std::make_shared<decltype(owners)>(move(owners));
+        for(size_t i=0; i<line.outputs.size(); ++i) values[line.outputs[i]] = std::shared_ptr<void>(owner, outputs[i]);
+        return true;
+    }
+    catch(...) { return false; } // Leave the line to fail at runtime, as it would have without folding
+}
+
+void ProgramCompiler::FoldConstants()
+{
+    // Evaluate pure lines whose inputs are all known at compile time, and remove them from the program
+    std::vector<std::shared_ptr<void>> values(totalSlots);
+    for(size_t i=0; i<constants.size(); ++i) values[constantSlots[i]] = constants[i];
+    stats.numReusedFoldedLines = 0;
+    std::vector<Program::Line> remainingLines;
+    std::vector<int> remainingLineNodes;
+    std::vector<size_t> lineMap(lines.size()+1);                                           // For each line, the index of the first remaining line at or after it
+    for(size_t i=0; i<lines.size(); ++i)
+    {
+        lineMap[i] = remainingLines.size();
+        const auto & line = lines[i];
+        bool isFoldable = !line.type.HasInFlow() && !line.type.HasOutFlow() && line.type.GetKind() != NodeType::EventNode;
+        for(auto slot : line.inputs) if(!values[slot]) isFoldable = false;
+        if(isFoldable)
+        {
+            bool isFolded = true;
+            for(auto slot : line.outputs) if(!values[slot]) isFolded = false;
+            if(isFolded) continue; // A pure line with constant inputs always produces the same outputs, so lines emitted again need no further work
+
+            // Reuse the outputs from an earlier compile if nothing upstream of the node has changed since
+            auto cached = foldCache && static_cast<size_t>(lineNodes[i]) < numGraphNodes ? &(*foldCache)[lineNodes[i]] : nullptr; // Inlined nodes are copied anew by each compile, so are not cached
+            if(cached && !cached->empty())
+            {
+                for(size_t j=0; j<line.outputs.size(); ++j) values[line.outputs[j]] = (*cached)[j];
+                ++stats.numReusedFoldedLines;
+                continue;
+            }
+            if(FoldLine(line, values))
+            {
+                if(cached) for(auto slot : line.outputs) cached->push_back(values[slot]);
+                continue;
+            }
+        }
+        remainingLines.push_back(line);
+        remainingLineNodes.push_back(lineNodes[i]);
+    }
+    stats.numFoldedLines = lines.size() - remainingLines.size();
+    if(remainingLines.size() == lines.size() && areConstantsLeading) return;
+    lineMap[lines.size()] = remainingLines.size();
+    for(auto & line : remainingLines) for(auto & target : line.targets) target = lineMap[target];
+
+    // Renumber slots, so that the constants still read by the program occupy the first slots
+    const size_t none = static_cast<size_t>(-1);
+    std::vector<size_t> slotMap(totalSlots, none);
+    std::vector<std::shared_ptr<void>> remainingConstants;
+    for(auto & line : remainingLines) for(auto slot : line.inputs) if(values[slot] && slotMap[slot] == none)
+    {
+        slotMap[slot] = remainingConstants.size();
+        remainingConstants.push_back(values[slot]);
+    }
+    totalSlots = remainingConstants.size();
+    for(size_t i=0; i<slotMap.size(); ++i) if(!values[i]) slotMap[i] = totalSlots++;
+    for(auto & line : remainingLines)
+    {
+        for(auto & slot : line.inputs) slot = slotMap[slot];
+        for(auto & slot : line.outputs) slot = slotMap[slot];
+    }
+
+    constants = move(remainingConstants);
+    lines = move(remainingLines);
+    lineNodes = move(remainingLineNodes);
+}
+
+void ProgramCompiler::AllocateSlots()
+{
+    stats.numSlotsBeforeAllocation = stats.numSlotsAfterAllocation = totalSlots;
+    if(lines.empty()) return;
+
+    // Find the line which first writes each slot, the type of value it holds, and the last line which reads it
+    const size_t none = static_cast<size_t>(-1);
+    std::vector<size_t> firstWrite(totalSlots, none), lastRead(totalSlots, 0);
+    std::vector<const Type *> slotTypes(totalSlots, nullptr);
+    for(size_t i=0; i<lines.size(); ++i)
+    {
+        for(auto slot : lines[i].inputs) lastRead[slot] = i;
+        for(size_t j=0; j<lines[i].outputs.size(); ++j)
+        {
+            auto slot = lines[i].outputs[j];
+            if(firstWrite[slot] == none) firstWrite[slot] = i;
+            lastRead[slot] = std::max(lastRead[slot], i);
+            slotTypes[slot] = lines[i].type.IsOutputConstructed(j) ? lines[i].type.GetOutputs()[j].type.type : nullptr;
+        }
+    }
+
+    // Outputs which are not constructed, such as the fields produced by a split node, may point into the storage of the line's inputs, 
+    // so the inputs must outlive every read of those outputs. Values written before a loop and read within it are read again on every pass,
+    // so they must outlive the jump back to the start of the loop. Repeat until no lifetimes change, as pure lines may be emitted more than once.
+    for(bool changed = true; changed; )
+    {
+        changed = false;
+        for(size_t i=0; i<lines.size(); ++i) for(auto target : lines[i].targets)
+        {
+            if(target > i) continue;
+            for(size_t j=target; j<=i; ++j) for(auto slot : lines[j].inputs)
+            {
+                if(slot < constants.size() || firstWrite[slot] >= target || lastRead[slot] >= i) continue;
+                lastRead[slot] = i;
+                changed = true;
+            }
+        }
+        for(size_t i=lines.size(); i-- > 0; )
+        {
+            for(size_t j=0; j<lines[i].outputs.size(); ++j)
+            {
+                if(lines[i].type.IsOutputConstructed(j)) continue;
+                for(auto slot : lines[i].inputs)
+                {
+                    if(slot < constants.size() || lastRead[slot] >= lastRead[lines[i].outputs[j]]) continue;
+                    lastRead[slot] = lastRead[lines[i].outputs[j]];
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Assign slots in program order. A slot becomes free for reuse by values of the same type once the line which last reads it has run.
+    // A slot is never reused by the line which last reads it, as a line's outputs are prepared before its inputs are consumed.
+    std::vector<size_t> slotMap(totalSlots, none);
+    std::map<const Type *, std::vector<size_t>> freeSlots;
+    std::vector<std::vector<size_t>> expiring(lines.size());
+    for(size_t i=0; i<constants.size(); ++i) slotMap[i] = i;
+    size_t numSlots = constants.size();
+    for(size_t i=0; i<lines.size(); ++i)
+    {
+        if(i > 0) for(auto slot : expiring[i-1]) freeSlots[slotTypes[slot]].push_back(slotMap[slot]);
+        for(auto slot : lines[i].outputs)
+        {
+            if(slotMap[slot] != none) continue;
+            auto & pool = freeSlots[slotTypes[slot]];
+            if(pool.empty()) slotMap[slot] = numSlots++;
+            else { slotMap[slot] = pool.back(); pool.pop_back(); }
+            expiring[lastRead[slot]].push_back(slot);
+        }
+    }
+    for(auto & line : lines)
+    {
+        for(auto & slot : line.inputs) slot = slotMap[slot];
+        for(auto & slot : line.outputs) slot = slotMap[slot];
+    }
+    totalSlots = stats.numSlotsAfterAllocation = numSlots;
+}
+
+///////////////////
+// Program cache //
+///////////////////
+
+// Describes the subgraph reachable from the given start nodes, following both wires and flow links. Nodes are numbered in the order they are reached, 
+// so that identical subgraphs produce identical keys regardless of where their nodes are stored. Strings are prefixed by their lengths to keep keys unambiguous.
+// Subgraph nodes are described by their linkage and by the content of their subgraphs, as nodes which share a name may stand for different programs.
+static void WriteSubgraphKey(std::ostream & key, const std::vector<Node> & nodes, std::initializer_list<int> startIndices)
+{
+    std::vector<int> order, localIndices(nodes.size(), -1);
+    auto reach = [&](int index) -> int
+    {
+        if(index == -1) return -1;
+        if(index < 0 || static_cast<size_t>(index) >= nodes.size()) throw std::runtime_error("Compile error - Wire refers to a node which does not exist!");
+        if(localIndices[index] == -1) { localIndices[index] = static_cast<int>(order.size()); order.push_back(index); }
+        return localIndices[index];
+    };
+    for(auto index : startIndices) reach(index);
+
+    for(size_t i=0; i<order.size(); ++i)
+    {
+        const auto & node = nodes[order[i]];
+        const auto & id = node.type.GetUniqueId();
+        key << id.size() << ':' << id;
+        if(auto subgraph = node.type.GetSubgraph())
+        {
+            key << (node.type.IsInlined() ? " {inline " : " {shared ");
+            WriteSubgraphKey(key, subgraph->nodes, {subgraph->inputIndex, subgraph->outputIndex});
+            key << '}';
+        }
+        for(const auto & wire : node.inputs)
+        {
+            if(wire.nodeIndex == -1) key << " i" << wire.immediate.size() << ':' << wire.immediate;
+            else key << " w" << reach(wire.nodeIndex) << '.' << wire.pinIndex;
+        }
+        for(auto subflow : node.subflowIndices) key << " s" << reach(subflow);
+        key << " n" << reach(node.flowOutputIndex) << ';';
+    }
+}
+
+static std::string GetSubgraphKey(const std::vector<Node> & nodes, int startIndex)
+{
+    std::ostringstream key;
+    WriteSubgraphKey(key, nodes, {startIndex});
+    return key.str();
+}
+
+struct ProgramCache::Impl
+{
+    typedef std::list<std::pair<std::string, Program>> EntryList;
+
+    mutable std::mutex                                          mutex;
+    size_t                                                      capacity;
+    EntryList                                                   entries;        // Cached programs, from most to least recently used
+    std::unordered_map<std::string, EntryList::iterator>        index;          // Location of the cached program for each subgraph key
+    size_t                                                      hits, misses;
+
+    Impl(size_t capacity) : capacity(capacity), hits(), misses() {}
+};
+
+ProgramCache::ProgramCache(size_t capacity) : impl(std::make_unique<Impl>(capacity)) {}
+ProgramCache::~ProgramCache() {}
+
+size_t ProgramCache::GetCapacity() const { return impl->capacity; }
+size_t ProgramCache::GetSize() const { std::lock_guard<std::mutex> lock(impl->mutex); return impl->entries.size(); }
+size_t ProgramCache::GetHitCount() const { std::lock_guard<std::mutex> lock(impl->mutex); return impl->hits; }
+size_t ProgramCache::GetMissCount() const { std::lock_guard<std::mutex> lock(impl->mutex); return impl->misses; }
+
+void ProgramCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->index.clear();
+    impl->entries.clear();
+}
+
+Program ProgramCache::Compile(const std::vector<Node> & nodes, int startIndex)
+{
+    auto key = GetSubgraphKey(nodes, startIndex);
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        auto it = impl->index.find(key);
+        if(it != end(impl->index))
+        {
+            impl->entries.splice(begin(impl->entries), impl->entries, it->second);
+            ++impl->hits;
+            return it->second->second;
+        }
+        ++impl->misses;
+    }
+
+    // Compile without holding the lock, so that other threads are not blocked meanwhile. If another thread compiled the same subgraph meanwhile, either result may be kept.
+    auto program = ::Compile(nodes, startIndex);
+    if(impl->capacity == 0) return program;
+
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    auto it = impl->index.find(key);
+    if(it != end(impl->index)) impl->entries.erase(it->second);
+    impl->entries.emplace_front(key, program);
+    impl->index[move(key)] = begin(impl->entries);
+    while(impl->entries.size() > impl->capacity)
+    {
+        impl->index.erase(impl->entries.back().first);
+        impl->entries.pop_back();
+    }
+    return program;
+}
+
+//////////////////////////////
+// Incremental recompilation //
+//////////////////////////////
+
+struct IncrementalCompiler::Impl
+{
+    std::vector<Node>                       nodes;
+    int                                     startIndex;
+    std::vector<std::vector<int>>           consumers;      // For each node, the nodes with a wire from one of its outputs
+    ProgramCompiler::FoldCache              foldCache;
+    std::unique_ptr<ProgramCompiler>        compiler;       // The compiler which produced the current program, which edits are applied to if it is updatable, or null if the next compile must start afresh
+    std::vector<int>                        editedNodes;    // Nodes whose inputs have been edited since the current program was compiled
+    Program                                 program;
+    std::vector<size_t>                     visitStamps;    // For each node, the number of the last invalidation which visited it
+    size_t                                  numVisits;
+    bool                                    isDirty;        // True if an edit may have changed the program
+    CompileStats                            stats;
+    size_t                                  numCompiles;
+
+    void AddConsumer(int source, int consumer) { if(source >= 0) consumers[source].push_back(consumer); }
+    void RemoveConsumer(int source, int consumer) { if(source < 0) return; auto & c = consumers[source]; c.erase(std::find(begin(c), end(c), consumer)); }
+    bool IsUsed(int index) const { return !compiler || compiler->IsNodeUsed(index); } // Nodes are conservatively assumed to be used when there is no compiler to ask
+
+    // Discard folded outputs which may depend on the given node. Every downstream node is visited, as a node which was merged with an identical node,
+    // or which has since become unused, may have nothing cached itself while its consumers do.
+    void Invalidate(int index)
+    {
+        std::vector<int> stack = {index};
+        ++numVisits;
+        while(!stack.empty())
+        {
+            const int i = stack.back();
+            stack.pop_back();
+            if(visitStamps[i] == numVisits) continue;
+            visitStamps[i] = numVisits;
+            foldCache[i].clear();
+            stack.insert(end(stack), begin(consumers[i]), end(consumers[i]));
+        }
+    }
+
+    // Record an edit to the inputs of a node. Edits to nodes which the current program was not compiled from cannot change it.
+    void Touch(int index)
+    {
+        Invalidate(index);
+        editedNodes.push_back(index);
+        if(IsUsed(index)) isDirty = true;
+    }
+
+    // Record an edit to the flow of a node. The compiler cannot apply these, so the next compile starts afresh.
+    void TouchFlow(int index)
+    {
+        if(!IsUsed(index)) return;
+        compiler.reset();
+        isDirty = true;
+    }
+};
+
+IncrementalCompiler::IncrementalCompiler(std::vector<Node> nodes, int startIndex) : impl(std::make_unique<Impl>())
+{
+    impl->nodes = move(nodes);
+    impl->startIndex = startIndex;
+    impl->consumers.resize(impl->nodes.size());
+    for(int i=0; i<static_cast<int>(impl->nodes.size()); ++i) for(auto & wire : impl->nodes[i].inputs) impl->AddConsumer(wire.nodeIndex, i);
+    impl->foldCache.resize(impl->nodes.size());
+    impl->visitStamps.resize(impl->nodes.size(), 0);
+    impl->numVisits = 0;
+    impl->isDirty = true;
+    impl->stats = {};
+    impl->numCompiles = 0;
+}
+
+IncrementalCompiler::~IncrementalCompiler() {}
+
+const std::vector<Node> & IncrementalCompiler::GetNodes() const { return impl->nodes; }
+const CompileStats & IncrementalCompiler::GetStats() const { return impl->stats; }
+size_t IncrementalCompiler::GetCompileCount() const { return impl->numCompiles; }
+
+int IncrementalCompiler::AddNode(Node node)
+{
+    const int index = static_cast<int>(impl->nodes.size());
+    impl->consumers.emplace_back();
+    for(auto & wire : node.inputs) impl->AddConsumer(wire.nodeIndex, index);
+    impl->nodes.push_back(std::move(node));
+    impl->foldCache.emplace_back();
+    impl->visitStamps.push_back(0);
+    if(impl->compiler && impl->compiler->IsUpdatable()) impl->compiler->AddNode();
+    else impl->compiler.reset();
+    return index;
+}
+
+void IncrementalCompiler::SetImmediate(int nodeIndex, int pinIndex, std::string immediate)
+{
+    auto & wire = impl->nodes[nodeIndex].inputs[pinIndex];
+    impl->RemoveConsumer(wire.nodeIndex, nodeIndex);
+    if(impl->compiler && impl->compiler->IsUpdatable()) impl->compiler->SetWireSource(nodeIndex, wire.nodeIndex, -1);
+    wire = {-1, -1, move(immediate)};
+    impl->Touch(nodeIndex);
+}
+
+void IncrementalCompiler::SetWire(int nodeIndex, int pinIndex, int sourceNodeIndex, int sourcePinIndex)
+{
+    auto & wire = impl->nodes[nodeIndex].inputs[pinIndex];
+    impl->RemoveConsumer(wire.nodeIndex, nodeIndex);
+    if(impl->compiler && impl->compiler->IsUpdatable()) impl->compiler->SetWireSource(nodeIndex, wire.nodeIndex, sourceNodeIndex);
+    wire = {sourceNodeIndex, sourcePinIndex};
+    impl->AddConsumer(sourceNodeIndex, nodeIndex);
+    impl->Touch(nodeIndex);
+}
+
+void IncrementalCompiler::SetFlow(int nodeIndex, int nextNodeIndex)
+{
+    impl->nodes[nodeIndex].flowOutputIndex = nextNodeIndex;
+    impl->TouchFlow(nodeIndex); // Flow links carry no values, so no folded outputs are affected
+}
+
+void IncrementalCompiler::SetSubflow(int nodeIndex, int subflowIndex, int firstNodeIndex)
+{
+    impl->nodes[nodeIndex].subflowIndices[subflowIndex] = firstNodeIndex;
+    impl->TouchFlow(nodeIndex);
+}
+
+Program IncrementalCompiler::GetProgram()
+{
+    if(!impl->isDirty) return impl->program;
+
+    // Apply edits to the compiler of the current program if possible, or else compile afresh. A compiler which fails part way through an update is discarded.
+    auto & compiler = impl->compiler;
+    try
+    {
+        if(compiler && compiler->IsUpdatable())
+        {
+            if(compiler->Update(impl->editedNodes))
+            {
+                impl->program = compiler->LoadProgram();
+                ++impl->numCompiles;
+            }
+            impl->stats = compiler->GetStats();
+        }
+        else
+        {
+            compiler = std::make_unique<ProgramCompiler>(impl->nodes, &impl->foldCache, false, true);
+            impl->program = compiler->Compile(impl->startIndex);
+            impl->stats = compiler->GetStats();
+            ++impl->numCompiles;
+        }
+    }
+    catch(...)
+    {
+        compiler.reset();
+        throw;
+    }
+    impl->editedNodes.clear();
+    impl->isDirty = false;
+    return impl->program;
+}
+
+/////////////////////////
+// Transpilation logic //
+/////////////////////////
+
+// Writes the C++ spelling of a type. Classes, unions, and enums are spelled with the names they were bound under.
+static void WriteType(std::ostream & out, const Type & type)
+{
+    static const struct { std::type_index index; const char * name; } fundamentals[] = {
+        {typeid(void), "void"}, {typeid(bool), "bool"}, {typeid(char), "char"}, {typeid(signed char), "signed char"}, {typeid(unsigned char), "unsigned char"},
+        {typeid(short), "short"}, {typeid(unsigned short), "unsigned short"}, {typeid(int), "int"}, {typeid(unsigned int), "unsigned int"}, 
+        {typeid(long), "long"}, {typeid(unsigned long), "unsigned long"}, {typeid(long long), "long long"}, {typeid(unsigned long long), "unsigned long long"},
+        {typeid(float), "float"}, {typeid(double), "double"}, {typeid(long double), "long double"}
+    };
+    switch(type.kind)
+    {
+    case Type::Fundamental:
+        for(auto & f : fundamentals) if(f.index == type.index) { out << f.name; return; }
+        break;
+    case Type::Class: case Type::Union: case Type::Enum:
+        if(type.className.empty()) break;
+        out << type.className;
+        return;
+    case Type::Pointer: // Pointers to objects are spelled after their pointee. Pointers to members and to functions are not spelled.
+        if(type.classType || type.elementType->kind == Type::Function) break;
+        if(type.isPointeeConst) out << "const ";
+        if(type.isPointeeVolatile) out << "volatile ";
+        WriteType(out, *type.elementType);
+        out << " *";
+        return;
+    case Type::None: case Type::Array: case Type::Function: // No variable of these types can be declared and initialized by the generated code
+        break;
+    }
+    throw std::runtime_error(std::string("Transpile error - No C++ spelling known for ")+type.index.name());
+}
+
+static void WriteVarType(std::ostream & out, const VarType & type)
+{
+    if(type.isConst) out << "const ";
+    if(type.isVolatile) out << "volatile ";
+    WriteType(out, *type.type);
+    if(type.indirection == VarType::LValueRef) out << " &";
+    if(type.indirection == VarType::RValueRef) out << " &&";
+}
+
+// Returns true if name is spelled entirely with operator characters, such as "+" or "<<"
+static bool IsOperatorName(const std::string & name)
+{
+    return !name.empty() && name.find_first_not_of("+-*/%^&|~!=<>") == std::string::npos;
+}
+
+std::string ProgramCompiler::Transpile(int nodeIndex, const std::string & functionName)
+{
+    CompileLines(nodeIndex);
+
+    // Every slot is given a name. Each line declares new variables for its outputs, so that pure lines which are emitted 
+    // more than once never need to assign to an existing variable, and the names of slots are updated as lines are emitted.
+    std::vector<std::string> slotNames(totalSlots);
+    std::ostringstream body;
+    for(size_t i=0; i<constants.size(); ++i)
+    {
+        std::ostringstream ss; ss << "c" << i; slotNames[i] = ss.str();
+        body << "    const "; WriteType(body, *constantTypes[i]); body << ' ' << slotNames[i] << " = ";
+        if(constantTypes[i]->index == typeid(int)) body << *reinterpret_cast<const int *>(constants[i].get()) << ";\n";
+        else
+        {
+            // Infinities and NaNs have no literal spelling, and are printed as words which are not C++, so they are spelled through numeric_limits
+            const float f = *reinterpret_cast<const float *>(constants[i].get());
+            if(f != f) body << "std::numeric_limits<float>::quiet_NaN();\n";
+            else if(f == std::numeric_limits<float>::infinity()) body << "std::numeric_limits<float>::infinity();\n";
+            else if(f == -std::numeric_limits<float>::infinity()) body << "-std::numeric_limits<float>::infinity();\n";
+            else
+            {
+                std::ostringstream value; value << std::setprecision(std::numeric_limits<float>::max_digits10) << f;
+                auto v = value.str(); if(v.find_first_of(".e") == std::string::npos) v += ".0";
+                body << v << "f;\n";
+            }
+        }
+    }
+
+    // Returns true if a later line reads the value which line i writes to slot, before any line writes to slot again
+    auto isOutputRead = [&](size_t i, size_t slot)
+    {
+        for(size_t k=i+1; k<lines.size(); ++k)
+        {
+            if(std::find(begin(lines[k].inputs), end(lines[k].inputs), slot) != end(lines[k].inputs)) return true;
+            if(std::find(begin(lines[k].outputs), end(lines[k].outputs), slot) != end(lines[k].outputs)) return false;
+        }
+        return false;
+    };
+
+    // Branches and loops are emitted as structured statements. Each open branch arm is closed when the line its branch jumps past is reached.
+    std::string indent = "    ";
+    std::vector<size_t> closeLines;
+    auto closeBlocks = [&](size_t i)
+    {
+        while(!closeLines.empty() && closeLines.back() == i)
+        {
+            closeLines.pop_back();
+            indent.resize(indent.size()-4);
+            body << indent << "}\n";
+        }
+    };
+
+    std::ostringstream signature;
+    signature << "void " << functionName << "(";
+    for(size_t i=0; i<lines.size(); ++i)
+    {
+        closeBlocks(i);
+        const auto & line = lines[i];
+        auto arg = [&](size_t j) -> const std::string & { return slotNames[line.inputs[j]]; };
+        std::vector<std::string> outputs;
+        for(size_t j=0; j<line.outputs.size(); ++j) { std::ostringstream ss; ss << "v" << i << "_" << j; outputs.push_back(ss.str()); }
+
+        switch(line.type.GetKind())
+        {
+        case NodeType::EventNode: // The outputs of the entry event are the parameters of the generated function
+            if(i != 0) throw std::runtime_error("Transpile error - Event node is not at the start of the program!");
+            for(size_t j=0; j<outputs.size(); ++j)
+            {
+                if(j) signature << ", ";
+                WriteVarType(signature, line.type.GetOutputs()[j].type);
+                signature << ' ' << (outputs[j] = "a" + std::to_string(j));
+            }
+            break;
+        case NodeType::FunctionNode:
+            {
+                auto & function = *line.type.GetFunction();
+                const auto & name = function.GetName();
+                std::ostringstream call;
+                if(IsOperatorName(name) && function.GetParamCount() == 2) call << "(" << arg(0) << " " << name << " " << arg(1) << ")";
+                else if(IsOperatorName(name) && function.GetParamCount() == 1) call << "(" << name << arg(0) << ")";
+                else
+                {
+                    size_t first = 0;
+                    if(function.GetParamCount() > 0 && function.GetParamName(0) == "this") call << arg(first++) << "."; // Methods are called on their first argument
+                    call << name << "(";
+                    for(size_t j=first; j<function.GetParamCount(); ++j) call << (j > first ? ", " : "") << arg(j);
+                    call << ")";
+                }
+                if(function.IsAsync()) call << ".Get()"; // Generated code waits on asynchronous functions
+
+                body << indent;
+                if(!outputs.empty()) { WriteVarType(body, function.GetReturnType()); body << ' ' << outputs[0] << " = "; }
+                body << call.str() << ";\n";
+            }
+            break;
+        case NodeType::SplitNode: // Split outputs refer to the fields of the input object. Fields which are never read are not referred to, so that they do not warn as unused.
+            for(size_t j=0; j<outputs.size(); ++j) if(isOutputRead(i, line.outputs[j])) body << indent << "auto & " << outputs[j] << " = " << arg(0) << "." << line.type.GetClass()->fields[j].identifier << ";\n";
+            break;
+        case NodeType::BuildNode: // Build outputs are default constructed, and then have their fields assigned
+            body << indent; WriteType(body, *line.type.GetClass()); body << ' ' << outputs[0] << ";\n";
+            for(size_t j=0; j<line.inputs.size(); ++j) body << indent << outputs[0] << "." << line.type.GetClass()->fields[j].identifier << " = " << arg(j) << ";\n";
+            break;
+        case NodeType::BranchNode:
+            body << indent << "if(" << arg(0) << ")\n" << indent << "{\n";
+            closeLines.push_back(line.targets[1]);
+            indent += "    ";
+            break;
+        case NodeType::JumpNode: // Jumps only occur between the arms of a branch
+            assert(!closeLines.empty() && closeLines.back() == i+1);
+            closeLines.back() = line.targets[0];
+            body << indent.substr(4) << "}\n" << indent.substr(4) << "else\n" << indent.substr(4) << "{\n";
+            break;
+        case NodeType::LoopNode: // The index is tested before it is incremented, as in the interpreter, so that a loop ending at the largest int cannot overflow
+            body << indent << "if(" << arg(0) << " <= " << arg(1) << ") for("; WriteType(body, *line.type.GetOutputs()[0].type.type); body << ' ' << outputs[0] << " = " << arg(0) << "; ; ++" << outputs[0] << ")\n" << indent << "{\n";
+            indent += "    ";
+            break;
+        case NodeType::SubgraphNode: case NodeType::OutputNode: // Subgraphs are always inlined, so output nodes only remain if a subgraph is transpiled by itself
+            throw std::runtime_error("Transpile error - Subgraph output nodes have no C++ equivalent!");
+        case NodeType::LoopEndNode:
+            outputs[0] = arg(0);
+            body << indent << "if(" << arg(0) << " >= " << arg(1) << ") break;\n";
+            indent.resize(indent.size()-4);
+            body << indent << "}\n";
+            break;
+        }
+
+        for(size_t j=0; j<line.outputs.size(); ++j) slotNames[line.outputs[j]] = outputs[j];
+    }
+    closeBlocks(lines.size());
+    signature << ")";
+
+    std::ostringstream out;
+    out << "// Generated by TranspileGraph() from a graph of " << numGraphNodes << " nodes. Changes to this function will be lost if it is regenerated.\n";
+    out << signature.str() << "\n{\n" << body.str() << "}\n";
+    return out.str();
 }
 
 //////////////////////////////
@@ -205,6 +1387,10 @@ JsonValue SaveGraph(const std::vector<Node> & nodes)
 
         if(node.type.HasOutFlow()) jNode.push_back({"next", node.flowOutputIndex});
 
+        JsonArray jSubflows;
+        for(auto subflow : node.subflowIndices) jSubflows.push_back(subflow);
+        if(!jSubflows.empty()) jNode.push_back({"subflows", jSubflows});
+
         jNodes.push_back(jNode);
     }
     return jNodes;
@@ -246,10 +1432,72 @@ std::vector<Node> LoadGraph(const std::vector<NodeType> & nodeTypes, const JsonV
 
         // Connect flow wires
         node.flowOutputIndex = jNode["next"].numberOrDefault(-1);
+        const auto & jSubflows = jNode["subflows"].array();
+        if(jSubflows.size() != node.subflowIndices.size()) throw std::runtime_error("Node subflow count mismatch: "+id);
+        for(size_t i=0; i<jSubflows.size(); ++i) node.subflowIndices[i] = jSubflows[i].number<int>();
     }
     assert(nodes.size() == jGraph.array().size());
 
     // TODO: Validate the graph. At the very least, wire types, pin indices, and flow wiring.
 
     return nodes;
-}
\ No newline at end of file
+}
+
+JsonValue SaveSubgraph(const Subgraph & subgraph)
+{
+    return JsonObject{
+        {"name", subgraph.name},
+        {"input", subgraph.inputIndex},
+        {"output", subgraph.outputIndex},
+        {"nodes", SaveGraph(subgraph.nodes)}
+    };
+}
+
+Subgraph LoadSubgraph(const std::vector<NodeType> & nodeTypes, const JsonValue & jSubgraph)
+{
+    Subgraph subgraph;
+    subgraph.name = jSubgraph["name"].string();
+    subgraph.nodes = LoadGraph(nodeTypes, jSubgraph["nodes"]);
+    subgraph.inputIndex = jSubgraph["input"].numberOrDefault(-1);
+    subgraph.outputIndex = jSubgraph["output"].numberOrDefault(-1);
+    return subgraph;
+}
+
+JsonValue SaveProfile(const ProgramProfile & profile, const std::vector<int> & lineNodes)
+{
+    JsonArray jLines;
+    for(size_t i=0; i<profile.lines.size(); ++i)
+    {
+        const auto & line = profile.lines[i];
+        jLines.push_back(JsonObject{
+            {"line", i},
+            {"node", i < lineNodes.size() ? lineNodes[i] : -1},
+            {"id", line.type.GetUniqueId()},
+            {"calls", line.callCount},
+            {"total", line.totalTime},
+            {"max", line.maxTime}
+        });
+    }
+    return jLines;
+}
+
+JsonValue SaveChromeTrace(const ProgramProfile & profile, const std::vector<int> & lineNodes)
+{
+    // Complete events ("ph":"X") give the start and duration of each call in microseconds
+    JsonArray jEvents;
+    for(const auto & call : profile.calls)
+    {
+        const auto & type = profile.lines[call.line].type;
+        jEvents.push_back(JsonObject{
+            {"name", type.GetLabel()},
+            {"cat", type.GetUniqueId()},
+            {"ph", "X"},
+            {"ts", call.startTime * 1e6},
+            {"dur", call.duration * 1e6},
+            {"pid", 0},
+            {"tid", 0},
+            {"args", JsonObject{{"line", call.line}, {"node", call.line < lineNodes.size() ? lineNodes[call.line] : -1}}}
+        });
+    }
+    return JsonObject{{"traceEvents", jEvents}};
+}
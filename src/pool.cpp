@@ -0,0 +1,162 @@
+#include "pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+struct ThreadPool::Impl
+{
+    struct Queue { std::mutex mutex; std::deque<size_t> tasks; };
+
+    std::vector<std::thread>            threads;
+    std::unique_ptr<Queue[]>            queues;             // One queue per worker, followed by one for the thread calling Run()
+    size_t                              numQueues;
+
+    std::mutex                          mutex;              // Guards generation, stopping and error, and is held by threads parking on idle
+    std::condition_variable             wake;               // Signalled when a new set of tasks is started, or the pool is stopping
+    std::condition_variable             idle;               // Signalled when tasks are queued while threads are parked, or the last outstanding task completes
+    uint64_t                            generation;         // Incremented every time Run() is called
+    bool                                stopping;
+    std::exception_ptr                  error;              // First exception thrown by a task during the current call to Run()
+
+    const TaskFunction *                job;                // Function used to execute tasks during the current call to Run()
+    std::atomic<size_t>                 outstanding;        // Number of tasks which have been queued but not yet completed
+    std::atomic<size_t>                 queued;             // Number of tasks which are sitting in a queue
+    std::atomic<size_t>                 parked;             // Number of threads waiting on idle
+    std::atomic<bool>                   failed;             // True if a task has thrown during the current call to Run()
+
+    enum { MaxIdleSpins = 64 };                             // Number of times a thread which finds no task yields before it parks
+
+    Impl(size_t numWorkers) : queues(new Queue[numWorkers+1]), numQueues(numWorkers+1), generation(), stopping(), job(), outstanding(), queued(), parked(), failed()
+    {
+        for(size_t i=0; i<numWorkers; ++i) threads.push_back(std::thread([this, i]() { WorkerMain(i); }));
+    }
+
+    ~Impl()
+    {
+        { std::lock_guard<std::mutex> lock(mutex); stopping = true; }
+        wake.notify_all();
+        for(auto & thread : threads) thread.join();
+    }
+
+    void Push(size_t queue, size_t task)
+    {
+        std::lock_guard<std::mutex> lock(queues[queue].mutex);
+        queues[queue].tasks.push_back(task);
+        ++queued;
+    }
+
+    // Wake any parked threads. A thread parks only after checking queued and outstanding while holding mutex, so taking mutex here ensures it is not missed.
+    void WakeParked()
+    {
+        if(parked.load() == 0) return;
+        { std::lock_guard<std::mutex> lock(mutex); }
+        idle.notify_all();
+    }
+
+    // Take the most recently queued task from our own queue, or failing that, the oldest task from another worker's queue
+    bool Take(size_t queue, size_t & task)
+    {
+        for(size_t i=0; i<numQueues; ++i)
+        {
+            auto & q = queues[(queue + i) % numQueues];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if(q.tasks.empty()) continue;
+            if(i == 0) { task = q.tasks.back(); q.tasks.pop_back(); }
+            else { task = q.tasks.front(); q.tasks.pop_front(); }
+            --queued;
+            return true;
+        }
+        return false;
+    }
+
+    // Execute tasks until every outstanding task has completed. A thread which finds no task yields briefly, as running tasks often spawn more,
+    // and then parks until a task is queued or the last outstanding task completes.
+    void Work(size_t queue)
+    {
+        std::vector<size_t> spawned;
+        for(size_t spins=0; outstanding.load() != 0; )
+        {
+            size_t task;
+            if(!Take(queue, task))
+            {
+                if(++spins < MaxIdleSpins) { std::this_thread::yield(); continue; }
+                std::unique_lock<std::mutex> lock(mutex);
+                ++parked;
+                idle.wait(lock, [this]() { return queued.load() != 0 || outstanding.load() == 0; });
+                --parked;
+                spins = 0;
+                continue;
+            }
+            spins = 0;
+
+            if(!failed.load())
+            {
+                try { (*job)(task, spawned); }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if(!error) error = std::current_exception();
+                    failed = true;
+                    spawned.clear();
+                }
+            }
+
+            // Account for spawned tasks before retiring this one, so that outstanding cannot reach zero early
+            outstanding += spawned.size();
+            for(auto t : spawned) Push(queue, t);
+            const bool isLast = --outstanding == 0;
+            if(isLast || !spawned.empty()) WakeParked();
+            spawned.clear();
+        }
+    }
+
+    void WorkerMain(size_t queue)
+    {
+        uint64_t seen = 0;
+        while(true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if(stopping) return;
+                seen = generation;
+            }
+            Work(queue);
+        }
+    }
+};
+
+ThreadPool::ThreadPool(size_t numWorkers) : impl(std::make_unique<Impl>(numWorkers)) {}
+ThreadPool::~ThreadPool() {}
+
+size_t ThreadPool::GetWorkerCount() const { return impl->threads.size(); }
+
+void ThreadPool::Run(const size_t roots[], size_t rootCount, const TaskFunction & execute)
+{
+    if(rootCount == 0) return;
+
+    // Publish the job and distribute the root tasks across all queues
+    impl->job = &execute;
+    impl->failed = false;
+    impl->outstanding = rootCount;
+    for(size_t i=0; i<rootCount; ++i) impl->Push(i % impl->numQueues, roots[i]);
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        ++impl->generation;
+    }
+    impl->wake.notify_all();
+
+    // Participate in the work, and report the first failure once every task has retired
+    impl->Work(impl->numQueues-1);
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        std::swap(error, impl->error);
+    }
+    if(error) std::rethrow_exception(error);
+}
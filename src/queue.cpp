@@ -0,0 +1,282 @@
+#include "queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+static int64_t GetTime() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// The queue is a bounded ring of cells, each of which holds the arguments of a single event. Producers and workers claim cells by advancing their own position with a
+// compare-and-swap, and each cell's sequence number records which lap of the ring it is ready for, so that neither side ever takes a lock while the queue is neither full
+// nor empty. Locks are only taken to put a thread to sleep, or to wake one which is sleeping.
+struct EventQueue::Impl
+{
+    struct Param { const Type * type; size_t offset; };     // Arguments are constructed at a fixed offset in each cell's storage. Type is null for parameters passed by reference, whose address is stored instead.
+    struct Cell { std::atomic<size_t> sequence; int64_t postTime; bool isValid; };
+
+    Program                             program;
+    std::vector<Param>                  params;
+    Backpressure                        backpressure;
+    size_t                              mask;               // Capacity minus one, capacity being a power of two
+    size_t                              cellStride;         // Size of the storage of a single cell, in units of max_align_t
+    std::unique_ptr<Cell[]>             cells;
+    std::vector<std::max_align_t>       storage;            // For each cell, storage for the arguments of an event
+
+    char                                pad0[64];
+    std::atomic<size_t>                 enqueuePos;         // Position of the next cell to be claimed by a producer. Padded so that producers and workers do not share a cache line.
+    char                                pad1[64];
+    std::atomic<size_t>                 dequeuePos;         // Position of the next cell to be claimed by a worker
+    char                                pad2[64];
+
+    std::mutex                          mutex;              // Guards stopping, error and the statistics below, and is held by threads going to sleep
+    std::condition_variable             workAvailable, spaceAvailable, batchRetired;
+    std::atomic<size_t>                 sleepingWorkers, waitingProducers, waitingFlushes;
+    bool                                stopping;
+    std::exception_ptr                  error;              // First exception thrown by a batch since the last call to Flush()
+    std::atomic<size_t>                 maxDepth;
+    std::atomic<uint64_t>               rejected, abandoned;
+    uint64_t                            dispatched, failed, batches;
+    double                              totalLatency, maxLatency;
+    std::vector<std::thread>            threads;
+
+    Impl(Program program, size_t capacity, Backpressure backpressure) : program(std::move(program)), backpressure(backpressure), enqueuePos(), dequeuePos(),
+        sleepingWorkers(), waitingProducers(), waitingFlushes(), stopping(), maxDepth(), rejected(), abandoned(), dispatched(), failed(), batches(), totalLatency(), maxLatency()
+    {
+        // Lay out the arguments of a single event
+        size_t size = 0;
+        if(!this->program.GetLines().empty()) for(auto & pin : this->program.GetLines()[0].type.GetOutputs())
+        {
+            const Type * type = pin.type.indirection == VarType::None ? pin.type.type : nullptr;
+            if(type && !type->IsCopyConstructible() && !type->IsMoveConstructible()) throw std::runtime_error("Unable to queue event - Parameter type cannot be copied or moved!");
+            const size_t paramSize = type ? type->size : sizeof(void *), align = type ? std::min(type->size & (~type->size + 1), alignof(std::max_align_t)) : alignof(void *);
+            if(align) size = (size + align - 1) / align * align;
+            params.push_back({type, size});
+            size += paramSize;
+        }
+        cellStride = (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+
+        size_t cellCount = 2; // A ring of one cell could not tell a published cell from a retired one
+        while(cellCount < capacity) cellCount *= 2;
+        mask = cellCount - 1;
+        cells.reset(new Cell[cellCount]);
+        for(size_t i=0; i<cellCount; ++i) cells[i].sequence.store(i, std::memory_order_relaxed);
+        storage.resize(cellStride * cellCount);
+    }
+
+    char * GetData(size_t pos) { return reinterpret_cast<char *>(storage.data() + (pos & mask) * cellStride); }
+
+    // Returns true if the cell at pos is free for producers on the current lap, false if the queue is full
+    bool TryClaimForWrite(size_t & pos)
+    {
+        pos = enqueuePos.load(std::memory_order_relaxed);
+        while(true)
+        {
+            const auto diff = static_cast<ptrdiff_t>(cells[pos & mask].sequence.load(std::memory_order_acquire) - pos);
+            if(diff == 0 && enqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) return true;
+            if(diff < 0) return false;
+            if(diff > 0) pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Returns true if the cell at pos holds a published event, false if the queue is empty
+    bool TryClaimForRead(size_t & pos)
+    {
+        pos = dequeuePos.load(std::memory_order_relaxed);
+        while(true)
+        {
+            const auto diff = static_cast<ptrdiff_t>(cells[pos & mask].sequence.load(std::memory_order_acquire) - (pos+1));
+            if(diff == 0 && dequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) return true;
+            if(diff < 0) return false;
+            if(diff > 0) pos = dequeuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool IsFull() const { auto pos = enqueuePos.load(); return static_cast<ptrdiff_t>(cells[pos & mask].sequence.load(std::memory_order_acquire) - pos) < 0; }
+    bool IsEmpty() const { auto pos = dequeuePos.load(); return cells[pos & mask].sequence.load(std::memory_order_acquire) != pos+1; }
+    bool IsRetired(size_t pos) const { return cells[pos & mask].sequence.load(std::memory_order_acquire) > pos+1; }
+
+    // Wake threads sleeping on cond, if there are any. The fence pairs with the one a thread issues after announcing that it is going to sleep, so that either the sleeper
+    // sees the change which should wake it, or this thread sees the sleeper. Taking the mutex ensures that a sleeper which has checked its condition is waiting before it is notified.
+    void Wake(std::atomic<size_t> & sleepers, std::condition_variable & cond)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(sleepers.load(std::memory_order_relaxed) == 0) return;
+        { std::lock_guard<std::mutex> lock(mutex); }
+        cond.notify_all();
+    }
+
+    template<class F> void Sleep(std::unique_lock<std::mutex> & lock, std::atomic<size_t> & sleepers, std::condition_variable & cond, F isAwake)
+    {
+        ++sleepers;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait(lock, isAwake);
+        --sleepers;
+    }
+
+    bool Post(void * args[], bool moveArgs)
+    {
+        size_t pos;
+        while(!TryClaimForWrite(pos))
+        {
+            if(backpressure == Reject) { ++rejected; return false; }
+            std::unique_lock<std::mutex> lock(mutex);
+            Sleep(lock, waitingProducers, spaceAvailable, [this]() { return !IsFull(); });
+        }
+
+        // Construct the arguments in the claimed cell. If a constructor throws, the cell is still published, so that the ring is not blocked, but is skipped by the workers.
+        auto & cell = cells[pos & mask];
+        auto data = GetData(pos);
+        size_t constructed = 0;
+        try
+        {
+            for(; constructed<params.size(); ++constructed)
+            {
+                auto & param = params[constructed];
+                if(!param.type) *reinterpret_cast<void **>(data + param.offset) = args[constructed];
+                else if(moveArgs && param.type->IsMoveConstructible()) param.type->MoveConstruct(data + param.offset, args[constructed]);
+                else param.type->CopyConstruct(data + param.offset, args[constructed]);
+            }
+            cell.isValid = true;
+        }
+        catch(...)
+        {
+            while(constructed--) if(params[constructed].type) params[constructed].type->Destruct(data + params[constructed].offset);
+            cell.isValid = false;
+            ++abandoned;
+            cell.sequence.store(pos+1, std::memory_order_release);
+            Wake(sleepingWorkers, workAvailable);
+            throw;
+        }
+        cell.postTime = GetTime();
+        cell.sequence.store(pos+1, std::memory_order_release);
+
+        // Track the deepest the queue has been, measured when each event is posted
+        const size_t dequeued = dequeuePos.load(std::memory_order_relaxed), depth = pos+1 > dequeued ? pos+1 - dequeued : 0;
+        size_t prevMax = maxDepth.load(std::memory_order_relaxed);
+        while(depth > prevMax && !maxDepth.compare_exchange_weak(prevMax, depth, std::memory_order_relaxed)) {}
+
+        Wake(sleepingWorkers, workAvailable);
+        return true;
+    }
+
+    // Invoke the program for the events in the claimed cells, then destroy their arguments and return the cells to the producers
+    void Dispatch(ExecutionContext & context, const size_t positions[], size_t count, std::vector<void *> & args)
+    {
+        size_t numEvents = 0;
+        for(size_t i=0; i<count; ++i)
+        {
+            if(!cells[positions[i] & mask].isValid) continue;
+            auto data = GetData(positions[i]);
+            for(size_t j=0; j<params.size(); ++j) args[numEvents*params.size() + j] = params[j].type ? data + params[j].offset : *reinterpret_cast<void **>(data + params[j].offset);
+            ++numEvents;
+        }
+
+        std::exception_ptr batchError;
+        try { if(numEvents) program.InvokeBatch(context, args.data(), params.size(), numEvents); }
+        catch(...) { batchError = std::current_exception(); }
+
+        const int64_t end = GetTime();
+        double latencySum = 0, latencyMax = 0;
+        for(size_t i=0; i<count; ++i)
+        {
+            auto & cell = cells[positions[i] & mask];
+            if(!cell.isValid) continue;
+            const double latency = (end - cell.postTime) * 1e-9;
+            latencySum += latency;
+            latencyMax = std::max(latencyMax, latency);
+            auto data = GetData(positions[i]);
+            for(auto & param : params) if(param.type) param.type->Destruct(data + param.offset);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            dispatched += numEvents;
+            if(batchError) { failed += numEvents; if(!error) error = batchError; }
+            if(numEvents) ++batches;
+            totalLatency += latencySum;
+            maxLatency = std::max(maxLatency, latencyMax);
+        }
+
+        for(size_t i=0; i<count; ++i) cells[positions[i] & mask].sequence.store(positions[i] + mask + 1, std::memory_order_release);
+        Wake(waitingProducers, spaceAvailable);
+        Wake(waitingFlushes, batchRetired);
+    }
+
+    void WorkerMain()
+    {
+        ExecutionContext context(program);
+        std::vector<void *> args(Program::MaxBatchChunk * std::max<size_t>(params.size(), 1));
+        size_t positions[Program::MaxBatchChunk];
+        while(true)
+        {
+            // Take as many events as are ready, up to a full batch, yielding briefly before going to sleep on an empty queue
+            size_t count = 0;
+            for(int spin=0; count == 0 && spin < 16; ++spin)
+            {
+                while(count < Program::MaxBatchChunk && TryClaimForRead(positions[count])) ++count;
+                if(count == 0) std::this_thread::yield();
+            }
+            if(count) { Dispatch(context, positions, count, args); continue; }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            Sleep(lock, sleepingWorkers, workAvailable, [this]() { return stopping || !IsEmpty(); });
+            if(stopping && IsEmpty()) return;
+        }
+    }
+};
+
+EventQueue::EventQueue(Program program, size_t capacity, size_t numWorkers, Backpressure backpressure) : impl(std::make_unique<Impl>(std::move(program), capacity, backpressure))
+{
+    for(size_t i=0; i<numWorkers; ++i) impl->threads.push_back(std::thread([this]() { impl->WorkerMain(); }));
+}
+
+EventQueue::~EventQueue()
+{
+    { std::lock_guard<std::mutex> lock(impl->mutex); impl->stopping = true; }
+    impl->workAvailable.notify_all();
+    for(auto & thread : impl->threads) thread.join();
+}
+
+bool EventQueue::Post(void * args[], size_t argCount, bool moveArgs)
+{
+    assert(argCount == impl->params.size());
+    return impl->Post(args, moveArgs);
+}
+
+void EventQueue::Flush()
+{
+    // Every position before the last one posted has been retired once the cells of the final lap have been, as each cell must be retired before it can be reused
+    const size_t end = impl->enqueuePos.load();
+    const size_t begin = end > impl->mask+1 ? end - (impl->mask+1) : 0;
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(impl->mutex);
+        impl->Sleep(lock, impl->waitingFlushes, impl->batchRetired, [&]()
+        {
+            for(size_t pos=begin; pos<end; ++pos) if(!impl->IsRetired(pos)) return false;
+            return true;
+        });
+        std::swap(error, impl->error);
+    }
+    if(error) std::rethrow_exception(error);
+}
+
+EventQueue::Stats EventQueue::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    const size_t enqueued = impl->enqueuePos.load(), dequeued = impl->dequeuePos.load();
+    Stats stats;
+    stats.capacity = impl->mask+1;
+    stats.depth = enqueued > dequeued ? enqueued - dequeued : 0;
+    stats.maxDepth = impl->maxDepth.load();
+    stats.posted = enqueued - impl->abandoned.load();
+    stats.rejected = impl->rejected.load();
+    stats.dispatched = impl->dispatched;
+    stats.failed = impl->failed;
+    stats.batches = impl->batches;
+    stats.meanLatency = impl->dispatched ? impl->totalLatency / impl->dispatched : 0;
+    stats.maxLatency = impl->maxLatency;
+    return stats;
+}
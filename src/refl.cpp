@@ -1,29 +1,429 @@
 #include "refl.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <sstream>
+
+//////////////////
+// InstancePool //
+//////////////////
+
+struct InstancePool::Shared : std::enable_shared_from_this<Shared>
+{
+    size_t                              id;                 // Unique among pools, so that each thread can find its cache for this pool
+    std::atomic<size_t>                 refs {1};           // One for each live block, plus one until the pool is destroyed
+    std::shared_ptr<Shared>             self;               // Set when the pool is destroyed, and reset by whichever of the pool and its live blocks releases the last reference
+    std::mutex                          mutex;
+    Block *                             freeBlocks = nullptr;
+    size_t                              numFree = 0;
+    size_t                              blockSize = 0;
+    size_t                              numAllocated = 0;
+    size_t                              numAllocations = 0, numReuses = 0, numReleases = 0; // Counts from threads without a cache, and from the caches of threads which have exited
+    std::vector<ThreadCache *>          caches;             // Caches of the threads which are using the pool
+    std::atomic<bool>                   isDestroyed {false};
+
+    Shared(size_t id) : id(id) {}
+    void Push(Block * block) { block->next = freeBlocks; freeBlocks = block; ++numFree; }
+    Block * Pop() { auto block = freeBlocks; freeBlocks = block->next; --numFree; return block; }
+};
+
+// Counts are only written by the owning thread, but are atomic so that GetStats() may read them from any thread
+struct InstancePool::ThreadCache
+{
+    std::shared_ptr<Shared>             shared;
+    Block *                             blocks = nullptr;
+    std::atomic<size_t>                 numCached {0}, numAllocations {0}, numReuses {0}, numReleases {0};
+
+    static void Add(std::atomic<size_t> & count, size_t n) { count.store(count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    Block * Pop() { auto block = blocks; blocks = block->next; Add(numCached, size_t(-1)); Add(numAllocations, 1); Add(numReuses, 1); return block; }
+
+    // Return cached blocks to the shared list when the thread exits, or to the global allocator if the pool has been destroyed
+    ~ThreadCache()
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->caches.erase(std::find(begin(shared->caches), end(shared->caches), this));
+        shared->numAllocations += numAllocations;
+        shared->numReuses += numReuses;
+        shared->numReleases += numReleases;
+        while(auto block = blocks)
+        {
+            blocks = block->next;
+            if(shared->isDestroyed) std::free(block);
+            else shared->Push(block);
+        }
+    }
+};
+
+static std::atomic<size_t> nextPoolId {0};
+
+InstancePool::InstancePool() : shared(std::make_shared<Shared>(nextPoolId++)) {}
+
+InstancePool::~InstancePool() 
+{ 
+    // Blocks which are still live keep the shared state alive, and are freed as they are released. Blocks cached by other threads are freed when those threads exit.
+    Trim();
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->isDestroyed = true;
+        shared->self = shared;
+    }
+    if(shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) shared->self.reset();
+}
+
+InstancePool::ThreadCache * InstancePool::GetThreadCache(Shared & shared, bool create)
+{
+    // Each thread holds its caches in a table indexed by pool id. Ids are not reused, so the entry of a destroyed pool is never mistaken for that of a later pool.
+    // Once the table has been destroyed, as the thread exits, pools are used without a cache.
+    const size_t id = shared.id;
+    static thread_local bool isTableDestroyed = false;
+    static thread_local struct Table { std::vector<std::unique_ptr<ThreadCache>> caches; ~Table() { isTableDestroyed = true; } } table;
+    if(isTableDestroyed) return nullptr;
+    if(id < table.caches.size() && table.caches[id]) return table.caches[id].get();
+    if(!create) return nullptr;
+
+    if(id >= table.caches.size()) table.caches.resize(id+1);
+    auto cache = std::make_unique<ThreadCache>();
+    cache->shared = shared.shared_from_this();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    shared.caches.push_back(cache.get());
+    return (table.caches[id] = std::move(cache)).get();
+}
+
+void * InstancePool::Allocate(size_t size)
+{
+    auto cache = GetThreadCache(*shared, true);
+    auto block = cache && cache->blocks ? cache->Pop() : Refill(cache, size);
+    shared->refs.fetch_add(1, std::memory_order_relaxed);
+    return block;
+}
+
+void InstancePool::Release(Shared & shared, void * block)
+{
+    if(auto cache = shared.isDestroyed.load(std::memory_order_relaxed) ? nullptr : GetThreadCache(shared, true))
+    {
+        cache->blocks = new(block) Block{cache->blocks};
+        ThreadCache::Add(cache->numCached, 1);
+        ThreadCache::Add(cache->numReleases, 1);
+        if(cache->numCached.load(std::memory_order_relaxed) > MaxCachedBlocks) Spill(*cache);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        ++shared.numReleases;
+        if(shared.isDestroyed) std::free(block);
+        else shared.Push(new(block) Block);
+    }
+
+    // The release of the last live block of a destroyed pool frees its shared state, unless the caches of other threads are still holding it
+    if(shared.refs.fetch_sub(1, std::memory_order_acq_rel) == 1) shared.self.reset();
+}
+
+// Moves up to half a cache's worth of blocks from the shared list into an empty cache and allocates one of them, or allocates a new block if the shared list is empty
+void * InstancePool::Refill(ThreadCache * cache, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        assert(!shared->blockSize || size == shared->blockSize);
+        shared->blockSize = size;
+        if(shared->freeBlocks && !cache)
+        {
+            ++shared->numAllocations;
+            ++shared->numReuses;
+            return shared->Pop();
+        }
+        if(shared->freeBlocks)
+        {
+            size_t n = 0;
+            for(; n < MaxCachedBlocks/2 && shared->freeBlocks; ++n)
+            {
+                auto block = shared->Pop();
+                block->next = cache->blocks;
+                cache->blocks = block;
+            }
+            ThreadCache::Add(cache->numCached, n);
+        }
+        else
+        {
+            ++shared->numAllocated;
+            if(!cache) ++shared->numAllocations;
+        }
+    }
+    if(cache && cache->blocks) return cache->Pop();
+
+    auto block = std::malloc(std::max(size, sizeof(Block)));
+    if(!block)
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        --shared->numAllocated;
+        if(!cache) --shared->numAllocations;
+        throw std::bad_alloc();
+    }
+    if(cache) ThreadCache::Add(cache->numAllocations, 1);
+    return block;
+}
+
+// Moves half of a full cache's blocks to the shared list, so that blocks released by one thread can be reused by others
+void InstancePool::Spill(ThreadCache & cache)
+{
+    auto & shared = cache.shared;
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    for(size_t i=0; i<MaxCachedBlocks/2; ++i)
+    {
+        auto block = cache.blocks;
+        cache.blocks = block->next;
+        shared->Push(block);
+    }
+    ThreadCache::Add(cache.numCached, size_t(0) - MaxCachedBlocks/2);
+}
+
+void InstancePool::Trim()
+{
+    Block * blocks = nullptr;
+    if(auto cache = GetThreadCache(*shared, false))
+    {
+        blocks = cache->blocks;
+        cache->blocks = nullptr;
+        cache->numCached = 0;
+    }
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        while(shared->freeBlocks)
+        {
+            auto block = shared->Pop();
+            block->next = blocks;
+            blocks = block;
+        }
+    }
+    while(auto block = blocks)
+    {
+        blocks = block->next;
+        std::free(block);
+    }
+}
+
+InstancePool::Stats InstancePool::GetStats() const
+{
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    size_t allocations = shared->numAllocations, reuses = shared->numReuses, releases = shared->numReleases, free = shared->numFree;
+    for(auto cache : shared->caches)
+    {
+        allocations += cache->numAllocations.load(std::memory_order_relaxed);
+        reuses += cache->numReuses.load(std::memory_order_relaxed);
+        releases += cache->numReleases.load(std::memory_order_relaxed);
+        free += cache->numCached.load(std::memory_order_relaxed);
+    }
+    return {shared->blockSize, shared->numAllocated, reuses, allocations > releases ? allocations - releases : 0, free};
+}
+
+///////////////////
+// InstanceArena //
+///////////////////
+
+// Chunks are followed by their blocks, and each block is preceded by the address of its chunk, so that blocks may be released without reference to the arena
+struct alignas(std::max_align_t) InstanceArena::Chunk
+{
+    std::atomic<size_t>                 refs;               // One for each live instance, plus one while the chunk is owned by the arena
+    size_t                              size;               // Bytes of storage following the chunk
+};
+struct alignas(std::max_align_t) InstanceArena::Block { Chunk * chunk; };
+static thread_local InstanceArena * currentArena = nullptr;
+
+static size_t RoundUpToAlignment(size_t size) { return (size + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t); }
+
+InstanceArena::InstanceArena(size_t chunkSize) : current(), offset(), chunkSize(RoundUpToAlignment(chunkSize)), numAllocatedChunks(), numInstances(), numResets() {}
+
+InstanceArena::~InstanceArena()
+{
+    assert(currentArena != this);
+    for(auto chunk : chunks) if(chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) std::free(chunk);
+}
+
+void * InstanceArena::Allocate(size_t size)
+{
+    auto NewChunk = [this](size_t size, size_t refs)
+    {
+        auto chunk = std::malloc(sizeof(Chunk) + size);
+        if(!chunk) throw std::bad_alloc();
+        ++numAllocatedChunks;
+        return new(chunk) Chunk{{refs}, size};
+    };
+
+    const size_t blockSize = sizeof(Block) + RoundUpToAlignment(size);
+    if(blockSize > chunkSize) 
+    {
+        // Oversized blocks are given a chunk of their own, which the arena does not own, and which is freed along with its block
+        auto chunk = NewChunk(blockSize, 1);
+        ++numInstances;
+        return new(chunk + 1) Block{chunk} + 1;
+    }
+
+    // Once the current chunk is full, start over within it if all of its instances have been released, otherwise move on to the next chunk, allocating one if every chunk is full
+    if(current < chunks.size() && offset + blockSize > chunks[current]->size)
+    {
+        if(chunks[current]->refs.load(std::memory_order_acquire) != 1) ++current;
+        offset = 0;
+    }
+    if(current == chunks.size()) chunks.push_back(NewChunk(chunkSize, 1));
+    auto chunk = chunks[current];
+    chunk->refs.fetch_add(1, std::memory_order_relaxed);
+    auto block = new(reinterpret_cast<char *>(chunk + 1) + offset) Block{chunk};
+    offset += blockSize;
+    ++numInstances;
+    return block + 1;
+}
+
+void InstanceArena::Release(void * block)
+{
+    auto chunk = (reinterpret_cast<Block *>(block) - 1)->chunk;
+    if(chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) std::free(chunk);
+}
+
+void InstanceArena::Reset()
+{
+    // A chunk referenced only by the arena holds no live instances, and no other thread can reference it again, so it can be reused. The rest are handed off to their instances.
+    size_t kept = 0;
+    for(auto chunk : chunks)
+    {
+        if(chunk->refs.load(std::memory_order_acquire) == 1) chunks[kept++] = chunk;
+        else if(chunk->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) std::free(chunk);
+    }
+    chunks.resize(kept);
+    current = offset = 0;
+    ++numResets;
+}
+
+InstanceArena::Stats InstanceArena::GetStats() const 
+{ 
+    return {chunkSize, numAllocatedChunks, chunks.size(), numInstances, numResets}; 
+}
+
+InstanceArena * InstanceArena::GetCurrent() { return currentArena; }
+InstanceArena * InstanceArena::SetCurrent(InstanceArena * arena) { auto previous = currentArena; currentArena = arena; return previous; }
+
+/////////////////////////
+// Types and functions //
+/////////////////////////
+
+namespace
+{
+    // An instance together with the function which destroys it, allocated along with its reference count by std::allocate_shared(). Storage is rounded up to one of a few
+    // sizes, and comes first, so that a pointer to the PooledInstance is also a pointer to the instance. Instances do not refer to their type, and may outlive it.
+    template<size_t N> struct PooledInstance
+    {
+        alignas(std::max_align_t) unsigned char storage[N];
+        void                            (*destruct)(void *);    // Set once the instance has been constructed, so that an instance whose constructor threw is not destroyed. Null for trivial types.
+
+                                        PooledInstance()    : destruct() {}
+                                        ~PooledInstance()   { if(destruct) destruct(storage); }
+    };
+
+    // Holds the owner of its pool, rather than the pool itself, so that the control block of an instance can release its block after the pool has been destroyed
+    template<class T> struct PoolAllocator
+    {
+        typedef T value_type;
+        InstancePool * pool;                                    // Only used to allocate, while the pool is known to be alive
+        InstancePool::Owner owner;
+        PoolAllocator(InstancePool * pool) : pool(pool), owner(pool->GetOwner()) {}
+        template<class U> PoolAllocator(const PoolAllocator<U> & r) : pool(r.pool), owner(r.owner) {}
+        T * allocate(size_t n) { assert(n == 1); return static_cast<T *>(pool->Allocate(sizeof(T))); }
+        void deallocate(T * p, size_t) { owner.Release(p); }
+        template<class U> bool operator == (const PoolAllocator<U> & r) const { return owner == r.owner; }
+        template<class U> bool operator != (const PoolAllocator<U> & r) const { return !(owner == r.owner); }
+    };
+
+    template<class T> struct ArenaAllocator
+    {
+        typedef T value_type;
+        InstanceArena * arena;
+        ArenaAllocator(InstanceArena * arena) : arena(arena) {}
+        template<class U> ArenaAllocator(const ArenaAllocator<U> & r) : arena(r.arena) {}
+        T * allocate(size_t n) { return static_cast<T *>(arena->Allocate(n * sizeof(T))); }
+        void deallocate(T * p, size_t) { InstanceArena::Release(p); }
+        template<class U> bool operator == (const ArenaAllocator<U> & r) const { return arena == r.arena; }
+        template<class U> bool operator != (const ArenaAllocator<U> & r) const { return arena != r.arena; }
+    };
+
+    template<size_t N, class Allocator> std::shared_ptr<void> ConstructInstance(const Type & type, const Allocator & alloc, const std::function<void(void * l)> & construct)
+    {
+        auto instance = std::allocate_shared<PooledInstance<N>>(alloc);
+        construct(instance->storage);
+        instance->destruct = type.IsTrivial() ? nullptr : type.nonTrivialOps->destruct;
+        return instance;
+    }
+
+    template<class Allocator> std::shared_ptr<void> ConstructInstance(const Type & type, const Allocator & alloc, const std::function<void(void * l)> & construct)
+    {
+        static_assert(Type::MaxPooledSize == 256, "Size classes must cover every pooled size");
+        if(type.size <=  16) return ConstructInstance< 16>(type, alloc, construct);
+        if(type.size <=  32) return ConstructInstance< 32>(type, alloc, construct);
+        if(type.size <=  64) return ConstructInstance< 64>(type, alloc, construct);
+        if(type.size <= 128) return ConstructInstance<128>(type, alloc, construct);
+        return ConstructInstance<256>(type, alloc, construct);
+    }
+}
+
+std::shared_ptr<void> Type::Construct(const std::function<void(void * l)> & construct) const
+{
+    if(size <= MaxPooledSize)
+    {
+        if(auto arena = InstanceArena::GetCurrent()) return ConstructInstance(*this, ArenaAllocator<char>(arena), construct);
+        return ConstructInstance(*this, PoolAllocator<char>(&GetPool()), construct);
+    }
+
+    // Larger instances are allocated individually, as their construction is likely to outweigh the cost of allocating them
+    auto obj = std::malloc(size);
+    try { construct(obj); } catch(...) { std::free(obj); throw; }
+    if(IsTrivial()) return std::shared_ptr<void>(obj, std::free); // Manage trivial types with malloc and free
+    return std::shared_ptr<void>(obj, [this](void * p) { Destruct(p); std::free(p); }); // Non-trivial types must also be destroyed
+}
+
+InstancePool & Type::CreatePool() const
+{
+    // Most types never construct a pooled instance, so pools are only created once needed. Threads which race to create the pool each make one, and all but the first discard theirs.
+    auto created = new InstancePool();
+    InstancePool * expected = nullptr;
+    if(pool.compare_exchange_strong(expected, created, std::memory_order_acq_rel, std::memory_order_acquire)) return *created;
+    delete created;
+    return *expected;
+}
+
 std::shared_ptr<void> Type::DefConstruct() const
 {
     assert(IsDefConstructible());
-    if(IsTrivial()) return std::shared_ptr<void>(std::malloc(size), std::free); // Manage trivial types with malloc and free
-    else return nonTrivialOps->defConstruct(); // If the type has a constructor, invoke it
+    return Construct([this](void * l) { DefConstruct(l); });
 }
 
 std::shared_ptr<void> Type::CopyConstruct(const void * r) const
 {
     assert(IsCopyConstructible());
-    if(IsTrivial())
-    {
-        auto obj = DefConstruct();
-        CopyAssign(obj.get(), r);
-        return obj;
-    }
-    else return nonTrivialOps->copyConstruct(r);
+    return Construct([this, r](void * l) { CopyConstruct(l, r); });
 }
 
 std::shared_ptr<void> Type::MoveConstruct(void * r) const
 {
     assert(IsMoveConstructible());
-    if(IsTrivial()) return CopyConstruct(r);
-    else return nonTrivialOps->moveConstruct(r);
+    return Construct([this, r](void * l) { MoveConstruct(l, r); });
+}
+
+void Type::DefConstruct(void * l) const
+{
+    assert(IsDefConstructible());
+    if(!IsTrivial()) nonTrivialOps->defConstruct(l); // Trivial types require no initialization
+}
+
+void Type::CopyConstruct(void * l, const void * r) const
+{
+    assert(IsCopyConstructible());
+    if(IsTrivial()) memcpy(l, r, size);
+    else nonTrivialOps->copyConstruct(l, r);
+}
+
+void Type::MoveConstruct(void * l, void * r) const
+{
+    assert(IsMoveConstructible());
+    if(IsTrivial()) memcpy(l, r, size);
+    else nonTrivialOps->moveConstruct(l, r);
 }
 
 void Type::CopyAssign(void * l, const void * r) const
@@ -40,6 +440,97 @@ void Type::MoveAssign(void * l, void * r) const
     else nonTrivialOps->moveAssign(l, r);
 }
 
+void Type::Destruct(void * l) const
+{
+    if(!IsTrivial() && nonTrivialOps->destruct) nonTrivialOps->destruct(l); // Trivial types require no cleanup
+}
+
+std::shared_ptr<void> Function::Invoke(void * args[]) const
+{
+    const auto returnType = GetReturnType();
+    if(returnType.indirection != VarType::None) return std::shared_ptr<void>(Invoke(args, nullptr), [](void *) {}); // Returned references are not owned by the caller
+    if(returnType.type->index == typeid(void)) { Invoke(args, nullptr); return nullptr; }
+    return returnType.type->Construct([this, args](void * l) { Invoke(args, l); });
+}
+
+void * Function::InvokeAndWait(void * args[], void * result) const
+{
+    auto state = InvokeAsync(args);
+    state->Wait();
+    state->TakeValue(result);
+    return result;
+}
+
+std::shared_ptr<FutureState> Function::InvokeAsync(void * args[]) const
+{
+    assert(isAsync);
+    std::shared_ptr<FutureState> state;
+    void * result = &state;
+    thunk(functor.get(), args, &result);
+    return state;
+}
+
+void FutureState::Complete(std::exception_ptr error)
+{
+    std::function<void()> next;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        assert(!isReady);
+        this->error = error;
+        isReady = true;
+        next = move(continuation);
+    }
+    ready.notify_all();
+    if(next) next();
+}
+
+bool FutureState::IsReady() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return isReady;
+}
+
+void FutureState::Wait() const
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this]() { return isReady; });
+}
+
+bool FutureState::OnReady(std::function<void()> continuation)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(isReady) return false;
+    assert(!this->continuation);
+    this->continuation = move(continuation);
+    return true;
+}
+
+uint64_t TypeLibrary::GetSignatureHash() const
+{
+    // Describe every type and function, and sort the descriptions, so that the hash does not depend on the order of binding
+    std::vector<std::string> entries;
+    for(auto & pair : types)
+    {
+        auto & type = pair.second;
+        std::ostringstream ss;
+        ss << "type " << type << ' ' << type.kind << ' ' << type.size << (type.IsTrivial() ? " trivial" : "");
+        for(auto & field : type.fields) ss << ' ' << field.identifier << ':' << field.type;
+        entries.push_back(ss.str());
+    }
+    for(auto & function : functions)
+    {
+        std::ostringstream ss;
+        ss << "func " << function << (function.IsPure() ? " pure" : "") << (function.IsAsync() ? " async" : "");
+        entries.push_back(ss.str());
+    }
+    std::sort(begin(entries), end(entries));
+
+    // Hash the descriptions with 64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(auto & entry : entries) for(auto ch : entry + '\n') hash = (hash ^ static_cast<unsigned char>(ch)) * 1099511628211ULL;
+    return hash;
+}
+
 std::ostream & operator << (std::ostream & out, const Type & type)
 {
     switch(type.kind)